@@ -0,0 +1,173 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * SPI bit rate and delay tuning. Tries the bit rates and delays until
+ * the transfers stop coming back as expected, either from a slave with a
+ * known response or through MISO wired to MOSI.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mcp2210.h"
+
+/* The bit rates tried, slowest first.  */
+
+static const long autotune_rates[] = {
+	10000, 25000, 50000, 100000, 200000, 300000, 500000, 750000,
+	1000000, 1500000, 2000000, 3000000, 4000000, 6000000, 12000000,
+};
+
+#define AUTOTUNE_RATES	(sizeof (autotune_rates) / sizeof (autotune_rates[0]))
+
+/*
+ * The delays tried, in 100 us units, shortest first. The CS delays are
+ * cheap, so they're given a chance before the byte delay.
+ */
+
+static const struct {
+	unsigned int cs;
+	unsigned int byte;
+} autotune_delays[] = {
+	{ 0, 0 }, { 1, 0 }, { 5, 0 }, { 10, 0 }, { 10, 1 }, { 10, 5 },
+};
+
+#define AUTOTUNE_DELAYS	(sizeof (autotune_delays) / sizeof (autotune_delays[0]))
+
+/*
+ * Apply the settings and do the transfer a number of times. Returns
+ * -MCP2210_EVERIFY if the response is not what was expected.
+ */
+
+static int
+autotune_try (int fd, mcp2210_packet spi_packet, const char *tx,
+		const char *expect, char *buf, unsigned short len, int rounds)
+{
+	mcp2210_packet packet;
+	int ret;
+	int i;
+
+	memcpy (packet, spi_packet, MCP2210_PACKET_SIZE);
+	ret = mcp2210_command (fd, packet, MCP2210_SPI_SET);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < rounds; i++) {
+		memcpy (buf, tx, len);
+		ret = mcp2210_spi_transfer (fd, spi_packet, buf, len);
+		if (ret < 0)
+			return ret;
+		if (memcmp (buf, expect, len))
+			return -MCP2210_EVERIFY;
+	}
+
+	return 0;
+}
+
+/* Nanoseconds a transaction is expected to take.  */
+
+static unsigned long long
+autotune_time (mcp2210_packet spi_packet, unsigned short len)
+{
+	return len * 8 * 1000000000ULL / mcp2210_spi_get_bitrate (spi_packet)
+		+ len * mcp2210_spi_get_byte_delay_100us (spi_packet) * 100000ULL
+		+ mcp2210_spi_get_cs_data_delay_100us (spi_packet) * 100000ULL
+		+ mcp2210_spi_get_data_cs_delay_100us (spi_packet) * 100000ULL;
+}
+
+/*
+ * Find the fastest settings the transfer of tx verifies with. The
+ * expected response is compared to expect, or to tx itself if it's NULL.
+ * For each set of delays the bit rate is raised until the transfer fails
+ * in any of the rounds, then lowered by margin steps. The spi_packet holds
+ * the runtime settings to start from; on success it's updated with the
+ * result, which is also applied. Otherwise the original settings are
+ * put back.
+ */
+
+int
+mcp2210_spi_autotune (int fd, mcp2210_packet spi_packet, const char *tx,
+		const char *expect, unsigned short len, int rounds, int margin)
+{
+	unsigned long long best_time = 0, t;
+	mcp2210_packet packet, best;
+	int found = 0;
+	int top, d, r;
+	char *buf;
+	int ret = 0;
+
+	if (expect == NULL)
+		expect = tx;
+
+	buf = malloc (len);
+	if (buf == NULL)
+		return -1;
+
+	memcpy (packet, spi_packet, MCP2210_PACKET_SIZE);
+	mcp2210_spi_set_transaction_size (packet, len);
+
+	for (d = 0; d < AUTOTUNE_DELAYS; d++) {
+		mcp2210_spi_set_cs_data_delay_100us (packet, autotune_delays[d].cs);
+		mcp2210_spi_set_data_cs_delay_100us (packet, autotune_delays[d].cs);
+		mcp2210_spi_set_byte_delay_100us (packet, autotune_delays[d].byte);
+
+		top = -1;
+		for (r = 0; r < AUTOTUNE_RATES; r++) {
+			mcp2210_spi_set_bitrate (packet, autotune_rates[r]);
+			ret = autotune_try (fd, packet, tx, expect, buf, len, rounds);
+			if (ret == -MCP2210_EVERIFY)
+				break;
+			if (ret < 0)
+				goto out;
+			top = r;
+		}
+		ret = 0;
+		if (top < 0)
+			continue;
+
+		r = top - margin < 0 ? 0 : top - margin;
+		mcp2210_spi_set_bitrate (packet, autotune_rates[r]);
+		t = autotune_time (packet, len);
+		if (!found || t < best_time) {
+			memcpy (best, packet, MCP2210_PACKET_SIZE);
+			best_time = t;
+			found = 1;
+		}
+
+		/* Longer delays can't make it any faster. */
+		if (top == AUTOTUNE_RATES - 1)
+			break;
+	}
+
+out:
+	free (buf);
+
+	if (found && ret == 0) {
+		/* Only the timing is changed. */
+		mcp2210_spi_set_transaction_size (best, mcp2210_spi_get_transaction_size (spi_packet));
+		memcpy (spi_packet, best, MCP2210_PACKET_SIZE);
+	}
+
+	memcpy (packet, spi_packet, MCP2210_PACKET_SIZE);
+	r = mcp2210_command (fd, packet, MCP2210_SPI_SET);
+	if (ret == 0 && r < 0)
+		ret = r;
+	else if (ret == 0 && !found)
+		ret = -MCP2210_EVERIFY;
+
+	return ret;
+}
@@ -0,0 +1,221 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * SPI bus arbitration with an external master. Instead of failing with
+ * MCP2210_ESPIBUSY, the work is queued and run once the bus status says
+ * the external master let go of it, polling with a backoff so that the
+ * USB link isn't flooded with status requests meanwhile.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mcp2210.h"
+
+/* Status polling interval bounds, in microseconds.  */
+
+#define BUS_POLL_MIN		1000
+#define BUS_POLL_MAX		64000
+
+struct mcp2210_bus_job {
+	int (*run) (int fd, void *data);
+	void *data;
+	struct mcp2210_bus_job *next;
+};
+
+static unsigned long long
+bus_now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Wait until the SPI bus is not owned by an external master. The status is
+ * polled with the interval doubling up to BUS_POLL_MAX. A negative timeout
+ * waits forever, zero just checks once. The status_packet is left with
+ * the last status. Returns the number of times the bus was found busy, or
+ * -MCP2210_ESPIBUSY if it didn't free up in time. The wait can be
+ * cancelled with the token attached to fd.
+ */
+
+int
+mcp2210_bus_wait (int fd, mcp2210_packet status_packet, int timeout_ms)
+{
+	unsigned long long deadline = bus_now_ns () + timeout_ms * 1000000ULL;
+	long poll = BUS_POLL_MIN;
+	struct timespec wakeup;
+	int busy;
+	int ret;
+
+	for (busy = 0; ; busy++) {
+		/* The polls are spaced from when they're issued. */
+		clock_gettime (CLOCK_MONOTONIC, &wakeup);
+		ret = mcp2210_get_command (fd, status_packet, MCP2210_STATUS_GET);
+		if (ret < 0)
+			return ret;
+		if (mcp2210_status_bus_owner (status_packet) != MCP2210_STATUS_SPI_OWNER_EXT)
+			return busy;
+
+		if (timeout_ms >= 0 && bus_now_ns () >= deadline)
+			return -MCP2210_ESPIBUSY;
+		if (mcp2210_cancelled (fd))
+			return -MCP2210_ECANCELED;
+
+		mcp2210_rt_deadline (&wakeup, poll * 1000ULL);
+		mcp2210_rt_sleep_until (&wakeup);
+		if (poll < BUS_POLL_MAX)
+			poll *= 2;
+	}
+}
+
+/*
+ * Let an external master have the bus. The GP7 pin, if it's assigned the
+ * bus release acknowledge function, is set to ack. Fails with
+ * -MCP2210_ESPIINPROGRESS if a transfer is underway.
+ */
+
+int
+mcp2210_bus_release (int fd, int ack)
+{
+	mcp2210_packet packet = { 0, };
+
+	packet[1] = ack;
+	return mcp2210_command (fd, packet, MCP2210_GP7_SPI_RELEASE);
+}
+
+/*
+ * Set up an empty queue. The jobs wait up to timeout_ms for the bus, see
+ * mcp2210_bus_wait(). Unless release is -1, the bus is released with
+ * the acknowledge value of release once the jobs are done.
+ */
+
+void
+mcp2210_bus_init (struct mcp2210_bus *bus, int timeout_ms, int release)
+{
+	memset (bus, 0, sizeof (*bus));
+	bus->timeout_ms = timeout_ms;
+	bus->release = release;
+}
+
+/*
+ * Add a job to be run once the bus is available. The job is called with
+ * the fd passed to mcp2210_bus_run() and the data. It should return zero
+ * or a negative error code; if it fails with -MCP2210_ESPIBUSY because an
+ * external master took the bus first, it's run again once it's free.
+ */
+
+int
+mcp2210_bus_queue (struct mcp2210_bus *bus, int (*run) (int fd, void *data), void *data)
+{
+	struct mcp2210_bus_job *job;
+
+	job = malloc (sizeof (*job));
+	if (job == NULL)
+		return -1;
+
+	job->run = run;
+	job->data = data;
+	job->next = NULL;
+	if (bus->tail)
+		bus->tail->next = job;
+	else
+		bus->head = job;
+	bus->tail = job;
+
+	return 0;
+}
+
+static void
+bus_pop (struct mcp2210_bus *bus)
+{
+	struct mcp2210_bus_job *job = bus->head;
+
+	bus->head = job->next;
+	if (bus->head == NULL)
+		bus->tail = NULL;
+	free (job);
+}
+
+/*
+ * Run the queued jobs in order, each one as soon as the bus is free. The
+ * time spent waiting is accounted in the bus structure. With a zero
+ * timeout the jobs are just run, without checking the bus status first.
+ * On error the failed job is dropped and the following ones stay queued.
+ * Once the queue is empty, the bus is released if the bus was set up to.
+ */
+
+int
+mcp2210_bus_run (struct mcp2210_bus *bus, int fd)
+{
+	mcp2210_packet status_packet;
+	struct timespec deadline;
+	unsigned long long t;
+	int races = 0;
+	int ret;
+
+	while (bus->head) {
+		ret = 0;
+		t = bus_now_ns ();
+		if (bus->timeout_ms != 0)
+			ret = mcp2210_bus_wait (fd, status_packet, bus->timeout_ms);
+		t = bus_now_ns () - t;
+
+		if (ret > 0 || ret == -MCP2210_ESPIBUSY) {
+			bus->waits++;
+			bus->wait_ns += t;
+			if (t > bus->max_wait_ns)
+				bus->max_wait_ns = t;
+		}
+
+		if (ret >= 0) {
+			clock_gettime (CLOCK_MONOTONIC, &deadline);
+			ret = bus->head->run (fd, bus->head->data);
+			if (ret == -MCP2210_ESPIBUSY && bus->timeout_ms != 0) {
+				/* Lost the race for the bus; back off and try again. */
+				mcp2210_rt_deadline (&deadline, (BUS_POLL_MIN << (races < 6 ? races : 6)) * 1000ULL);
+				mcp2210_rt_sleep_until (&deadline);
+				races++;
+				continue;
+			}
+		}
+		bus_pop (bus);
+		races = 0;
+		if (ret < 0)
+			return ret;
+	}
+
+	if (bus->release >= 0)
+		return mcp2210_bus_release (fd, bus->release);
+
+	return 0;
+}
+
+/*
+ * Drop the queued jobs without running them.
+ */
+
+void
+mcp2210_bus_clear (struct mcp2210_bus *bus)
+{
+	while (bus->head)
+		bus_pop (bus);
+}
@@ -0,0 +1,375 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Settings cache. The settings read from a device are kept in a file
+ * named after its USB IDs and serial number, so that the next session
+ * can start without reading them again. The cached settings are checked
+ * with a single command before they're first used.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mcp2210.h"
+
+#define CACHE_MAGIC		"M2CC"
+#define CACHE_VERSION		1
+
+/*
+ * The settings that only change when they're set. The status and the
+ * GPIO pins are always read from the device, and so are the runtime SPI
+ * settings: a reset puts them back to the NVRAM ones without touching
+ * the chip settings the cache is checked with, and the transfers change
+ * the transaction size all the time.
+ */
+
+#define CACHE_SECTIONS		((1 << MCP2210_STATE_CHIP) | \
+				 (1 << MCP2210_STATE_NVRAM_SPI) | \
+				 (1 << MCP2210_STATE_NVRAM_CHIP) | \
+				 (1 << MCP2210_STATE_NVRAM_USB_KEY) | \
+				 (1 << MCP2210_STATE_NVRAM_PRODUCT) | \
+				 (1 << MCP2210_STATE_NVRAM_MANUFACT))
+
+/*
+ * The file is a single entry. A torn write fails the CRC and the entry is
+ * treated as missing. The fields are in the host byte order.
+ */
+
+struct cache_entry {
+	char magic[4];
+	unsigned int version;
+	unsigned long long generation;
+	struct mcp2210_device_id id;
+	unsigned int sections;
+	unsigned int crc;
+	struct mcp2210_state state;
+};
+
+struct mcp2210_cache {
+	int fd;
+	char *path;
+	struct mcp2210_device_id id;
+
+	/* What the file had, and what it's compared to on the device. */
+	struct cache_entry entry;
+
+	/* The sections read or set in this session. */
+	unsigned int fresh;
+	int probed;
+	int invalidated;
+
+	struct mcp2210_cache_stats stats;
+};
+
+static const unsigned short cache_get[MCP2210_STATE_PACKETS] = {
+	[MCP2210_STATE_STATUS] = MCP2210_STATUS_GET,
+	[MCP2210_STATE_SPI] = MCP2210_SPI_GET,
+	[MCP2210_STATE_GPIO_VAL] = MCP2210_GPIO_VAL_GET,
+	[MCP2210_STATE_GPIO_DIR] = MCP2210_GPIO_DIR_GET,
+	[MCP2210_STATE_CHIP] = MCP2210_CHIP_GET,
+};
+
+static const unsigned short cache_nvram[MCP2210_STATE_PACKETS] = {
+	[MCP2210_STATE_NVRAM_SPI] = MCP2210_NVRAM_PARAM_SPI,
+	[MCP2210_STATE_NVRAM_CHIP] = MCP2210_NVRAM_PARAM_CHIP,
+	[MCP2210_STATE_NVRAM_USB_KEY] = MCP2210_NVRAM_PARAM_USB_KEY,
+	[MCP2210_STATE_NVRAM_PRODUCT] = MCP2210_NVRAM_PARAM_PRODUCT,
+	[MCP2210_STATE_NVRAM_MANUFACT] = MCP2210_NVRAM_PARAM_MANUFACT,
+};
+
+static unsigned int
+cache_crc (struct cache_entry *entry)
+{
+	unsigned int saved = entry->crc;
+	unsigned int crc;
+
+	entry->crc = 0;
+	crc = mcp2210_crc32c (0, entry, sizeof (*entry));
+	entry->crc = saved;
+
+	return crc;
+}
+
+/*
+ * Read the entry of the device from the file, or leave it empty if there
+ * is none or it's not usable.
+ */
+
+static void
+cache_load (int fd, const struct mcp2210_device_id *id, struct cache_entry *entry)
+{
+	if (pread (fd, entry, sizeof (*entry), 0) == sizeof (*entry)
+	    && memcmp (entry->magic, CACHE_MAGIC, sizeof (entry->magic)) == 0
+	    && entry->version == CACHE_VERSION
+	    && memcmp (&entry->id, id, sizeof (*id)) == 0
+	    && entry->crc == cache_crc (entry))
+		return;
+
+	memset (entry, 0, sizeof (*entry));
+}
+
+/*
+ * Open the cache of the device at fd in the directory dir, which is
+ * created if needed. Nothing is issued to the device yet.
+ */
+
+struct mcp2210_cache *
+mcp2210_cache_open (int fd, const char *dir)
+{
+	struct mcp2210_cache *cache;
+	char name[sizeof (cache->id.serial) + 16];
+	int i;
+
+	cache = calloc (1, sizeof (*cache));
+	if (cache == NULL)
+		return NULL;
+	cache->fd = fd;
+
+	if (mcp2210_device_id (fd, &cache->id) == -1)
+		goto err;
+	if (cache->id.serial[0] == '\0') {
+		errno = ENOENT;
+		goto err;
+	}
+
+	/* The serial number is up to the device; keep it a plain name. */
+	snprintf (name, sizeof (name), "%04x-%04x-%s",
+		cache->id.vendor, cache->id.product, cache->id.serial);
+	for (i = 10; name[i]; i++) {
+		if (name[i] == '/' || name[i] == '.' || (unsigned char)name[i] < ' ')
+			name[i] = '_';
+	}
+
+	if (mkdir (dir, 0755) == -1 && errno != EEXIST)
+		goto err;
+	cache->path = malloc (strlen (dir) + strlen (name) + 2);
+	if (cache->path == NULL)
+		goto err;
+	sprintf (cache->path, "%s/%s", dir, name);
+
+	fd = open (cache->path, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		flock (fd, LOCK_SH);
+		cache_load (fd, &cache->id, &cache->entry);
+		close (fd);
+	} else if (errno != ENOENT) {
+		goto err;
+	}
+	cache->entry.sections &= CACHE_SECTIONS;
+	cache->stats.generation = cache->entry.generation;
+
+	return cache;
+
+err:
+	free (cache->path);
+	free (cache);
+	return NULL;
+}
+
+/*
+ * The runtime chip settings are compared with the cached ones. They're
+ * what a reset of the device or another program is most likely to have
+ * changed. If they differ, the rest is not trusted either.
+ */
+
+static int
+cache_probe (struct mcp2210_cache *cache)
+{
+	struct mcp2210_state *state = &cache->entry.state;
+	mcp2210_packet packet;
+	int ret;
+
+	ret = mcp2210_get_command (cache->fd, packet, MCP2210_CHIP_GET);
+	if (ret < 0)
+		return ret;
+	cache->probed = 1;
+
+	if (cache->entry.sections & (1 << MCP2210_STATE_CHIP)) {
+		cache->stats.probes++;
+		if (mcp2210_settings_cmp (packet, state->packets[MCP2210_STATE_CHIP],
+					  MCP2210_NVRAM_PARAM_CHIP))
+			cache->entry.sections = 0;
+	} else {
+		/* Nothing to check against; keep it for the next time. */
+		cache->entry.sections = 0;
+		cache->stats.misses++;
+	}
+
+	if (cache->entry.sections == 0 && cache->entry.generation) {
+		cache->invalidated = 1;
+		cache->stats.invalidations++;
+	}
+
+	memcpy (state->packets[MCP2210_STATE_CHIP], packet, MCP2210_PACKET_SIZE);
+	cache->entry.sections |= 1 << MCP2210_STATE_CHIP;
+	cache->fresh |= 1 << MCP2210_STATE_CHIP;
+
+	return 0;
+}
+
+/*
+ * Get a section of the state, MCP2210_STATE_*, from the cache if it's
+ * there, or from the device otherwise.
+ */
+
+int
+mcp2210_cache_get (struct mcp2210_cache *cache, int section, mcp2210_packet packet)
+{
+	struct mcp2210_state *state = &cache->entry.state;
+	int ret;
+
+	if (section < 0 || section >= MCP2210_STATE_PACKETS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!(CACHE_SECTIONS & (1 << section))) {
+		memset (packet, 0, MCP2210_PACKET_SIZE);
+		return mcp2210_command (cache->fd, packet, cache_get[section]);
+	}
+
+	if (!cache->probed) {
+		ret = cache_probe (cache);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (cache->entry.sections & (1 << section)) {
+		memcpy (packet, state->packets[section], MCP2210_PACKET_SIZE);
+		cache->stats.hits++;
+		return 0;
+	}
+
+	if (cache_nvram[section])
+		ret = mcp2210_get_nvram (cache->fd, packet, cache_nvram[section]);
+	else
+		ret = mcp2210_get_command (cache->fd, packet, cache_get[section]);
+	if (ret < 0)
+		return ret;
+	cache->stats.misses++;
+
+	memcpy (state->packets[section], packet, MCP2210_PACKET_SIZE);
+	cache->entry.sections |= 1 << section;
+	cache->fresh |= 1 << section;
+
+	return 0;
+}
+
+/*
+ * Record the settings of a section that were set on the device, in the
+ * layout of the response to the command that reads them. A NULL packet
+ * drops the section, so that it's read from the device next time.
+ */
+
+void
+mcp2210_cache_put (struct mcp2210_cache *cache, int section, const mcp2210_packet packet)
+{
+	struct mcp2210_state *state = &cache->entry.state;
+
+	if (section < 0 || section >= MCP2210_STATE_PACKETS
+	    || !(CACHE_SECTIONS & (1 << section)))
+		return;
+
+	if (packet == NULL) {
+		cache->entry.sections &= ~(1 << section);
+		cache->fresh |= 1 << section;
+		return;
+	}
+
+	memcpy (state->packets[section], packet, MCP2210_PACKET_SIZE);
+	state->packets[section][0] = cache_nvram[section] ? MCP2210_NVRAM_GET : cache_get[section];
+	cache->entry.sections |= 1 << section;
+	cache->fresh |= 1 << section;
+}
+
+void
+mcp2210_cache_get_stats (struct mcp2210_cache *cache, struct mcp2210_cache_stats *stats)
+{
+	*stats = cache->stats;
+}
+
+/*
+ * Write the sections read or set in this session to the file and free the
+ * cache. The sections another session wrote in the meantime are kept,
+ * unless this one found the cache out of date. The generation goes up
+ * each time the settings in the file change.
+ */
+
+int
+mcp2210_cache_close (struct mcp2210_cache *cache)
+{
+	struct cache_entry *cur = &cache->entry;
+	struct cache_entry disk;
+	unsigned int sections;
+	ssize_t written;
+	int ret = 0;
+	int fd;
+	int i;
+
+	if (cache->fresh == 0)
+		goto out;
+
+	fd = open (cache->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		ret = -1;
+		goto out;
+	}
+	flock (fd, LOCK_EX);
+	cache_load (fd, &cache->id, &disk);
+
+	sections = cache->invalidated ? 0 : disk.sections & CACHE_SECTIONS;
+	sections &= ~cache->fresh;
+	for (i = 0; i < MCP2210_STATE_PACKETS; i++) {
+		if (sections & (1 << i))
+			memcpy (cur->state.packets[i], disk.state.packets[i], MCP2210_PACKET_SIZE);
+		else if (!(cur->sections & (1 << i)))
+			memset (cur->state.packets[i], 0, MCP2210_PACKET_SIZE);
+	}
+	sections |= cur->sections & cache->fresh;
+	memcpy (cur->state.magic, MCP2210_STATE_MAGIC, sizeof (cur->state.magic));
+	cur->state.version = MCP2210_STATE_VERSION;
+
+	if (sections == disk.sections
+	    && memcmp (&cur->state, &disk.state, sizeof (cur->state)) == 0)
+		goto unlock;
+
+	memcpy (cur->magic, CACHE_MAGIC, sizeof (cur->magic));
+	cur->version = CACHE_VERSION;
+	cur->generation = disk.generation + 1;
+	cur->id = cache->id;
+	cur->sections = sections;
+	cur->crc = cache_crc (cur);
+
+	written = pwrite (fd, cur, sizeof (*cur), 0);
+	if (written >= 0 && written != sizeof (*cur))
+		errno = ENOSPC;
+	if (written != sizeof (*cur) || ftruncate (fd, sizeof (*cur)) == -1)
+		ret = -1;
+
+unlock:
+	close (fd);
+out:
+	free (cache->path);
+	free (cache);
+	return ret;
+}
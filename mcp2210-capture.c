@@ -0,0 +1,632 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Capture files for long acquisitions. The records are collected into
+ * chunks that a thread compresses and appends to the file, so that the
+ * acquisition doesn't wait for the disk. An index of the chunks at the
+ * end of the file lets the readers go straight to the chunk with the
+ * records of a point in time.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "mcp2210.h"
+
+/* The chunks filled and not yet written.  */
+
+#define CAPTURE_BLOCKS		4
+
+#define CHUNK_HEADER		sizeof (struct mcp2210_capture_chunk)
+#define RECORD_HEADER		sizeof (struct mcp2210_capture_record)
+
+struct capture_block {
+	/* The data, with room for the chunk header in front of it. */
+	unsigned char *buf;
+	size_t len;
+	unsigned int records;
+	unsigned long long first_ns;
+	unsigned long long last_ns;
+};
+
+struct mcp2210_capture {
+	int fd;
+	int writing;
+	unsigned int flags;
+	size_t chunk_size;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* A ring of the full chunks, followed by the one being filled. */
+	struct capture_block blocks[CAPTURE_BLOCKS];
+	int head;
+	int count;
+	int fill;
+	int error;
+	int stop;
+
+	/* The chunks written so far. */
+	struct mcp2210_capture_index *index;
+	unsigned long long chunks;
+	unsigned long long alloc;
+	unsigned long long offset;
+
+	/* The compressed chunk being written or read. */
+	unsigned char *out;
+	size_t out_size;
+
+	/* The chunk being read. */
+	unsigned long long next;
+	unsigned char *raw;
+	size_t raw_size;
+	size_t raw_len;
+	size_t pos;
+	unsigned long long from_ns;
+};
+
+static int
+write_all (int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write (fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+read_all (int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pread (fd, buf, len, offset);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0) {
+			errno = EBADMSG;
+			return -1;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+static int
+capture_add_index (struct mcp2210_capture *cap, const struct mcp2210_capture_chunk *chunk,
+		unsigned long long offset)
+{
+	struct mcp2210_capture_index *index;
+
+	if (cap->chunks == cap->alloc) {
+		cap->alloc = cap->alloc ? cap->alloc * 2 : 64;
+		index = realloc (cap->index, cap->alloc * sizeof (*index));
+		if (index == NULL)
+			return -1;
+		cap->index = index;
+	}
+
+	index = &cap->index[cap->chunks++];
+	index->offset = offset;
+	index->first_ns = chunk->first_ns;
+	index->last_ns = chunk->last_ns;
+
+	return 0;
+}
+
+/*
+ * Compress the chunk, unless it doesn't get any smaller, and append it
+ * to the file with a single write.
+ */
+
+static int
+capture_write_chunk (struct mcp2210_capture *cap, struct capture_block *block)
+{
+	struct mcp2210_capture_chunk chunk = { { 0, }, };
+	unsigned char *buf = block->buf;
+	uLongf size = cap->out_size - CHUNK_HEADER;
+
+	memcpy (chunk.magic, MCP2210_CAPTURE_CHUNK_MAGIC, sizeof (chunk.magic));
+	chunk.raw_size = block->len;
+	chunk.size = block->len;
+	chunk.records = block->records;
+	chunk.first_ns = block->first_ns;
+	chunk.last_ns = block->last_ns;
+
+	if (cap->flags & MCP2210_CAPTURE_COMPRESS
+	    && compress2 (&cap->out[CHUNK_HEADER], &size, &block->buf[CHUNK_HEADER],
+	                  block->len, Z_BEST_SPEED) == Z_OK
+	    && size < block->len) {
+		chunk.flags |= MCP2210_CAPTURE_COMPRESS;
+		chunk.size = size;
+		buf = cap->out;
+	}
+	chunk.crc = mcp2210_crc32c (0, &buf[CHUNK_HEADER], chunk.size);
+	memcpy (buf, &chunk, CHUNK_HEADER);
+
+	if (write_all (cap->fd, buf, CHUNK_HEADER + chunk.size) == -1)
+		return -1;
+	if (capture_add_index (cap, &chunk, cap->offset) == -1)
+		return -1;
+	cap->offset += CHUNK_HEADER + chunk.size;
+
+	return 0;
+}
+
+/*
+ * The consumer. Writes the full chunks until told to stop or until a
+ * write fails.
+ */
+
+static void *
+capture_writer (void *data)
+{
+	struct mcp2210_capture *cap = data;
+	struct capture_block *block;
+	int ret;
+
+	pthread_mutex_lock (&cap->lock);
+	while (1) {
+		while (cap->count == 0 && !cap->stop)
+			pthread_cond_wait (&cap->cond, &cap->lock);
+		if (cap->count == 0)
+			break;
+		block = &cap->blocks[cap->head];
+		pthread_mutex_unlock (&cap->lock);
+
+		ret = capture_write_chunk (cap, block);
+
+		pthread_mutex_lock (&cap->lock);
+		if (ret == -1) {
+			cap->error = errno;
+			break;
+		}
+		cap->head = (cap->head + 1) % CAPTURE_BLOCKS;
+		cap->count--;
+		pthread_cond_signal (&cap->cond);
+	}
+	pthread_cond_signal (&cap->cond);
+	pthread_mutex_unlock (&cap->lock);
+
+	return NULL;
+}
+
+static void
+capture_free (struct mcp2210_capture *cap)
+{
+	int i;
+
+	for (i = 0; i < CAPTURE_BLOCKS; i++)
+		free (cap->blocks[i].buf);
+	free (cap->index);
+	free (cap->out);
+	free (cap->raw);
+	if (cap->fd != -1)
+		close (cap->fd);
+	free (cap);
+}
+
+/*
+ * Start a capture at path, with chunks of up to chunk_size bytes of
+ * records, or MCP2210_CAPTURE_CHUNK if it's zero. The flags can ask for
+ * the chunks to be compressed.
+ */
+
+struct mcp2210_capture *
+mcp2210_capture_create (const char *path, unsigned int flags, size_t chunk_size)
+{
+	struct mcp2210_capture_header header = { { 0, }, };
+	struct mcp2210_capture *cap;
+	int i;
+
+	if (chunk_size == 0)
+		chunk_size = MCP2210_CAPTURE_CHUNK;
+	if (chunk_size <= RECORD_HEADER || chunk_size > 1U << 30) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cap = calloc (1, sizeof (*cap));
+	if (cap == NULL)
+		return NULL;
+	cap->fd = -1;
+	cap->writing = 1;
+	cap->flags = flags;
+	cap->chunk_size = chunk_size;
+
+	cap->out_size = CHUNK_HEADER + compressBound (chunk_size);
+	cap->out = malloc (cap->out_size);
+	if (cap->out == NULL)
+		goto err;
+	for (i = 0; i < CAPTURE_BLOCKS; i++) {
+		cap->blocks[i].buf = malloc (CHUNK_HEADER + chunk_size);
+		if (cap->blocks[i].buf == NULL)
+			goto err;
+	}
+
+	cap->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (cap->fd == -1)
+		goto err;
+
+	/* The index is filled in once it's written. */
+	memcpy (header.magic, MCP2210_CAPTURE_MAGIC, sizeof (header.magic));
+	header.version = MCP2210_CAPTURE_VERSION;
+	header.flags = flags;
+	if (write_all (cap->fd, (unsigned char *)&header, sizeof (header)) == -1)
+		goto err;
+	cap->offset = sizeof (header);
+
+	pthread_mutex_init (&cap->lock, NULL);
+	pthread_cond_init (&cap->cond, NULL);
+	errno = pthread_create (&cap->thread, NULL, capture_writer, cap);
+	if (errno)
+		goto err;
+
+	return cap;
+err:
+	capture_free (cap);
+	return NULL;
+}
+
+/*
+ * Queue the chunk being filled for writing, waiting for a free one if
+ * the writer is behind.
+ */
+
+static int
+capture_submit (struct mcp2210_capture *cap)
+{
+	int ret = 0;
+
+	pthread_mutex_lock (&cap->lock);
+	if (cap->error == 0) {
+		cap->count++;
+		pthread_cond_signal (&cap->cond);
+		while (cap->count == CAPTURE_BLOCKS && cap->error == 0)
+			pthread_cond_wait (&cap->cond, &cap->lock);
+	}
+	if (cap->error) {
+		errno = cap->error;
+		ret = -1;
+	}
+	pthread_mutex_unlock (&cap->lock);
+
+	if (ret == 0) {
+		cap->fill = (cap->fill + 1) % CAPTURE_BLOCKS;
+		cap->blocks[cap->fill].len = 0;
+		cap->blocks[cap->fill].records = 0;
+	}
+
+	return ret;
+}
+
+/*
+ * Add a record with len bytes of data. The records are expected to come
+ * in the order of their time stamps.
+ */
+
+int
+mcp2210_capture_write (struct mcp2210_capture *cap, const struct mcp2210_capture_record *rec, const void *data)
+{
+	struct mcp2210_capture_record r = *rec;
+	struct capture_block *block;
+	size_t need = RECORD_HEADER + rec->len;
+
+	if (need > cap->chunk_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	block = &cap->blocks[cap->fill];
+	if (block->len + need > cap->chunk_size) {
+		if (capture_submit (cap) == -1)
+			return -1;
+		block = &cap->blocks[cap->fill];
+	}
+
+	/* The records are packed, not aligned. */
+	memset (r.reserved, 0, sizeof (r.reserved));
+	memcpy (&block->buf[CHUNK_HEADER + block->len], &r, RECORD_HEADER);
+	memcpy (&block->buf[CHUNK_HEADER + block->len + RECORD_HEADER], data, rec->len);
+
+	if (block->records == 0)
+		block->first_ns = rec->time_ns;
+	block->last_ns = rec->time_ns;
+	block->records++;
+	block->len += need;
+
+	return 0;
+}
+
+/*
+ * Hand the records collected so far to the writer, rather than waiting
+ * for the chunk to fill up.
+ */
+
+int
+mcp2210_capture_flush (struct mcp2210_capture *cap)
+{
+	if (cap->blocks[cap->fill].len == 0)
+		return 0;
+	return capture_submit (cap);
+}
+
+/*
+ * Write the rest of the records and the index of the chunks, or just free
+ * the reader.
+ */
+
+int
+mcp2210_capture_close (struct mcp2210_capture *cap)
+{
+	struct mcp2210_capture_header header;
+	int ret = 0;
+
+	if (!cap->writing) {
+		capture_free (cap);
+		return 0;
+	}
+
+	ret = mcp2210_capture_flush (cap);
+
+	pthread_mutex_lock (&cap->lock);
+	cap->stop = 1;
+	pthread_cond_signal (&cap->cond);
+	pthread_mutex_unlock (&cap->lock);
+	pthread_join (cap->thread, NULL);
+	pthread_mutex_destroy (&cap->lock);
+	pthread_cond_destroy (&cap->cond);
+
+	if (ret == 0 && cap->error) {
+		errno = cap->error;
+		ret = -1;
+	}
+
+	if (ret == 0) {
+		ret = write_all (cap->fd, (unsigned char *)cap->index, cap->chunks * sizeof (*cap->index));
+		memset (&header, 0, sizeof (header));
+		memcpy (header.magic, MCP2210_CAPTURE_MAGIC, sizeof (header.magic));
+		header.version = MCP2210_CAPTURE_VERSION;
+		header.flags = cap->flags;
+		header.index_offset = cap->offset;
+		header.chunks = cap->chunks;
+		if (ret == 0 && pwrite (cap->fd, &header, sizeof (header), 0) != sizeof (header))
+			ret = -1;
+	}
+
+	if (close (cap->fd) == -1)
+		ret = -1;
+	cap->fd = -1;
+	capture_free (cap);
+
+	return ret;
+}
+
+/*
+ * Find the chunks of a capture that was not closed, such as one whose
+ * writer crashed, by walking their headers.
+ */
+
+static int
+capture_rebuild_index (struct mcp2210_capture *cap)
+{
+	struct mcp2210_capture_chunk chunk;
+	off_t offset = sizeof (struct mcp2210_capture_header);
+
+	while (pread (cap->fd, &chunk, CHUNK_HEADER, offset) == CHUNK_HEADER) {
+		if (memcmp (chunk.magic, MCP2210_CAPTURE_CHUNK_MAGIC, sizeof (chunk.magic)) != 0)
+			break;
+		if (capture_add_index (cap, &chunk, offset) == -1)
+			return -1;
+		offset += CHUNK_HEADER + chunk.size;
+	}
+
+	return 0;
+}
+
+/*
+ * Open the capture at path for reading, from the start.
+ */
+
+struct mcp2210_capture *
+mcp2210_capture_open (const char *path)
+{
+	struct mcp2210_capture_header header;
+	struct mcp2210_capture *cap;
+
+	cap = calloc (1, sizeof (*cap));
+	if (cap == NULL)
+		return NULL;
+
+	cap->fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (cap->fd == -1)
+		goto err;
+
+	if (read_all (cap->fd, &header, sizeof (header), 0) == -1)
+		goto err;
+	if (memcmp (header.magic, MCP2210_CAPTURE_MAGIC, sizeof (header.magic)) != 0
+	    || header.version != MCP2210_CAPTURE_VERSION) {
+		errno = EINVAL;
+		goto err;
+	}
+	cap->flags = header.flags;
+
+	if (header.index_offset) {
+		cap->chunks = cap->alloc = header.chunks;
+		cap->index = malloc (header.chunks * sizeof (*cap->index));
+		if (cap->index == NULL && header.chunks)
+			goto err;
+		if (read_all (cap->fd, cap->index, header.chunks * sizeof (*cap->index),
+		              header.index_offset) == -1)
+			goto err;
+	} else if (capture_rebuild_index (cap) == -1) {
+		goto err;
+	}
+
+	return cap;
+err:
+	capture_free (cap);
+	return NULL;
+}
+
+/*
+ * The chunks in the capture, with their offsets and time spans.
+ */
+
+const struct mcp2210_capture_index *
+mcp2210_capture_get_index (struct mcp2210_capture *cap, unsigned long long *chunks)
+{
+	*chunks = cap->chunks;
+	return cap->index;
+}
+
+/*
+ * Continue reading with the first record not older than time_ns. Only
+ * the chunks that may contain it are read.
+ */
+
+void
+mcp2210_capture_seek (struct mcp2210_capture *cap, unsigned long long time_ns)
+{
+	unsigned long long lo = 0, hi = cap->chunks, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cap->index[mid].last_ns < time_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	cap->next = lo;
+	cap->raw_len = cap->pos = 0;
+	cap->from_ns = time_ns;
+}
+
+static int
+capture_grow (unsigned char **buf, size_t *size, size_t need)
+{
+	unsigned char *p;
+
+	if (need <= *size)
+		return 0;
+	p = realloc (*buf, need);
+	if (p == NULL)
+		return -1;
+	*buf = p;
+	*size = need;
+
+	return 0;
+}
+
+static int
+capture_read_chunk (struct mcp2210_capture *cap, unsigned long long n)
+{
+	struct mcp2210_capture_chunk chunk;
+	off_t offset = cap->index[n].offset;
+	uLongf len;
+
+	if (read_all (cap->fd, &chunk, CHUNK_HEADER, offset) == -1)
+		return -1;
+	if (memcmp (chunk.magic, MCP2210_CAPTURE_CHUNK_MAGIC, sizeof (chunk.magic)) != 0) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	if (capture_grow (&cap->out, &cap->out_size, chunk.size) == -1
+	    || capture_grow (&cap->raw, &cap->raw_size, chunk.raw_size) == -1)
+		return -1;
+	if (read_all (cap->fd, cap->out, chunk.size, offset + CHUNK_HEADER) == -1)
+		return -1;
+	if (mcp2210_crc32c (0, cap->out, chunk.size) != chunk.crc) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	if (chunk.flags & MCP2210_CAPTURE_COMPRESS) {
+		len = chunk.raw_size;
+		if (uncompress (cap->raw, &len, cap->out, chunk.size) != Z_OK || len != chunk.raw_size) {
+			errno = EBADMSG;
+			return -1;
+		}
+	} else {
+		memcpy (cap->raw, cap->out, chunk.size);
+	}
+
+	cap->raw_len = chunk.raw_size;
+	cap->pos = 0;
+
+	return 0;
+}
+
+/*
+ * Read the next record, pointing data to its data, which stays valid
+ * until the next call. Returns one if there was a record and zero at the
+ * end of the capture.
+ */
+
+int
+mcp2210_capture_read (struct mcp2210_capture *cap, struct mcp2210_capture_record *rec, const void **data)
+{
+	while (1) {
+		if (cap->pos == cap->raw_len) {
+			if (cap->next == cap->chunks)
+				return 0;
+			if (capture_read_chunk (cap, cap->next) == -1)
+				return -1;
+			cap->next++;
+		}
+
+		if (cap->raw_len - cap->pos < RECORD_HEADER) {
+			errno = EBADMSG;
+			return -1;
+		}
+		memcpy (rec, &cap->raw[cap->pos], RECORD_HEADER);
+		if (cap->raw_len - cap->pos - RECORD_HEADER < rec->len) {
+			errno = EBADMSG;
+			return -1;
+		}
+		*data = &cap->raw[cap->pos + RECORD_HEADER];
+		cap->pos += RECORD_HEADER + rec->len;
+
+		if (rec->time_ns >= cap->from_ns)
+			return 1;
+	}
+}
@@ -0,0 +1,749 @@
+/*
+ * MCP2210 USB SPI bridge library, C++ coroutine interface
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * The commands are issued without blocking the thread: a conversation
+ * with a device is a coroutine that is suspended while the device is
+ * busy, and resumed by a reactor built on epoll once the descriptor is
+ * ready. Any number of threads can run the reactor.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MCP2210_CORO_HPP
+#define __MCP2210_CORO_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "mcp2210.hpp"
+
+namespace mcp2210 {
+
+template <class T = void>
+class task;
+
+namespace detail {
+
+struct task_promise_base {
+	/* Whoever awaits the task is resumed once it's over. */
+	struct final_awaiter {
+		bool
+		await_ready () noexcept
+		{
+			return false;
+		}
+
+		template <class P>
+		std::coroutine_handle<>
+		await_suspend (std::coroutine_handle<P> h) noexcept
+		{
+			return h.promise ().continuation;
+		}
+
+		void
+		await_resume () noexcept {}
+	};
+
+	std::suspend_always
+	initial_suspend () noexcept
+	{
+		return {};
+	}
+
+	final_awaiter
+	final_suspend () noexcept
+	{
+		return {};
+	}
+
+	void
+	unhandled_exception () noexcept
+	{
+		exception = std::current_exception ();
+	}
+
+	std::coroutine_handle<> continuation = std::noop_coroutine ();
+	std::exception_ptr exception;
+};
+
+template <class T>
+struct task_promise : task_promise_base {
+	task<T> get_return_object () noexcept;
+
+	template <class U>
+	void
+	return_value (U &&val)
+	{
+		value.emplace (std::forward<U> (val));
+	}
+
+	T
+	result ()
+	{
+		if (exception)
+			std::rethrow_exception (exception);
+		return std::move (*value);
+	}
+
+	std::optional<T> value;
+};
+
+template <>
+struct task_promise<void> : task_promise_base {
+	task<void> get_return_object () noexcept;
+
+	void
+	return_void () noexcept {}
+
+	void
+	result ()
+	{
+		if (exception)
+			std::rethrow_exception (exception);
+	}
+};
+
+} /* namespace detail */
+
+/*
+ * A coroutine that starts once it's awaited and hands its result or
+ * exception over to the awaiting one.
+ */
+
+template <class T>
+class task {
+public:
+	using promise_type = detail::task_promise<T>;
+
+	task (task &&other) noexcept
+		: h_ (std::exchange (other.h_, nullptr)) {}
+
+	task (const task &) = delete;
+	task &operator= (const task &) = delete;
+
+	~task ()
+	{
+		if (h_)
+			h_.destroy ();
+	}
+
+	bool
+	await_ready () const noexcept
+	{
+		return false;
+	}
+
+	std::coroutine_handle<>
+	await_suspend (std::coroutine_handle<> caller) noexcept
+	{
+		h_.promise ().continuation = caller;
+		return h_;
+	}
+
+	T
+	await_resume ()
+	{
+		return h_.promise ().result ();
+	}
+
+private:
+	friend promise_type;
+
+	explicit task (std::coroutine_handle<promise_type> h) noexcept
+		: h_ (h) {}
+
+	std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+
+template <class T>
+inline task<T>
+task_promise<T>::get_return_object () noexcept
+{
+	return task<T> (std::coroutine_handle<task_promise<T>>::from_promise (*this));
+}
+
+inline task<void>
+task_promise<void>::get_return_object () noexcept
+{
+	return task<void> (std::coroutine_handle<task_promise<void>>::from_promise (*this));
+}
+
+/* A coroutine nobody awaits, that frees itself once it's over. */
+struct detached {
+	struct promise_type {
+		detached
+		get_return_object () noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never
+		initial_suspend () noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never
+		final_suspend () noexcept
+		{
+			return {};
+		}
+
+		void
+		return_void () noexcept {}
+
+		void
+		unhandled_exception () noexcept
+		{
+			std::terminate ();
+		}
+	};
+};
+
+} /* namespace detail */
+
+/*
+ * The reactor resumes the coroutines waiting for their descriptors. The
+ * descriptors are registered as one-shot, so that a coroutine is resumed
+ * by a single thread even if several of them run the reactor.
+ */
+
+class reactor {
+public:
+	/* A coroutine waiting for a descriptor. */
+	struct watch {
+		std::atomic<void *> handle {nullptr};
+		bool added = false;
+	};
+
+	class wait_op {
+	public:
+		wait_op (reactor &r, int fd, watch &w, unsigned int events) noexcept
+			: r_ (r), fd_ (fd), w_ (w), events_ (events) {}
+
+		bool
+		await_ready () const noexcept
+		{
+			return false;
+		}
+
+		/* Once armed, another thread may resume the coroutine. */
+		bool
+		await_suspend (std::coroutine_handle<> h) noexcept
+		{
+			if (r_.arm (fd_, w_, events_, h) == -1) {
+				err_ = errno;
+				return false;
+			}
+			return true;
+		}
+
+		void
+		await_resume () const
+		{
+			if (err_)
+				throw std::system_error (err_, std::generic_category ());
+		}
+
+	private:
+		reactor &r_;
+		int fd_;
+		watch &w_;
+		unsigned int events_;
+		int err_ = 0;
+	};
+
+	reactor ()
+	{
+		struct epoll_event ev = { EPOLLIN, { nullptr } };
+
+		epfd_ = check (epoll_create1 (EPOLL_CLOEXEC));
+		evfd_ = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (evfd_ == -1 || epoll_ctl (epfd_, EPOLL_CTL_ADD, evfd_, &ev) == -1) {
+			int err = errno;
+
+			if (evfd_ != -1)
+				close (evfd_);
+			close (epfd_);
+			throw std::system_error (err, std::generic_category ());
+		}
+	}
+
+	reactor (const reactor &) = delete;
+	reactor &operator= (const reactor &) = delete;
+
+	~reactor ()
+	{
+		close (evfd_);
+		close (epfd_);
+	}
+
+	/* Suspend the coroutine until fd is ready for the EPOLL* events. */
+	wait_op
+	wait (int fd, watch &w, unsigned int events) noexcept
+	{
+		return wait_op (*this, fd, w, events);
+	}
+
+	/* Stop watching fd before it's closed. */
+	void
+	forget (int fd, watch &w) noexcept
+	{
+		if (w.added)
+			epoll_ctl (epfd_, EPOLL_CTL_DEL, fd, nullptr);
+		w.added = false;
+	}
+
+	/*
+	 * Start a conversation. It runs on the calling thread until it
+	 * first waits, then on the threads that run the reactor.
+	 */
+	void
+	spawn (task<> t)
+	{
+		eventfd_t val;
+
+		/* The reactor is no longer done. */
+		if (live_.fetch_add (1) == 0)
+			eventfd_read (evfd_, &val);
+		run_detached (std::move (t));
+	}
+
+	/*
+	 * Resume the coroutines until all the spawned ones are over. The
+	 * first exception that escaped one of them is thrown then.
+	 */
+	void
+	run ()
+	{
+		struct epoll_event ev[64];
+		int i, n;
+
+		while (live_.load () > 0) {
+			n = epoll_wait (epfd_, ev, 64, -1);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1)
+				throw std::system_error (errno, std::generic_category ());
+			for (i = 0; i < n; i++) {
+				watch *w = static_cast<watch *> (ev[i].data.ptr);
+
+				if (w)
+					std::coroutine_handle<>::from_address (w->handle.load (std::memory_order_acquire)).resume ();
+			}
+		}
+
+		std::lock_guard<std::mutex> lock (lock_);
+		if (exception_)
+			std::rethrow_exception (std::exchange (exception_, nullptr));
+	}
+
+private:
+	int
+	arm (int fd, watch &w, unsigned int events, std::coroutine_handle<> h) noexcept
+	{
+		struct epoll_event ev = { events | EPOLLONESHOT, { &w } };
+		int op = w.added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+		/* Whatever the coroutine did is published along with it. */
+		w.added = true;
+		w.handle.store (h.address (), std::memory_order_release);
+		if (epoll_ctl (epfd_, op, fd, &ev) == 0)
+			return 0;
+		if (op == EPOLL_CTL_ADD)
+			w.added = false;
+		return -1;
+	}
+
+	detail::detached
+	run_detached (task<> t)
+	{
+		try {
+			co_await t;
+		} catch (...) {
+			std::lock_guard<std::mutex> lock (lock_);
+			if (!exception_)
+				exception_ = std::current_exception ();
+		}
+
+		/* Let all the threads in run() know. */
+		if (live_.fetch_sub (1) == 1)
+			eventfd_write (evfd_, 1);
+	}
+
+	int epfd_;
+	int evfd_;
+	std::atomic<unsigned long> live_ {0};
+	std::mutex lock_;
+	std::exception_ptr exception_;
+};
+
+/*
+ * A device driven by a reactor. Its descriptor is made non-blocking. The
+ * operations are the ones of the device class, returning tasks to await
+ * instead; the packets and settings passed by reference must outlive the
+ * task. Only one conversation may be issuing commands to a device at a
+ * time. Hidraw devices and sockets are supported.
+ */
+
+class async_device {
+public:
+	async_device (reactor &r, device dev)
+		: r_ (r), dev_ (std::move (dev))
+	{
+		const struct mcp2210_transport *ops;
+		void *priv;
+		int flags;
+
+		ops = mcp2210_get_transport (dev_.fd (), &priv);
+		if (ops != &mcp2210_hidraw_transport && ops != &mcp2210_socket_transport)
+			throw std::system_error (ENOTSUP, std::generic_category ());
+		stream_ = ops == &mcp2210_socket_transport;
+
+		flags = check (fcntl (dev_.fd (), F_GETFL));
+		check (fcntl (dev_.fd (), F_SETFL, flags | O_NONBLOCK));
+		timer_fd_ = check (timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+	}
+
+	async_device (reactor &r, const char *path)
+		: async_device (r, device (path)) {}
+
+	async_device (const async_device &) = delete;
+	async_device &operator= (const async_device &) = delete;
+
+	~async_device ()
+	{
+		r_.forget (dev_.fd (), io_);
+		r_.forget (timer_fd_, timer_);
+		close (timer_fd_);
+	}
+
+	int
+	fd () const noexcept
+	{
+		return dev_.fd ();
+	}
+
+	/*
+	 * Issue a command; the packet is replaced with the response. Device
+	 * errors are returned as negative MCP2210_E* codes, like the C
+	 * interface does, rather than thrown.
+	 */
+	task<int>
+	issue (unsigned char *packet, unsigned char command)
+	{
+		/* The C routines can't see the settings this sets. */
+		if (command == MCP2210_SPI_SET)
+			mcp2210_spi_forget (fd ());
+		packet[0] = command;
+		co_await write_report (packet);
+		std::memset (packet, 0, MCP2210_PACKET_SIZE);
+		co_await read_report (packet);
+
+		if (packet[1] != 0)
+			co_return -packet[1];
+		if (packet[0] != command)
+			co_return -MCP2210_EBADCMD;
+		co_return 0;
+	}
+
+	task<>
+	command (unsigned char *packet, unsigned char command)
+	{
+		check (co_await issue (packet, command));
+	}
+
+	template <class P>
+	task<P>
+	get ()
+	{
+		static_assert (P::get_command != 0, "the packet can't be read");
+		P p;
+
+		co_await command (p.raw (), P::get_command);
+		co_return p;
+	}
+
+	template <class P>
+	task<>
+	set (P p)
+	{
+		static_assert (P::set_command != 0, "the packet can't be written");
+
+		co_await command (p.raw (), P::set_command);
+	}
+
+	template <class P>
+	task<P>
+	get_nvram ()
+	{
+		P p;
+
+		co_await subcommand (p.raw (), MCP2210_NVRAM_GET, P::nvram_param);
+		co_return p;
+	}
+
+	template <class P>
+	task<>
+	set_nvram (P p)
+	{
+		co_await subcommand (p.raw (), MCP2210_NVRAM_SET, P::nvram_param);
+	}
+
+	task<unsigned char>
+	read_eeprom (unsigned int addr)
+	{
+		mcp2210_packet packet = { 0, };
+
+		packet[1] = addr;
+		co_await command (packet, MCP2210_EEPROM_READ);
+		if (packet[2] != addr)
+			throw error (MCP2210_EBADADDR);
+		co_return packet[3];
+	}
+
+	task<>
+	write_eeprom (unsigned int addr, unsigned char val)
+	{
+		mcp2210_packet packet = { 0, };
+
+		packet[1] = addr;
+		packet[2] = val;
+		co_await command (packet, MCP2210_EEPROM_WRITE);
+	}
+
+	/*
+	 * A single transaction, see device::transfer(). The coroutine is
+	 * suspended while the device shifts the data out, rather than the
+	 * thread.
+	 */
+	task<buffer>
+	transfer (spi_settings &spi, buffer data)
+	{
+		if (data.size () > MCP2210_SPI_TX_MAX)
+			throw std::system_error (EMSGSIZE, std::generic_category ());
+		co_await spi_transfer (spi, data.data (), data.size ());
+		co_return data;
+	}
+
+	template <std::size_t N>
+	task<std::array<char, N>>
+	transfer (spi_settings &spi, std::array<char, N> data)
+	{
+		static_assert (N > 0 && N <= MCP2210_SPI_TX_MAX,
+			       "the transaction is too large");
+
+		co_await spi_transfer (spi, data.data (), N);
+		co_return data;
+	}
+
+	/* Suspend the coroutine until the deadline on CLOCK_MONOTONIC. */
+	task<>
+	sleep_until (struct timespec deadline)
+	{
+		struct itimerspec its = { { 0, 0 }, deadline };
+		unsigned long long expirations;
+
+		check (timerfd_settime (timer_fd_, TFD_TIMER_ABSTIME, &its, nullptr));
+		while (read (timer_fd_, &expirations, sizeof (expirations)) == -1) {
+			if (errno == EAGAIN)
+				co_await r_.wait (timer_fd_, timer_, EPOLLIN);
+			else if (errno != EINTR)
+				throw std::system_error (errno, std::generic_category ());
+		}
+	}
+
+	task<>
+	sleep_for (unsigned long long ns)
+	{
+		struct timespec deadline;
+
+		if (ns == 0)
+			co_return;
+		clock_gettime (CLOCK_MONOTONIC, &deadline);
+		mcp2210_rt_deadline (&deadline, ns);
+		co_await sleep_until (deadline);
+	}
+
+private:
+	task<>
+	write_report (const unsigned char *packet)
+	{
+		std::size_t len = 0;
+		ssize_t ret;
+
+		while (len < MCP2210_PACKET_SIZE) {
+			if (stream_)
+				ret = send (fd (), packet + len, MCP2210_PACKET_SIZE - len, MSG_NOSIGNAL);
+			else
+				ret = write (fd (), packet, MCP2210_PACKET_SIZE);
+			if (ret == -1 && errno == EAGAIN) {
+				co_await r_.wait (fd (), io_, EPOLLOUT);
+				continue;
+			}
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (mcp2210_trace && (ret == -1 || len + ret == MCP2210_PACKET_SIZE))
+				mcp2210_trace_packet (fd (), MCP2210_TRACE_WRITE, ret, packet);
+			if (ret == -1)
+				throw std::system_error (errno, std::generic_category ());
+			if (!stream_ && ret != MCP2210_PACKET_SIZE)
+				throw error (MCP2210_EWRSHORT);
+			len += ret;
+		}
+	}
+
+	task<>
+	read_report (unsigned char *packet)
+	{
+		std::size_t len = 0;
+		ssize_t ret;
+
+		while (len < MCP2210_PACKET_SIZE) {
+			ret = read (fd (), packet + len, MCP2210_PACKET_SIZE - len);
+			if (ret == -1 && errno == EAGAIN) {
+				co_await r_.wait (fd (), io_, EPOLLIN);
+				continue;
+			}
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (mcp2210_trace && (ret <= 0 || len + ret == MCP2210_PACKET_SIZE))
+				mcp2210_trace_packet (fd (), MCP2210_TRACE_READ, ret, packet);
+			if (ret == -1)
+				throw std::system_error (errno, std::generic_category ());
+			if (ret == 0 || (!stream_ && ret != MCP2210_PACKET_SIZE))
+				throw error (MCP2210_ERDSHORT);
+			len += ret;
+		}
+	}
+
+	task<>
+	subcommand (unsigned char *packet, unsigned char command, unsigned char subcommand)
+	{
+		packet[1] = subcommand;
+		co_await this->command (packet, command);
+		if (packet[2] != subcommand)
+			throw error (MCP2210_EBADSUBCMD);
+	}
+
+	/* Drop the rest of a transfer, along with the responses queued. */
+	task<>
+	spi_cancel ()
+	{
+		mcp2210_packet packet = { 0, };
+		int n;
+
+		packet[0] = MCP2210_SPI_CANCEL;
+		co_await write_report (packet);
+		for (n = 0; n < 16; n++) {
+			co_await read_report (packet);
+			if (packet[0] == MCP2210_SPI_CANCEL) {
+				if (packet[1])
+					throw error (packet[1]);
+				co_return;
+			}
+		}
+		throw error (MCP2210_EBADCMD);
+	}
+
+	/*
+	 * Like mcp2210_spi_transfer(), with the transaction size issued
+	 * first if it differs, and the waits for the data to be shifted
+	 * out on the timer.
+	 */
+	task<>
+	spi_transfer (spi_settings &spi, char *data, std::size_t len)
+	{
+		std::size_t rd = 0, wr = 0;
+		unsigned long long bit_rate = spi.bitrate () > 0 ? spi.bitrate () : 1;
+		int ret;
+
+		if (spi.transaction_size () != len) {
+			spi.set_transaction_size (len);
+			co_await set (spi);
+		}
+
+		while (rd < len) {
+			mcp2210_packet packet;
+			std::size_t wr_len = std::min<std::size_t> (MCP2210_SPI_CHUNK, len - wr);
+			std::size_t rd_len = std::min<std::size_t> (MCP2210_SPI_CHUNK, len - rd);
+			unsigned long long delay_ns;
+
+			delay_ns = rd_len * 8 * 1000000000ULL / bit_rate;
+			delay_ns += rd_len * spi.byte_delay_100us () * (100000 + 30000);
+			if (wr == 0)
+				delay_ns += spi.cs_data_delay_100us () * 100000ULL;
+			if (rd + rd_len == len)
+				delay_ns += spi.data_cs_delay_100us () * (100000 + 30000ULL);
+
+			for (;;) {
+				if (mcp2210_cancelled (fd ())) {
+					/* Nothing's been sent yet if we're at the start. */
+					if (wr != 0)
+						co_await spi_cancel ();
+					throw error (MCP2210_ECANCELED);
+				}
+
+				std::memset (packet, 0, MCP2210_PACKET_SIZE);
+				packet[1] = wr_len;
+				std::memcpy (&packet[2], &data[wr], wr_len);
+				ret = co_await issue (packet, MCP2210_SPI_TRANSFER);
+				co_await sleep_for (delay_ns);
+				if (ret != -MCP2210_ESPIINPROGRESS)
+					break;
+				delay_ns = 5000000;
+			}
+			check (ret);
+			wr += wr_len;
+
+			switch (packet[3]) {
+			case MCP2210_SPI_STARTED:
+			case MCP2210_SPI_END:
+			case MCP2210_SPI_DATA:
+				break;
+			default:
+				throw error (MCP2210_EBADTXSTAT);
+			}
+			if (packet[2] > len - rd)
+				throw error (MCP2210_EBADTXSTAT);
+
+			std::memcpy (&data[rd], &packet[4], packet[2]);
+			rd += packet[2];
+		}
+	}
+
+	reactor &r_;
+	device dev_;
+	bool stream_;
+	int timer_fd_;
+	reactor::watch io_;
+	reactor::watch timer_;
+};
+
+} /* namespace mcp2210 */
+
+#endif /* defined(__MCP2210_CORO_HPP) */
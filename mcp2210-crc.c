@@ -0,0 +1,206 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * CRC-32 and CRC-32C for verifying the SPI data as it arrives. The CRC
+ * instructions of SSE 4.2 and ARMv8 are used when the CPU has them, the
+ * slicing-by-8 tables otherwise.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined (__x86_64__)
+#include <nmmintrin.h>
+#elif defined (__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "mcp2210.h"
+
+/* The reflected polynomials.  */
+
+#define CRC32_POLY	0xedb88320
+#define CRC32C_POLY	0x82f63b78
+
+typedef unsigned int (*crc_func) (unsigned int crc, const unsigned char *p, size_t len);
+
+static unsigned int crc32_table[8][256];
+static unsigned int crc32c_table[8][256];
+
+static crc_func crc32_impl;
+static crc_func crc32c_impl;
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void
+crc_table_init (unsigned int table[8][256], unsigned int poly)
+{
+	unsigned int crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ poly : crc >> 1;
+		table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++)
+			table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+	}
+}
+
+static inline unsigned int
+crc_slice8 (unsigned int table[8][256], unsigned int crc, const unsigned char *p, size_t len)
+{
+	while (len >= 8) {
+		crc ^= p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+		crc = table[7][crc & 0xff] ^ table[6][(crc >> 8) & 0xff]
+			^ table[5][(crc >> 16) & 0xff] ^ table[4][crc >> 24]
+			^ table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+static unsigned int
+crc32_sw (unsigned int crc, const unsigned char *p, size_t len)
+{
+	return crc_slice8 (crc32_table, crc, p, len);
+}
+
+static unsigned int
+crc32c_sw (unsigned int crc, const unsigned char *p, size_t len)
+{
+	return crc_slice8 (crc32c_table, crc, p, len);
+}
+
+#if defined (__x86_64__)
+
+/* There's no instruction for the CRC-32 polynomial, only for CRC-32C.  */
+
+__attribute__ ((target ("sse4.2")))
+static unsigned int
+crc32c_sse42 (unsigned int crc, const unsigned char *p, size_t len)
+{
+	unsigned long long c = crc;
+	unsigned long long v;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8 (c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy (&v, p, 8);
+		c = _mm_crc32_u64 (c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = _mm_crc32_u8 (c, *p++);
+
+	return c;
+}
+
+#elif defined (__aarch64__)
+
+__attribute__ ((target ("+crc")))
+static unsigned int
+crc32_armv8 (unsigned int crc, const unsigned char *p, size_t len)
+{
+	unsigned long long v;
+
+	while (len >= 8) {
+		memcpy (&v, p, 8);
+		crc = __crc32d (crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = __crc32b (crc, *p++);
+
+	return crc;
+}
+
+__attribute__ ((target ("+crc")))
+static unsigned int
+crc32c_armv8 (unsigned int crc, const unsigned char *p, size_t len)
+{
+	unsigned long long v;
+
+	while (len >= 8) {
+		memcpy (&v, p, 8);
+		crc = __crc32cd (crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = __crc32cb (crc, *p++);
+
+	return crc;
+}
+
+#endif
+
+static void
+crc_init (void)
+{
+	crc_table_init (crc32_table, CRC32_POLY);
+	crc_table_init (crc32c_table, CRC32C_POLY);
+	crc32_impl = crc32_sw;
+	crc32c_impl = crc32c_sw;
+
+#if defined (__x86_64__)
+	if (__builtin_cpu_supports ("sse4.2"))
+		crc32c_impl = crc32c_sse42;
+#elif defined (__aarch64__)
+	if (getauxval (AT_HWCAP) & HWCAP_CRC32) {
+		crc32_impl = crc32_armv8;
+		crc32c_impl = crc32c_armv8;
+	}
+#endif
+}
+
+/*
+ * Update the CRC with len bytes of data. Start with a crc of zero; the
+ * result of a call can be passed to the next one to compute the CRC of
+ * data that comes in pieces. The CRC-32 is the one of zlib and Ethernet,
+ * CRC-32C is the Castagnoli one of iSCSI and ext4.
+ */
+
+unsigned int
+mcp2210_crc32 (unsigned int crc, const void *data, size_t len)
+{
+	pthread_once (&crc_once, crc_init);
+	return ~crc32_impl (~crc, data, len);
+}
+
+unsigned int
+mcp2210_crc32c (unsigned int crc, const void *data, size_t len)
+{
+	pthread_once (&crc_once, crc_init);
+	return ~crc32c_impl (~crc, data, len);
+}
@@ -0,0 +1,384 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Reading SPI flash through a page cache. Only the pages that are actually
+ * accessed are read from the chip, with the sequential accesses reading
+ * ahead in larger transactions. The least recently used pages are dropped
+ * when the cache fills up.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mcp2210.h"
+
+/* The JEDEC read commands, with 3 and 4 address bytes.  */
+
+#define FLASH_READ		0x03
+#define FLASH_READ4		0x13
+
+/* As many pages as fit into a single transaction along with the command.  */
+
+#define FLASH_BATCH_MAX		((MCP2210_SPI_TX_MAX - 5) / MCP2210_FLASH_PAGE)
+
+#define NO_PAGE			((unsigned int)-1)
+
+struct flash_page {
+	unsigned int page;
+	unsigned int lru_prev, lru_next;
+	unsigned int hash_next;
+	unsigned char *data;
+};
+
+struct mcp2210_flash {
+	int fd;
+	mcp2210_packet spi_packet;
+	unsigned long long size;
+	int addr_bytes;
+
+	/* The slots, on a list from the most recently used one. */
+	struct flash_page *slots;
+	unsigned int nslots;
+	unsigned int lru_head, lru_tail;
+	unsigned char *data;
+
+	/* The slots by page number. */
+	unsigned int *hash;
+	unsigned int hash_mask;
+
+	/* The read-ahead window grows while the reads are sequential. */
+	unsigned int readahead;
+	unsigned int window;
+	unsigned int next;
+
+	unsigned char *buf;
+	struct mcp2210_flash_stats stats;
+};
+
+/*
+ * Set up the reading of a flash of size bytes, accessed with the spi_packet
+ * settings on fd, with up to pages pages cached and up to readahead pages
+ * read at once.
+ */
+
+struct mcp2210_flash *
+mcp2210_flash_open (int fd, mcp2210_packet spi_packet, unsigned long long size,
+		unsigned int pages, unsigned int readahead)
+{
+	struct mcp2210_flash *flash;
+	unsigned int i;
+
+	if (size == 0 || size > 1ULL << 32 || pages == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	flash = calloc (1, sizeof (*flash));
+	if (flash == NULL)
+		return NULL;
+
+	flash->fd = fd;
+	memcpy (flash->spi_packet, spi_packet, MCP2210_PACKET_SIZE);
+	flash->size = size;
+	flash->addr_bytes = size > 1 << 24 ? 4 : 3;
+
+	if (readahead == 0)
+		readahead = 1;
+	if (readahead > FLASH_BATCH_MAX)
+		readahead = FLASH_BATCH_MAX;
+	if (readahead > pages)
+		readahead = pages;
+	flash->readahead = readahead;
+	flash->window = 1;
+	flash->next = NO_PAGE;
+
+	for (flash->hash_mask = 1; flash->hash_mask < pages * 2; flash->hash_mask <<= 1);
+	flash->hash_mask--;
+
+	flash->nslots = pages;
+	flash->slots = calloc (pages, sizeof (*flash->slots));
+	flash->data = malloc ((size_t)pages * MCP2210_FLASH_PAGE);
+	flash->hash = malloc ((flash->hash_mask + 1) * sizeof (*flash->hash));
+	flash->buf = malloc (1 + flash->addr_bytes + readahead * MCP2210_FLASH_PAGE);
+	if (flash->slots == NULL || flash->data == NULL || flash->hash == NULL || flash->buf == NULL) {
+		mcp2210_flash_close (flash);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i <= flash->hash_mask; i++)
+		flash->hash[i] = NO_PAGE;
+
+	for (i = 0; i < pages; i++) {
+		flash->slots[i].page = NO_PAGE;
+		flash->slots[i].data = &flash->data[(size_t)i * MCP2210_FLASH_PAGE];
+		flash->slots[i].lru_prev = i ? i - 1 : NO_PAGE;
+		flash->slots[i].lru_next = i + 1 < pages ? i + 1 : NO_PAGE;
+		flash->slots[i].hash_next = NO_PAGE;
+	}
+	flash->lru_head = 0;
+	flash->lru_tail = pages - 1;
+
+	return flash;
+}
+
+void
+mcp2210_flash_close (struct mcp2210_flash *flash)
+{
+	free (flash->slots);
+	free (flash->data);
+	free (flash->hash);
+	free (flash->buf);
+	free (flash);
+}
+
+static unsigned int
+flash_hash (struct mcp2210_flash *flash, unsigned int page)
+{
+	return (page * 0x9e3779b1U) & flash->hash_mask;
+}
+
+static unsigned int
+flash_lookup (struct mcp2210_flash *flash, unsigned int page)
+{
+	unsigned int slot;
+
+	for (slot = flash->hash[flash_hash (flash, page)]; slot != NO_PAGE;
+	     slot = flash->slots[slot].hash_next) {
+		if (flash->slots[slot].page == page)
+			return slot;
+	}
+
+	return NO_PAGE;
+}
+
+static void
+lru_unlink (struct mcp2210_flash *flash, unsigned int slot)
+{
+	struct flash_page *p = &flash->slots[slot];
+
+	if (p->lru_prev != NO_PAGE)
+		flash->slots[p->lru_prev].lru_next = p->lru_next;
+	else
+		flash->lru_head = p->lru_next;
+	if (p->lru_next != NO_PAGE)
+		flash->slots[p->lru_next].lru_prev = p->lru_prev;
+	else
+		flash->lru_tail = p->lru_prev;
+}
+
+static void
+lru_touch (struct mcp2210_flash *flash, unsigned int slot)
+{
+	struct flash_page *p = &flash->slots[slot];
+
+	if (flash->lru_head == slot)
+		return;
+
+	lru_unlink (flash, slot);
+	p->lru_prev = NO_PAGE;
+	p->lru_next = flash->lru_head;
+	flash->slots[flash->lru_head].lru_prev = slot;
+	flash->lru_head = slot;
+}
+
+static void
+hash_remove (struct mcp2210_flash *flash, unsigned int slot)
+{
+	unsigned int *link = &flash->hash[flash_hash (flash, flash->slots[slot].page)];
+
+	while (*link != slot)
+		link = &flash->slots[*link].hash_next;
+	*link = flash->slots[slot].hash_next;
+}
+
+/*
+ * Take the least recently used slot for the page.
+ */
+
+static unsigned int
+flash_evict (struct mcp2210_flash *flash, unsigned int page)
+{
+	unsigned int slot = flash->lru_tail;
+	unsigned int h = flash_hash (flash, page);
+
+	if (flash->slots[slot].page != NO_PAGE) {
+		hash_remove (flash, slot);
+		flash->stats.evictions++;
+	}
+
+	flash->slots[slot].page = page;
+	flash->slots[slot].hash_next = flash->hash[h];
+	flash->hash[h] = slot;
+	lru_touch (flash, slot);
+
+	return slot;
+}
+
+/*
+ * Read the page that's not cached, along with the following ones if the
+ * reads seem to be sequential.
+ */
+
+static int
+flash_fill (struct mcp2210_flash *flash, unsigned int page)
+{
+	unsigned int pages = (flash->size + MCP2210_FLASH_PAGE - 1) / MCP2210_FLASH_PAGE;
+	unsigned long long addr = (unsigned long long)page * MCP2210_FLASH_PAGE;
+	int hdr = 1 + flash->addr_bytes;
+	unsigned int count, i;
+	size_t len;
+	int ret;
+
+	if (page == flash->next)
+		flash->window = flash->window * 2 < flash->readahead ? flash->window * 2 : flash->readahead;
+	else
+		flash->window = 1;
+
+	/* Up to the window, the end of the flash or a page that's cached. */
+	for (count = 1; count < flash->window && page + count < pages; count++) {
+		if (flash_lookup (flash, page + count) != NO_PAGE)
+			break;
+	}
+	flash->next = page + count;
+
+	len = (size_t)count * MCP2210_FLASH_PAGE;
+	if (addr + len > flash->size)
+		len = flash->size - addr;
+
+	memset (flash->buf, 0, hdr + len);
+	flash->buf[0] = flash->addr_bytes == 4 ? FLASH_READ4 : FLASH_READ;
+	for (i = 0; i < flash->addr_bytes; i++)
+		flash->buf[hdr - 1 - i] = addr >> (i * 8);
+
+	/* The device may have been set up for another slave meanwhile. */
+	mcp2210_spi_set_transaction_size (flash->spi_packet, hdr + len);
+	ret = mcp2210_spi_apply (flash->fd, flash->spi_packet);
+	if (ret < 0)
+		return ret;
+
+	flash->stats.transfers++;
+	ret = mcp2210_spi_transfer (flash->fd, flash->spi_packet, (char *)flash->buf, hdr + len);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < count; i++) {
+		struct flash_page *p = &flash->slots[flash_evict (flash, page + i)];
+		size_t n = len - i * MCP2210_FLASH_PAGE;
+
+		if (n > MCP2210_FLASH_PAGE)
+			n = MCP2210_FLASH_PAGE;
+		memcpy (p->data, &flash->buf[hdr + i * MCP2210_FLASH_PAGE], n);
+	}
+	flash->stats.misses++;
+	flash->stats.pages += count;
+
+	/* The requested page is the most recently used one. */
+	lru_touch (flash, flash_lookup (flash, page));
+
+	return 0;
+}
+
+/*
+ * Get the cached page at the offset, reading it if needed. The data stays
+ * valid until the next call that reads the flash.
+ */
+
+int
+mcp2210_flash_page (struct mcp2210_flash *flash, unsigned long long offset, const void **data)
+{
+	unsigned int page = offset / MCP2210_FLASH_PAGE;
+	unsigned int slot;
+	int ret;
+
+	if (offset >= flash->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	slot = flash_lookup (flash, page);
+	if (slot == NO_PAGE) {
+		ret = flash_fill (flash, page);
+		if (ret < 0)
+			return ret;
+		slot = flash->lru_head;
+	} else {
+		flash->stats.hits++;
+		lru_touch (flash, slot);
+	}
+
+	*data = flash->slots[slot].data;
+	return 0;
+}
+
+/*
+ * Read len bytes at the offset into buf.
+ */
+
+int
+mcp2210_flash_read (struct mcp2210_flash *flash, unsigned long long offset, void *buf, size_t len)
+{
+	const void *data;
+	size_t skip, n;
+	int ret;
+
+	if (offset > flash->size || len > flash->size - offset) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (len) {
+		ret = mcp2210_flash_page (flash, offset, &data);
+		if (ret < 0)
+			return ret;
+
+		skip = offset % MCP2210_FLASH_PAGE;
+		n = MCP2210_FLASH_PAGE - skip;
+		if (n > len)
+			n = len;
+		memcpy (buf, (const char *)data + skip, n);
+
+		buf = (char *)buf + n;
+		offset += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Drop the cached pages, such as after the flash was written to.
+ */
+
+void
+mcp2210_flash_invalidate (struct mcp2210_flash *flash)
+{
+	unsigned int i;
+
+	for (i = 0; i <= flash->hash_mask; i++)
+		flash->hash[i] = NO_PAGE;
+	for (i = 0; i < flash->nslots; i++)
+		flash->slots[i].page = NO_PAGE;
+	flash->next = NO_PAGE;
+}
+
+void
+mcp2210_flash_get_stats (struct mcp2210_flash *flash, struct mcp2210_flash_stats *stats)
+{
+	*stats = flash->stats;
+}
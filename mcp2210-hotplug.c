@@ -0,0 +1,441 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Surviving the device resets and replugs. The hidraw devices are tracked
+ * by their USB IDs and serial numbers; once a device goes away, it's looked
+ * for among the hidraw devices that show up, reopened on the same file
+ * descriptor and given back its runtime settings.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/hidraw.h>
+
+#include "mcp2210.h"
+
+#define HOTPLUG_DIR		"/dev"
+
+/* Rescan even without a notification, in case one was missed. */
+#define HOTPLUG_RESCAN_MS	250
+
+struct mcp2210_hotplug {
+	int inotify_fd;
+	int timeout_ms;
+	pthread_mutex_t lock;
+	struct mcp2210_hotplug_stats stats;
+};
+
+struct hotplug_dev {
+	struct mcp2210_hotplug *hp;
+	struct mcp2210_device_id id;
+
+	/* The runtime sections of the state, as last set. */
+	struct mcp2210_state want;
+
+	/* The last report written, repeated if its response got lost. */
+	mcp2210_packet last;
+	int restoring;
+};
+
+/* The runtime sections, with the commands that read and set them.  */
+
+static const struct {
+	int section;
+	unsigned short get;
+	unsigned short set;
+} hotplug_sections[] = {
+	{ MCP2210_STATE_CHIP, MCP2210_CHIP_GET, MCP2210_CHIP_SET },
+	{ MCP2210_STATE_GPIO_DIR, MCP2210_GPIO_DIR_GET, MCP2210_GPIO_DIR_SET },
+	{ MCP2210_STATE_GPIO_VAL, MCP2210_GPIO_VAL_GET, MCP2210_GPIO_VAL_SET },
+	{ MCP2210_STATE_SPI, MCP2210_SPI_GET, MCP2210_SPI_SET },
+};
+
+#define HOTPLUG_SECTIONS	(sizeof (hotplug_sections) / sizeof (hotplug_sections[0]))
+
+static unsigned long long
+hotplug_now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Identify a hidraw device by its USB vendor and product IDs and its
+ * serial number. The serial number is left empty with kernels that
+ * can't tell it.
+ */
+
+int
+mcp2210_device_id (int fd, struct mcp2210_device_id *id)
+{
+	struct hidraw_devinfo info;
+	int len;
+
+	memset (id, 0, sizeof (*id));
+	if (ioctl (fd, HIDIOCGRAWINFO, &info) == -1)
+		return -1;
+	id->vendor = info.vendor;
+	id->product = info.product;
+
+	len = ioctl (fd, HIDIOCGRAWUNIQ (sizeof (id->serial) - 1), id->serial);
+	if (len == -1 && errno != EINVAL && errno != ENOTTY)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Read the runtime sections of the state, in a single batch.
+ */
+
+static int
+hotplug_runtime (int fd, struct mcp2210_state *state)
+{
+	mcp2210_packet packets[HOTPLUG_SECTIONS];
+	int ret;
+	int i;
+
+	memset (packets, 0, sizeof (packets));
+	for (i = 0; i < HOTPLUG_SECTIONS; i++)
+		packets[i][0] = hotplug_sections[i].get;
+
+	ret = mcp2210_commands (fd, packets, HOTPLUG_SECTIONS);
+	if (ret < 0)
+		return ret;
+
+	memset (state, 0, sizeof (*state));
+	for (i = 0; i < HOTPLUG_SECTIONS; i++)
+		memcpy (state->packets[hotplug_sections[i].section], packets[i], MCP2210_PACKET_SIZE);
+
+	return 0;
+}
+
+/*
+ * Look for the device among the hidraw devices present. Returns a new
+ * file descriptor, or -1 if it's not there.
+ */
+
+static int
+hotplug_scan (const struct mcp2210_device_id *want)
+{
+	struct mcp2210_device_id id;
+	struct dirent *ent;
+	char path[300];
+	DIR *dir;
+	int fd = -1;
+
+	dir = opendir (HOTPLUG_DIR);
+	if (dir == NULL)
+		return -1;
+
+	while ((ent = readdir (dir)) != NULL) {
+		if (strncmp (ent->d_name, "hidraw", 6))
+			continue;
+
+		snprintf (path, sizeof (path), HOTPLUG_DIR "/%s", ent->d_name);
+		fd = open (path, O_RDWR | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+		if (mcp2210_device_id (fd, &id) == 0 && memcmp (&id, want, sizeof (id)) == 0)
+			break;
+		close (fd);
+		fd = -1;
+	}
+
+	closedir (dir);
+	return fd;
+}
+
+static void
+hotplug_drain (struct mcp2210_hotplug *hp)
+{
+	char buf[4096];
+
+	while (read (hp->inotify_fd, buf, sizeof (buf)) > 0);
+}
+
+/*
+ * Wait for the device to show up again, put it in place of the dead one
+ * and restore its runtime settings, with as few commands as possible.
+ */
+
+static int
+hotplug_reconnect (struct hotplug_dev *dev, int fd)
+{
+	struct mcp2210_hotplug *hp = dev->hp;
+	unsigned long long start = hotplug_now_ns ();
+	struct mcp2210_state cur;
+	struct pollfd pfd;
+	long long left;
+	int new_fd;
+	int ret;
+
+	if (dev->restoring)
+		return -1;
+
+	/*
+	 * The lock is only held while scanning, not while waiting, so that
+	 * the other devices can come back meanwhile. A notification drained
+	 * by another thread is made up for by the periodic rescan.
+	 */
+	while (1) {
+		pthread_mutex_lock (&hp->lock);
+		hotplug_drain (hp);
+		new_fd = hotplug_scan (&dev->id);
+		pthread_mutex_unlock (&hp->lock);
+		if (new_fd != -1)
+			break;
+
+		left = hp->timeout_ms - (long long)(hotplug_now_ns () - start) / 1000000;
+		if (hp->timeout_ms >= 0 && left <= 0) {
+			errno = ENODEV;
+			return -1;
+		}
+
+		pfd.fd = hp->inotify_fd;
+		pfd.events = POLLIN;
+		poll (&pfd, 1, hp->timeout_ms < 0 || left > HOTPLUG_RESCAN_MS ? HOTPLUG_RESCAN_MS : left);
+	}
+
+	ret = dup3 (new_fd, fd, O_CLOEXEC);
+	close (new_fd);
+	if (ret == -1)
+		return -1;
+	mcp2210_spi_forget (fd);
+
+	dev->restoring = 1;
+	ret = hotplug_runtime (fd, &cur);
+	if (ret == 0)
+		ret = mcp2210_state_restore (fd, &cur, &dev->want);
+	dev->restoring = 0;
+
+	if (ret == 0) {
+		unsigned long long t = hotplug_now_ns () - start;
+
+		pthread_mutex_lock (&hp->lock);
+		hp->stats.reconnects++;
+		hp->stats.total_ns += t;
+		if (t > hp->stats.max_ns)
+			hp->stats.max_ns = t;
+		pthread_mutex_unlock (&hp->lock);
+	}
+
+	if (ret < 0) {
+		if (ret != -1)
+			errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+hotplug_gone (int err)
+{
+	return err == ENODEV || err == EIO || err == ESHUTDOWN;
+}
+
+/*
+ * The transport: hidraw, reconnecting when the device is gone. A command
+ * that's a part of an SPI transfer can't be repeated, since the transfer
+ * doesn't survive the reset; it fails with ECONNRESET, but the following
+ * commands go to the device again.
+ */
+
+static ssize_t
+hotplug_write (int fd, void *priv, const mcp2210_packet packet)
+{
+	struct hotplug_dev *dev = priv;
+	ssize_t ret;
+
+	ret = write (fd, packet, MCP2210_PACKET_SIZE);
+	if (ret == -1 && hotplug_gone (errno)) {
+		if (hotplug_reconnect (dev, fd) == -1)
+			return -1;
+		if (packet[0] == MCP2210_SPI_TRANSFER) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		ret = write (fd, packet, MCP2210_PACKET_SIZE);
+	}
+
+	if (ret == MCP2210_PACKET_SIZE && !dev->restoring)
+		memcpy (dev->last, packet, MCP2210_PACKET_SIZE);
+
+	return ret;
+}
+
+static ssize_t
+hotplug_read (int fd, void *priv, mcp2210_packet packet)
+{
+	struct hotplug_dev *dev = priv;
+	ssize_t ret;
+	int i;
+
+	ret = read (fd, packet, MCP2210_PACKET_SIZE);
+	if (ret == -1 && hotplug_gone (errno)) {
+		if (hotplug_reconnect (dev, fd) == -1)
+			return -1;
+		if (dev->last[0] == MCP2210_SPI_TRANSFER) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (write (fd, dev->last, MCP2210_PACKET_SIZE) != MCP2210_PACKET_SIZE)
+			return -1;
+		ret = read (fd, packet, MCP2210_PACKET_SIZE);
+	}
+
+	/* Remember the settings the device took. */
+	if (ret == MCP2210_PACKET_SIZE && packet[0] == dev->last[0] && packet[1] == 0 && !dev->restoring) {
+		for (i = 0; i < HOTPLUG_SECTIONS; i++) {
+			if (hotplug_sections[i].set == dev->last[0]) {
+				memcpy (dev->want.packets[hotplug_sections[i].section], dev->last,
+					MCP2210_PACKET_SIZE);
+			}
+		}
+	}
+
+	return ret;
+}
+
+static int
+hotplug_close (int fd, void *priv)
+{
+	free (priv);
+	return close (fd);
+}
+
+static const struct mcp2210_transport hotplug_transport = {
+	.name = "hotplug",
+	.depth = 1,
+	.write = hotplug_write,
+	.read = hotplug_read,
+	.close = hotplug_close,
+};
+
+/*
+ * Set up the tracking of devices that reappear within timeout_ms, or
+ * any time later with a negative timeout.
+ */
+
+struct mcp2210_hotplug *
+mcp2210_hotplug_new (int timeout_ms)
+{
+	struct mcp2210_hotplug *hp;
+
+	hp = calloc (1, sizeof (*hp));
+	if (hp == NULL)
+		return NULL;
+
+	hp->timeout_ms = timeout_ms;
+	hp->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (hp->inotify_fd == -1) {
+		free (hp);
+		return NULL;
+	}
+	if (inotify_add_watch (hp->inotify_fd, HOTPLUG_DIR, IN_CREATE | IN_ATTRIB) == -1) {
+		close (hp->inotify_fd);
+		free (hp);
+		return NULL;
+	}
+	pthread_mutex_init (&hp->lock, NULL);
+
+	return hp;
+}
+
+/*
+ * Free the tracking. The devices must be closed first.
+ */
+
+void
+mcp2210_hotplug_free (struct mcp2210_hotplug *hp)
+{
+	pthread_mutex_destroy (&hp->lock);
+	close (hp->inotify_fd);
+	free (hp);
+}
+
+/*
+ * Track the hidraw device open on fd. Its current runtime settings and
+ * the ones set later are restored after it reappears. A device without a
+ * serial number can't be told from others of the same kind, so it's not
+ * tracked.
+ */
+
+int
+mcp2210_hotplug_add (struct mcp2210_hotplug *hp, int fd)
+{
+	struct hotplug_dev *dev;
+	void *priv;
+	int ret;
+
+	if (mcp2210_get_transport (fd, &priv) != &mcp2210_hidraw_transport) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	dev = calloc (1, sizeof (*dev));
+	if (dev == NULL)
+		return -1;
+	dev->hp = hp;
+
+	if (mcp2210_device_id (fd, &dev->id) == -1) {
+		free (dev);
+		return -1;
+	}
+	if (dev->id.serial[0] == '\0') {
+		free (dev);
+		errno = ENOENT;
+		return -1;
+	}
+
+	ret = hotplug_runtime (fd, &dev->want);
+	if (ret < 0) {
+		free (dev);
+		return ret;
+	}
+
+	if (mcp2210_set_transport (fd, &hotplug_transport, dev) == -1) {
+		free (dev);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+mcp2210_hotplug_get_stats (struct mcp2210_hotplug *hp, struct mcp2210_hotplug_stats *stats)
+{
+	pthread_mutex_lock (&hp->lock);
+	*stats = hp->stats;
+	pthread_mutex_unlock (&hp->lock);
+}
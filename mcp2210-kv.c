@@ -0,0 +1,438 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Key/value store in the user EEPROM. The EEPROM is split into two banks,
+ * each a header followed by a log of records. Updates are appended to the
+ * log of the active bank; once it's full, the live records are copied to
+ * the other bank, which then becomes the active one. This way every byte
+ * is written about as often as any other, and only the bytes that actually
+ * change are written at all.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mcp2210.h"
+
+/*
+ * The bank header is the magic, the generation and a CRC of the two; the
+ * bank with the newer generation is the active one. A record is the key,
+ * the length of the value, the value and a CRC of all that along with the
+ * generation. A key of KV_END marks the end of the log.
+ */
+
+#define KV_BANK			(MCP2210_EEPROM_SIZE / 2)
+#define KV_HEADER		3
+#define KV_MAGIC		0x4b
+#define KV_END			0xff
+#define KV_DELETED		0xff
+
+#define NO_RECORD		-1
+
+struct mcp2210_kv {
+	int fd;
+
+	/* What the EEPROM is believed to contain. */
+	unsigned char image[MCP2210_EEPROM_SIZE];
+	unsigned char unsure[MCP2210_EEPROM_SIZE];
+
+	int bank;
+	unsigned char gen;
+	int tail;
+	short index[MCP2210_KV_KEYS];
+
+	/* The writes of an update, done as a single batch. */
+	mcp2210_packet packets[MCP2210_EEPROM_SIZE];
+	unsigned char addr[MCP2210_EEPROM_SIZE];
+	unsigned char val[MCP2210_EEPROM_SIZE];
+	int pending;
+
+	struct mcp2210_kv_stats stats;
+};
+
+static unsigned char
+kv_crc (unsigned char gen, const unsigned char *data, size_t len)
+{
+	return mcp2210_crc32c (mcp2210_crc32c (0, &gen, 1), data, len);
+}
+
+static int
+kv_header_valid (const unsigned char *hdr)
+{
+	return hdr[0] == KV_MAGIC && hdr[2] == kv_crc (0, hdr, 2);
+}
+
+/*
+ * Pick the active bank and index its records. The log ends at the end
+ * marker or the first record that doesn't check out, such as one whose
+ * write was interrupted.
+ */
+
+static int
+kv_scan (struct mcp2210_kv *kv)
+{
+	const unsigned char *b0 = &kv->image[0];
+	const unsigned char *b1 = &kv->image[KV_BANK];
+	const unsigned char *bank;
+	int pos, len;
+	int i;
+
+	if (kv_header_valid (b0) && kv_header_valid (b1))
+		kv->bank = (signed char)(b1[1] - b0[1]) > 0;
+	else if (kv_header_valid (b0))
+		kv->bank = 0;
+	else if (kv_header_valid (b1))
+		kv->bank = 1;
+	else
+		return -1;
+
+	bank = &kv->image[kv->bank * KV_BANK];
+	kv->gen = bank[1];
+
+	for (i = 0; i < MCP2210_KV_KEYS; i++)
+		kv->index[i] = NO_RECORD;
+
+	for (pos = KV_HEADER; pos + 3 <= KV_BANK; pos += 3 + len) {
+		if (bank[pos] == KV_END)
+			break;
+		len = bank[pos + 1] == KV_DELETED ? 0 : bank[pos + 1];
+		if (pos + 3 + len > KV_BANK)
+			break;
+		if (bank[pos + 2 + len] != kv_crc (kv->gen, &bank[pos], 2 + len))
+			break;
+		kv->index[bank[pos]] = bank[pos + 1] == KV_DELETED ? NO_RECORD : pos;
+	}
+	kv->tail = pos;
+
+	return 0;
+}
+
+/*
+ * Add a byte to the batch, unless it's known to be there already.
+ */
+
+static void
+kv_queue (struct mcp2210_kv *kv, int addr, unsigned char val)
+{
+	if (kv->image[addr] == val && !kv->unsure[addr]) {
+		kv->stats.unchanged++;
+		return;
+	}
+
+	memset (kv->packets[kv->pending], 0, MCP2210_PACKET_SIZE);
+	kv->packets[kv->pending][0] = MCP2210_EEPROM_WRITE;
+	kv->packets[kv->pending][1] = addr;
+	kv->packets[kv->pending][2] = val;
+	kv->addr[kv->pending] = addr;
+	kv->val[kv->pending] = val;
+	kv->pending++;
+}
+
+/*
+ * Write the batch. The bytes are written in the order they were queued;
+ * if that fails, any of them may or may not have been written and all of
+ * them are written again next time around.
+ */
+
+static int
+kv_flush (struct mcp2210_kv *kv)
+{
+	int n = kv->pending;
+	int ret;
+	int i;
+
+	kv->pending = 0;
+	if (n == 0)
+		return 0;
+
+	kv->stats.batches++;
+	ret = mcp2210_commands (kv->fd, kv->packets, n);
+	for (i = 0; i < n; i++) {
+		if (ret == 0) {
+			kv->image[kv->addr[i]] = kv->val[i];
+			kv->unsure[kv->addr[i]] = 0;
+		} else {
+			kv->unsure[kv->addr[i]] = 1;
+		}
+	}
+	if (ret == 0)
+		kv->stats.written += n;
+
+	return ret;
+}
+
+/*
+ * Lay out the record in rec, returning its size. A NULL val deletes the key.
+ */
+
+static int
+kv_record (unsigned char *rec, unsigned char gen, unsigned char key, const void *val, size_t len)
+{
+	rec[0] = key;
+	if (val == NULL) {
+		rec[1] = KV_DELETED;
+		len = 0;
+	} else {
+		rec[1] = len;
+		memcpy (&rec[2], val, len);
+	}
+	rec[2 + len] = kv_crc (gen, rec, 2 + len);
+
+	return 3 + len;
+}
+
+/*
+ * Append the record to the log. The key goes in last, so that an update
+ * that's interrupted leaves the end of the log where it was.
+ */
+
+static int
+kv_append (struct mcp2210_kv *kv, unsigned char key, const void *val, size_t len)
+{
+	unsigned char rec[3 + MCP2210_KV_VALUE_MAX];
+	int base = kv->bank * KV_BANK;
+	int size;
+	int ret;
+	int i;
+
+	size = kv_record (rec, kv->gen, key, val, len);
+
+	kv_queue (kv, base + kv->tail, KV_END);
+	if (kv->tail + size < KV_BANK)
+		kv_queue (kv, base + kv->tail + size, KV_END);
+	for (i = 1; i < size; i++)
+		kv_queue (kv, base + kv->tail + i, rec[i]);
+	kv_queue (kv, base + kv->tail, key);
+
+	ret = kv_flush (kv);
+	if (ret < 0)
+		return ret;
+
+	kv->index[key] = val ? kv->tail : NO_RECORD;
+	kv->tail += size;
+	kv->stats.appends++;
+
+	return 0;
+}
+
+/*
+ * Copy the live records, with the key updated, to the other bank and make
+ * it the active one. The header goes in last, so that an interrupted
+ * compaction leaves the old bank active.
+ */
+
+static int
+kv_compact (struct mcp2210_kv *kv, int key, const void *val, size_t len)
+{
+	unsigned char bank[KV_BANK];
+	const unsigned char *rec;
+	int target = !kv->bank;
+	unsigned char gen = kv->gen + 1;
+	int base = target * KV_BANK;
+	int pos = KV_HEADER;
+	int k;
+	int ret;
+
+	memcpy (bank, &kv->image[base], KV_BANK);
+	for (k = 0; k < MCP2210_KV_KEYS; k++) {
+		if (k == key) {
+			if (val == NULL)
+				continue;
+			if (pos + 3 + len > KV_BANK)
+				goto nospc;
+			pos += kv_record (&bank[pos], gen, k, val, len);
+		} else if (kv->index[k] != NO_RECORD) {
+			rec = &kv->image[kv->bank * KV_BANK + kv->index[k]];
+			if (pos + 3 + rec[1] > KV_BANK)
+				goto nospc;
+			pos += kv_record (&bank[pos], gen, k, &rec[2], rec[1]);
+		}
+	}
+	if (pos < KV_BANK)
+		bank[pos++] = KV_END;
+
+	bank[0] = KV_MAGIC;
+	bank[1] = gen;
+	bank[2] = kv_crc (0, bank, 2);
+
+	for (k = KV_HEADER; k < pos; k++)
+		kv_queue (kv, base + k, bank[k]);
+	kv_queue (kv, base + 1, bank[1]);
+	kv_queue (kv, base + 2, bank[2]);
+	kv_queue (kv, base + 0, bank[0]);
+
+	ret = kv_flush (kv);
+	if (ret < 0)
+		return ret;
+
+	kv->stats.compactions++;
+	return kv_scan (kv);
+
+nospc:
+	kv->pending = 0;
+	errno = ENOSPC;
+	return -1;
+}
+
+/*
+ * Read the EEPROM in a single batch and index the store in it. Unless
+ * there's a store already, an empty one is created if create is set.
+ */
+
+int
+mcp2210_kv_open (int fd, int create, struct mcp2210_kv **kvp)
+{
+	struct mcp2210_kv *kv;
+	int ret;
+	int i;
+
+	kv = calloc (1, sizeof (*kv));
+	if (kv == NULL)
+		return -1;
+	kv->fd = fd;
+
+	for (i = 0; i < MCP2210_EEPROM_SIZE; i++) {
+		memset (kv->packets[i], 0, MCP2210_PACKET_SIZE);
+		kv->packets[i][0] = MCP2210_EEPROM_READ;
+		kv->packets[i][1] = i;
+	}
+	ret = mcp2210_commands (fd, kv->packets, MCP2210_EEPROM_SIZE);
+	if (ret < 0)
+		goto out;
+
+	for (i = 0; i < MCP2210_EEPROM_SIZE; i++) {
+		if (kv->packets[i][2] != i) {
+			ret = -MCP2210_EBADADDR;
+			goto out;
+		}
+		kv->image[i] = kv->packets[i][3];
+	}
+
+	if (kv_scan (kv) == -1) {
+		if (!create) {
+			errno = ENOENT;
+			ret = -1;
+			goto out;
+		}
+
+		/* Compacting nothing into bank 0. */
+		kv->bank = 1;
+		kv->gen = 0xff;
+		for (i = 0; i < MCP2210_KV_KEYS; i++)
+			kv->index[i] = NO_RECORD;
+		ret = kv_compact (kv, -1, NULL, 0);
+		if (ret < 0)
+			goto out;
+	}
+
+	*kvp = kv;
+	return 0;
+out:
+	free (kv);
+	return ret;
+}
+
+void
+mcp2210_kv_close (struct mcp2210_kv *kv)
+{
+	free (kv);
+}
+
+/*
+ * Copy up to size bytes of the value of key to buf and return its length.
+ */
+
+int
+mcp2210_kv_get (struct mcp2210_kv *kv, unsigned int key, void *buf, size_t size)
+{
+	const unsigned char *rec;
+
+	if (key >= MCP2210_KV_KEYS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (kv->index[key] == NO_RECORD) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	rec = &kv->image[kv->bank * KV_BANK + kv->index[key]];
+	memcpy (buf, &rec[2], size < rec[1] ? size : rec[1]);
+
+	return rec[1];
+}
+
+int
+mcp2210_kv_set (struct mcp2210_kv *kv, unsigned int key, const void *val, size_t len)
+{
+	const unsigned char *rec;
+
+	if (key >= MCP2210_KV_KEYS || len > MCP2210_KV_VALUE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (kv->index[key] != NO_RECORD) {
+		rec = &kv->image[kv->bank * KV_BANK + kv->index[key]];
+		if (rec[1] == len && memcmp (&rec[2], val, len) == 0)
+			return 0;
+	}
+
+	if (kv->tail + 3 + len <= KV_BANK)
+		return kv_append (kv, key, val, len);
+	return kv_compact (kv, key, val, len);
+}
+
+int
+mcp2210_kv_delete (struct mcp2210_kv *kv, unsigned int key)
+{
+	if (key >= MCP2210_KV_KEYS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (kv->index[key] == NO_RECORD) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (kv->tail + 3 <= KV_BANK)
+		return kv_append (kv, key, NULL, 0);
+	return kv_compact (kv, key, NULL, 0);
+}
+
+/*
+ * The next key with a value after the given one, starting with -1.
+ * Returns -1 after the last one.
+ */
+
+int
+mcp2210_kv_next (struct mcp2210_kv *kv, int key)
+{
+	for (key++; key < MCP2210_KV_KEYS; key++) {
+		if (kv->index[key] != NO_RECORD)
+			return key;
+	}
+
+	return -1;
+}
+
+void
+mcp2210_kv_get_stats (struct mcp2210_kv *kv, struct mcp2210_kv_stats *stats)
+{
+	*stats = kv->stats;
+}
@@ -0,0 +1,331 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * libusb transport. Keeps a number of interrupt IN transfers queued, so
+ * that the responses are collected as soon as the device produces them,
+ * and lets a number of OUT transfers be in flight at once.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+#include "mcp2210.h"
+
+#define MCP2210_VID		0x04d8
+#define MCP2210_PID		0x00de
+#define MCP2210_INTERFACE	0
+#define MCP2210_EP_OUT		0x01
+#define MCP2210_EP_IN		0x81
+
+#define IN_URBS			4
+#define OUT_URBS		4
+#define RESPONSES		16
+
+struct usb_priv {
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct libusb_transfer *in[IN_URBS];
+	struct libusb_transfer *out[OUT_URBS];
+	unsigned char in_buf[IN_URBS][MCP2210_PACKET_SIZE];
+	unsigned char out_buf[OUT_URBS][MCP2210_PACKET_SIZE];
+	int out_busy[OUT_URBS];
+	int out_next;
+	int in_flight;
+
+	/* Responses received and not yet read. */
+	mcp2210_packet responses[RESPONSES];
+	int head, tail;
+
+	int error;
+};
+
+static int
+usb_errno (int err)
+{
+	switch (err) {
+	case LIBUSB_ERROR_NO_DEVICE:
+		return ENODEV;
+	case LIBUSB_ERROR_ACCESS:
+		return EACCES;
+	case LIBUSB_ERROR_BUSY:
+		return EBUSY;
+	case LIBUSB_ERROR_TIMEOUT:
+		return ETIMEDOUT;
+	case LIBUSB_ERROR_NO_MEM:
+		return ENOMEM;
+	case LIBUSB_ERROR_NOT_FOUND:
+		return ENOENT;
+	default:
+		return EIO;
+	}
+}
+
+static void LIBUSB_CALL
+in_done (struct libusb_transfer *transfer)
+{
+	struct usb_priv *priv = transfer->user_data;
+
+	priv->in_flight--;
+
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+		return;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		priv->error = transfer->status == LIBUSB_TRANSFER_NO_DEVICE ? ENODEV : EIO;
+		return;
+	}
+
+	if ((priv->tail + 1) % RESPONSES == priv->head) {
+		/* Nobody's reading the responses; this shouldn't happen. */
+		priv->error = EOVERFLOW;
+		return;
+	}
+	memcpy (priv->responses[priv->tail], transfer->buffer, MCP2210_PACKET_SIZE);
+	priv->tail = (priv->tail + 1) % RESPONSES;
+
+	if (libusb_submit_transfer (transfer) == 0)
+		priv->in_flight++;
+	else
+		priv->error = EIO;
+}
+
+static void LIBUSB_CALL
+out_done (struct libusb_transfer *transfer)
+{
+	struct usb_priv *priv = transfer->user_data;
+	int i;
+
+	for (i = 0; i < OUT_URBS; i++) {
+		if (priv->out[i] == transfer)
+			priv->out_busy[i] = 0;
+	}
+
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+		return;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED
+	    || transfer->actual_length != MCP2210_PACKET_SIZE)
+		priv->error = transfer->status == LIBUSB_TRANSFER_NO_DEVICE ? ENODEV : EIO;
+}
+
+static int
+handle_events (struct usb_priv *priv)
+{
+	int ret;
+
+	ret = libusb_handle_events (priv->ctx);
+	if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+		errno = usb_errno (ret);
+		return -1;
+	}
+
+	if (priv->error) {
+		errno = priv->error;
+		priv->error = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static ssize_t
+usb_write_report (int fd, void *data, const mcp2210_packet packet)
+{
+	struct usb_priv *priv = data;
+	int i = priv->out_next;
+	int ret;
+
+	while (priv->out_busy[i]) {
+		if (handle_events (priv) == -1)
+			return -1;
+	}
+
+	memcpy (priv->out_buf[i], packet, MCP2210_PACKET_SIZE);
+	ret = libusb_submit_transfer (priv->out[i]);
+	if (ret < 0) {
+		errno = usb_errno (ret);
+		return -1;
+	}
+	priv->out_busy[i] = 1;
+	priv->out_next = (i + 1) % OUT_URBS;
+
+	return MCP2210_PACKET_SIZE;
+}
+
+static ssize_t
+usb_read_report (int fd, void *data, mcp2210_packet packet)
+{
+	struct usb_priv *priv = data;
+
+	while (priv->head == priv->tail) {
+		if (handle_events (priv) == -1)
+			return -1;
+	}
+
+	memcpy (packet, priv->responses[priv->head], MCP2210_PACKET_SIZE);
+	priv->head = (priv->head + 1) % RESPONSES;
+
+	return MCP2210_PACKET_SIZE;
+}
+
+static void
+usb_free (struct usb_priv *priv)
+{
+	int i;
+
+	for (i = 0; i < IN_URBS; i++) {
+		if (priv->in[i])
+			libusb_cancel_transfer (priv->in[i]);
+	}
+	for (i = 0; i < OUT_URBS; i++) {
+		if (priv->out_busy[i])
+			libusb_cancel_transfer (priv->out[i]);
+	}
+
+	/* Wait for the cancellations to complete. */
+	while (priv->in_flight) {
+		if (libusb_handle_events (priv->ctx) < 0)
+			break;
+	}
+	for (i = 0; i < OUT_URBS; i++) {
+		while (priv->out_busy[i]) {
+			if (libusb_handle_events (priv->ctx) < 0)
+				break;
+		}
+	}
+
+	for (i = 0; i < IN_URBS; i++)
+		libusb_free_transfer (priv->in[i]);
+	for (i = 0; i < OUT_URBS; i++)
+		libusb_free_transfer (priv->out[i]);
+
+	if (priv->handle) {
+		libusb_release_interface (priv->handle, MCP2210_INTERFACE);
+		libusb_close (priv->handle);
+	}
+	if (priv->ctx)
+		libusb_exit (priv->ctx);
+	free (priv);
+}
+
+static int
+usb_close (int fd, void *data)
+{
+	usb_free (data);
+	return close (fd);
+}
+
+static const struct mcp2210_transport usb_transport = {
+	.name = "libusb",
+	.depth = OUT_URBS,
+	.write = usb_write_report,
+	.read = usb_read_report,
+	.close = usb_close,
+};
+
+/*
+ * Open a device with the given "vid:pid" in hex, or the first MCP2210 if
+ * the spec is empty. The file descriptor returned is an eventfd that only
+ * serves as a handle.
+ */
+
+int
+mcp2210_libusb_open (const char *spec)
+{
+	unsigned int vid = MCP2210_VID, pid = MCP2210_PID;
+	struct usb_priv *priv;
+	int ret;
+	int fd;
+	int i;
+
+	if (*spec && sscanf (spec, "%x:%x", &vid, &pid) != 2) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	priv = calloc (1, sizeof (*priv));
+	if (priv == NULL)
+		return -1;
+
+	ret = libusb_init (&priv->ctx);
+	if (ret < 0) {
+		priv->ctx = NULL;
+		goto err;
+	}
+
+	priv->handle = libusb_open_device_with_vid_pid (priv->ctx, vid, pid);
+	if (priv->handle == NULL) {
+		ret = LIBUSB_ERROR_NOT_FOUND;
+		goto err;
+	}
+
+	libusb_set_auto_detach_kernel_driver (priv->handle, 1);
+	ret = libusb_claim_interface (priv->handle, MCP2210_INTERFACE);
+	if (ret < 0) {
+		libusb_close (priv->handle);
+		priv->handle = NULL;
+		goto err;
+	}
+
+	for (i = 0; i < OUT_URBS; i++) {
+		priv->out[i] = libusb_alloc_transfer (0);
+		if (priv->out[i] == NULL) {
+			ret = LIBUSB_ERROR_NO_MEM;
+			goto err;
+		}
+		libusb_fill_interrupt_transfer (priv->out[i], priv->handle, MCP2210_EP_OUT,
+			priv->out_buf[i], MCP2210_PACKET_SIZE, out_done, priv, 0);
+	}
+
+	for (i = 0; i < IN_URBS; i++) {
+		priv->in[i] = libusb_alloc_transfer (0);
+		if (priv->in[i] == NULL) {
+			ret = LIBUSB_ERROR_NO_MEM;
+			goto err;
+		}
+		libusb_fill_interrupt_transfer (priv->in[i], priv->handle, MCP2210_EP_IN,
+			priv->in_buf[i], MCP2210_PACKET_SIZE, in_done, priv, 0);
+		ret = libusb_submit_transfer (priv->in[i]);
+		if (ret < 0)
+			goto err;
+		priv->in_flight++;
+	}
+
+	fd = eventfd (0, EFD_CLOEXEC);
+	if (fd == -1) {
+		ret = LIBUSB_ERROR_NO_MEM;
+		goto err;
+	}
+
+	if (mcp2210_set_transport (fd, &usb_transport, priv) == -1) {
+		close (fd);
+		ret = LIBUSB_ERROR_NO_MEM;
+		goto err;
+	}
+
+	return fd;
+err:
+	usb_free (priv);
+	errno = usb_errno (ret);
+	return -1;
+}
@@ -0,0 +1,534 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Register maps of SPI slaves. The registers that don't change on their
+ * own are cached, so that reading them doesn't take a transfer, and the
+ * writes to consecutive registers are done in a single burst if the slave
+ * increments the address by itself.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mcp2210.h"
+
+/* The state of a register, along with its MCP2210_REG_* attributes.  */
+
+#define REG_ATTRS		0x0f
+#define REG_VALID		0x10
+#define REG_DIRTY		0x20
+#define REG_DEFAULT		0x40
+
+struct mcp2210_regmap {
+	int fd;
+	mcp2210_packet spi_packet;
+	struct mcp2210_regmap_config config;
+	int cache_only;
+
+	unsigned int *cache;
+	unsigned int *defaults;
+	unsigned char *state;
+
+	/* A whole transaction, the address and the values. */
+	char *buf;
+	unsigned int burst_max;
+
+	struct mcp2210_regmap_stats stats;
+};
+
+/*
+ * Set up a register map of the slave that's accessed with the spi_packet
+ * settings on fd. The transaction size of the settings is adjusted as
+ * needed, and the settings are set again whenever the device was set up
+ * otherwise in the meantime. The cache starts out empty.
+ */
+
+struct mcp2210_regmap *
+mcp2210_regmap_new (int fd, mcp2210_packet spi_packet, const struct mcp2210_regmap_config *config)
+{
+	struct mcp2210_regmap *map;
+	unsigned int regs, reg;
+	int i;
+
+	if (config->reg_bytes < 1 || config->reg_bytes > 2
+	    || config->val_bytes < 1 || config->val_bytes > 4
+	    || config->max_register >= 1U << (config->reg_bytes * 8)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = calloc (1, sizeof (*map));
+	if (map == NULL)
+		return NULL;
+
+	map->fd = fd;
+	memcpy (map->spi_packet, spi_packet, MCP2210_PACKET_SIZE);
+	map->config = *config;
+
+	regs = config->max_register + 1;
+	map->burst_max = config->burst ? (MCP2210_SPI_TX_MAX - config->reg_bytes) / config->val_bytes : 1;
+	if (map->burst_max > regs)
+		map->burst_max = regs;
+
+	map->cache = calloc (regs, sizeof (*map->cache));
+	map->state = calloc (regs, sizeof (*map->state));
+	map->buf = malloc (config->reg_bytes + map->burst_max * config->val_bytes);
+	if (config->ndefaults)
+		map->defaults = calloc (regs, sizeof (*map->defaults));
+	if (map->cache == NULL || map->state == NULL || map->buf == NULL
+	    || (config->ndefaults && map->defaults == NULL)) {
+		mcp2210_regmap_free (map);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < config->nranges; i++) {
+		for (reg = config->ranges[i].first; reg <= config->ranges[i].last && reg < regs; reg++)
+			map->state[reg] |= config->ranges[i].flags & REG_ATTRS;
+	}
+
+	for (i = 0; i < config->ndefaults; i++) {
+		reg = config->defaults[i].reg;
+		if (reg >= regs)
+			continue;
+		map->defaults[reg] = config->defaults[i].val;
+		map->state[reg] |= REG_DEFAULT;
+	}
+
+	/* The tables are not needed anymore, the caller may free them. */
+	map->config.ranges = NULL;
+	map->config.defaults = NULL;
+
+	return map;
+}
+
+void
+mcp2210_regmap_free (struct mcp2210_regmap *map)
+{
+	free (map->cache);
+	free (map->defaults);
+	free (map->state);
+	free (map->buf);
+	free (map);
+}
+
+static void
+put_be (char *p, unsigned int val, int bytes)
+{
+	while (bytes--) {
+		p[bytes] = val & 0xff;
+		val >>= 8;
+	}
+}
+
+static unsigned int
+get_be (const char *p, int bytes)
+{
+	unsigned int val = 0;
+
+	while (bytes--)
+		val = val << 8 | (unsigned char)*p++;
+
+	return val;
+}
+
+/*
+ * A transaction of len bytes from the buffer.
+ */
+
+static int
+regmap_transfer (struct mcp2210_regmap *map, unsigned int len)
+{
+	int ret;
+
+	/* Someone else may have set the device up for another slave. */
+	mcp2210_spi_set_transaction_size (map->spi_packet, len);
+	ret = mcp2210_spi_apply (map->fd, map->spi_packet);
+	if (ret < 0)
+		return ret;
+
+	map->stats.transfers++;
+	map->stats.bytes += len;
+	return mcp2210_spi_transfer (map->fd, map->spi_packet, map->buf, len);
+}
+
+/*
+ * Write the values of n consecutive registers to the slave, in as few
+ * transactions as the burst length allows.
+ */
+
+static int
+regmap_raw_write (struct mcp2210_regmap *map, unsigned int reg, const unsigned int *vals, unsigned int n)
+{
+	int reg_bytes = map->config.reg_bytes;
+	int val_bytes = map->config.val_bytes;
+	unsigned int count, i;
+	int ret;
+
+	while (n) {
+		count = n < map->burst_max ? n : map->burst_max;
+		put_be (map->buf, reg | map->config.write_flag, reg_bytes);
+		for (i = 0; i < count; i++)
+			put_be (&map->buf[reg_bytes + i * val_bytes], vals[i], val_bytes);
+
+		ret = regmap_transfer (map, reg_bytes + count * val_bytes);
+		if (ret < 0)
+			return ret;
+
+		reg += count;
+		vals += count;
+		n -= count;
+	}
+
+	return 0;
+}
+
+static int
+regmap_raw_read (struct mcp2210_regmap *map, unsigned int reg, unsigned int *vals, unsigned int n)
+{
+	int reg_bytes = map->config.reg_bytes;
+	int val_bytes = map->config.val_bytes;
+	unsigned int count, i;
+	int ret;
+
+	while (n) {
+		count = n < map->burst_max ? n : map->burst_max;
+		put_be (map->buf, reg | map->config.read_flag, reg_bytes);
+		memset (&map->buf[reg_bytes], 0, count * val_bytes);
+
+		ret = regmap_transfer (map, reg_bytes + count * val_bytes);
+		if (ret < 0)
+			return ret;
+
+		for (i = 0; i < count; i++)
+			vals[i] = get_be (&map->buf[reg_bytes + i * val_bytes], val_bytes);
+
+		reg += count;
+		vals += count;
+		n -= count;
+	}
+
+	return 0;
+}
+
+static int
+regmap_check (struct mcp2210_regmap *map, unsigned int reg, unsigned int n)
+{
+	if (n == 0 || reg > map->config.max_register || n - 1 > map->config.max_register - reg) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read a register. The cached value is used unless the register is
+ * volatile. The write-only registers can only be read from the cache.
+ */
+
+int
+mcp2210_regmap_read (struct mcp2210_regmap *map, unsigned int reg, unsigned int *val)
+{
+	unsigned char state;
+	int ret;
+
+	if (regmap_check (map, reg, 1) == -1)
+		return -1;
+	state = map->state[reg];
+
+	if (!(state & MCP2210_REG_VOLATILE) && (state & REG_VALID)) {
+		map->stats.hits++;
+		*val = map->cache[reg];
+		return 0;
+	}
+	if (state & MCP2210_REG_WRITE_ONLY) {
+		errno = EACCES;
+		return -1;
+	}
+	if (map->cache_only) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	ret = regmap_raw_read (map, reg, val, 1);
+	if (ret < 0)
+		return ret;
+
+	if (!(state & MCP2210_REG_VOLATILE)) {
+		map->cache[reg] = *val;
+		map->state[reg] |= REG_VALID;
+	}
+
+	return 0;
+}
+
+/*
+ * Read n consecutive registers. If all of them are cached, there's no
+ * transfer at all, otherwise a burst slave is read in a single one.
+ */
+
+int
+mcp2210_regmap_bulk_read (struct mcp2210_regmap *map, unsigned int reg, unsigned int *vals, unsigned int n)
+{
+	unsigned char state;
+	int cached = 1;
+	unsigned int i;
+	int ret;
+
+	if (regmap_check (map, reg, n) == -1)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		state = map->state[reg + i];
+		if ((state & MCP2210_REG_VOLATILE) || !(state & REG_VALID)) {
+			if (state & MCP2210_REG_WRITE_ONLY) {
+				errno = EACCES;
+				return -1;
+			}
+			cached = 0;
+		}
+	}
+
+	if (cached) {
+		map->stats.hits += n;
+		memcpy (vals, &map->cache[reg], n * sizeof (*vals));
+		return 0;
+	}
+
+	if (!map->config.burst) {
+		for (i = 0; i < n; i++) {
+			ret = mcp2210_regmap_read (map, reg + i, &vals[i]);
+			if (ret < 0)
+				return ret;
+		}
+		return 0;
+	}
+
+	if (map->cache_only) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	ret = regmap_raw_read (map, reg, vals, n);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < n; i++) {
+		state = map->state[reg + i];
+		if (state & MCP2210_REG_VOLATILE)
+			continue;
+		if (state & (MCP2210_REG_WRITE_ONLY | REG_DIRTY)) {
+			/* The slave doesn't have the value, or doesn't tell it. */
+			vals[i] = map->cache[reg + i];
+		} else {
+			map->cache[reg + i] = vals[i];
+			map->state[reg + i] |= REG_VALID;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write n consecutive registers, in a single burst if the slave supports
+ * it. In the cache-only mode the values are just remembered and written
+ * with mcp2210_regmap_sync().
+ */
+
+int
+mcp2210_regmap_bulk_write (struct mcp2210_regmap *map, unsigned int reg, const unsigned int *vals, unsigned int n)
+{
+	unsigned int i;
+	int ret;
+
+	if (regmap_check (map, reg, n) == -1)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (map->state[reg + i] & MCP2210_REG_READ_ONLY) {
+			errno = EACCES;
+			return -1;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (map->state[reg + i] & MCP2210_REG_VOLATILE)
+			continue;
+		map->cache[reg + i] = vals[i];
+		map->state[reg + i] |= REG_VALID | REG_DIRTY;
+	}
+	if (map->cache_only)
+		return 0;
+
+	if (map->config.burst) {
+		ret = regmap_raw_write (map, reg, vals, n);
+	} else {
+		for (i = 0, ret = 0; i < n && ret == 0; i++)
+			ret = regmap_raw_write (map, reg + i, &vals[i], 1);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (ret < 0)
+			map->state[reg + i] &= ~(REG_VALID | REG_DIRTY);
+		else
+			map->state[reg + i] &= ~REG_DIRTY;
+	}
+
+	return ret;
+}
+
+int
+mcp2210_regmap_write (struct mcp2210_regmap *map, unsigned int reg, unsigned int val)
+{
+	return mcp2210_regmap_bulk_write (map, reg, &val, 1);
+}
+
+/*
+ * Replace the bits of a register in mask with those of val. Nothing is
+ * written if the value stays the same.
+ */
+
+int
+mcp2210_regmap_update_bits (struct mcp2210_regmap *map, unsigned int reg, unsigned int mask, unsigned int val)
+{
+	unsigned int old;
+	int ret;
+
+	ret = mcp2210_regmap_read (map, reg, &old);
+	if (ret < 0)
+		return ret;
+
+	val = (old & ~mask) | (val & mask);
+	if (val == old && !(map->state[reg] & MCP2210_REG_VOLATILE))
+		return 0;
+
+	return mcp2210_regmap_write (map, reg, val);
+}
+
+/*
+ * With enable set, the writes only go to the cache, such as while the
+ * slave is powered down or held in reset.
+ */
+
+void
+mcp2210_regmap_cache_only (struct mcp2210_regmap *map, int enable)
+{
+	map->cache_only = enable;
+}
+
+/*
+ * Tell the map the slave was reset. The registers with known reset
+ * values that are cached with a different value, and those without known
+ * reset values, are to be written by mcp2210_regmap_sync(). The rest
+ * is cached with the reset values.
+ */
+
+void
+mcp2210_regmap_mark_dirty (struct mcp2210_regmap *map)
+{
+	unsigned int reg;
+	unsigned char state;
+
+	for (reg = 0; reg <= map->config.max_register; reg++) {
+		state = map->state[reg];
+		if (state & (MCP2210_REG_VOLATILE | MCP2210_REG_READ_ONLY)) {
+			/* Whatever the slave has now. */
+			map->state[reg] &= ~(REG_VALID | REG_DIRTY);
+		} else if (state & REG_VALID) {
+			if ((state & REG_DEFAULT) && map->cache[reg] == map->defaults[reg])
+				map->state[reg] &= ~REG_DIRTY;
+			else
+				map->state[reg] |= REG_DIRTY;
+			continue;
+		}
+
+		if ((state & REG_DEFAULT) && !(state & MCP2210_REG_VOLATILE)) {
+			map->cache[reg] = map->defaults[reg];
+			map->state[reg] |= REG_VALID;
+		}
+	}
+}
+
+static int
+regmap_writable (struct mcp2210_regmap *map, unsigned int reg)
+{
+	unsigned char state = map->state[reg];
+
+	return (state & REG_VALID) && !(state & (MCP2210_REG_VOLATILE | MCP2210_REG_READ_ONLY));
+}
+
+/*
+ * Write the cached values the slave doesn't have. On a burst slave the
+ * runs of dirty registers are written at once, along with the clean
+ * cached registers between them, if any, which is cheaper than starting
+ * another transaction.
+ */
+
+int
+mcp2210_regmap_sync (struct mcp2210_regmap *map)
+{
+	unsigned int reg, first, last, end;
+	int ret;
+
+	for (reg = 0; reg <= map->config.max_register; reg++) {
+		if (!(map->state[reg] & REG_DIRTY))
+			continue;
+
+		first = last = reg;
+		if (map->config.burst) {
+			end = first + map->burst_max - 1;
+			if (end > map->config.max_register)
+				end = map->config.max_register;
+			for (reg = first + 1; reg <= end && regmap_writable (map, reg); reg++) {
+				if (map->state[reg] & REG_DIRTY)
+					last = reg;
+			}
+		}
+
+		ret = regmap_raw_write (map, first, &map->cache[first], last - first + 1);
+		if (ret < 0)
+			return ret;
+		for (reg = first; reg <= last; reg++)
+			map->state[reg] &= ~REG_DIRTY;
+		reg = last;
+	}
+
+	return 0;
+}
+
+/*
+ * Drop the cached values, so that the registers are read anew.
+ */
+
+void
+mcp2210_regmap_invalidate (struct mcp2210_regmap *map)
+{
+	unsigned int reg;
+
+	for (reg = 0; reg <= map->config.max_register; reg++) {
+		if (!(map->state[reg] & REG_DIRTY))
+			map->state[reg] &= ~REG_VALID;
+	}
+}
+
+void
+mcp2210_regmap_get_stats (struct mcp2210_regmap *map, struct mcp2210_regmap_stats *stats)
+{
+	*stats = map->stats;
+}
@@ -0,0 +1,314 @@
+/*
+ * MCP2210 USB SPI bridge trace replay
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Feeds a session recorded with mcp2210_trace_open() back through
+ * mcp2210_command(), with a forked process acting as the device, or
+ * serves it as a device on a socket.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "mcp2210.h"
+
+unsigned long long
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Print out the trace records, one per line.
+ */
+
+void
+dump_trace (const struct mcp2210_trace_header *trace)
+{
+	struct mcp2210_trace_record *rec;
+	unsigned long long start = 0;
+	unsigned long long n;
+	int i;
+
+	for (n = mcp2210_trace_first (trace); n < trace->count; n++) {
+		rec = mcp2210_trace_record (trace, n);
+		if (!start)
+			start = rec->time_ns;
+
+		printf ("%12.6f %3d %c %3d ", (rec->time_ns - start) / 1e9,
+			rec->fd, rec->dir, rec->result);
+		for (i = 0; i < MCP2210_PACKET_SIZE; i++)
+			printf ("%02x", rec->packet[i]);
+		printf ("\n");
+	}
+}
+
+/*
+ * Issue the recorded commands against a device that answers with the
+ * recorded responses. With timed set, the commands are issued at the same
+ * pace as they were recorded. Returns the number of responses that
+ * differed from the recorded ones.
+ */
+
+int
+replay_trace (int fd, const struct mcp2210_trace_header *trace, int timed)
+{
+	struct mcp2210_trace_record *w, *r;
+	unsigned long long min = ~0ULL, max = 0, total = 0;
+	unsigned long long first = 0, last = 0;
+	unsigned long long start, t;
+	unsigned long long n;
+	mcp2210_packet packet;
+	int mismatches = 0;
+	int count = 0;
+	int ret;
+
+	start = now_ns ();
+	n = mcp2210_trace_first (trace);
+	while (mcp2210_trace_next (trace, &n, &w, &r)) {
+		if (!first)
+			first = w->time_ns;
+		last = r->time_ns;
+
+		if (timed) {
+			struct timespec ts;
+
+			t = start + (w->time_ns - first);
+			ts.tv_sec = t / 1000000000ULL;
+			ts.tv_nsec = t % 1000000000ULL;
+			while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		}
+
+		memcpy (packet, w->packet, MCP2210_PACKET_SIZE);
+		t = now_ns ();
+		ret = mcp2210_command (fd, packet, packet[0]);
+		t = now_ns () - t;
+		if (ret == -1) {
+			perror ("Replay");
+			break;
+		}
+
+		if (memcmp (packet, r->packet, MCP2210_PACKET_SIZE))
+			mismatches++;
+
+		if (t < min)
+			min = t;
+		if (t > max)
+			max = t;
+		total += t;
+		count++;
+	}
+	t = now_ns () - start;
+
+	if (count == 0) {
+		fprintf (stderr, "No commands in the trace\n");
+		return 0;
+	}
+
+	printf ("Commands replayed: %d\n", count);
+	printf ("Recorded duration: %.6f s\n", (last - first) / 1e9);
+	printf ("Replay duration: %.6f s (%.0f commands/s)\n", t / 1e9, count / (t / 1e9));
+	printf ("Command latency: min %.1f us, avg %.1f us, max %.1f us\n",
+		min / 1e3, total / 1e3 / count, max / 1e3);
+	printf ("Responses mismatched: %d\n", mismatches);
+
+	return mismatches;
+}
+
+/*
+ * Serve the trace to the clients that connect to the address, one at a
+ * time, each one from the beginning.
+ */
+
+int
+listen_trace (const char *addr, const struct mcp2210_trace_header *trace)
+{
+	int lfd, fd;
+	int ret;
+
+	lfd = mcp2210_socket (addr, 1);
+	if (lfd == -1) {
+		perror (addr);
+		return 1;
+	}
+
+	while (1) {
+		fd = accept (lfd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR)
+				continue;
+			perror ("accept");
+			return 1;
+		}
+
+		if (mcp2210_set_transport (fd, &mcp2210_socket_transport, NULL) == -1) {
+			perror ("mcp2210_set_transport");
+			close (fd);
+			continue;
+		}
+
+		ret = mcp2210_trace_serve (fd, trace);
+		if (ret < 0)
+			fprintf (stderr, "Device: %s\n", mcp2210_strerror (ret));
+		else
+			printf ("Requests mismatched: %d\n", ret);
+		fflush (stdout);
+		mcp2210_close (fd);
+	}
+}
+
+/*
+ * Print the records of a capture between from and to seconds after the
+ * first one. Only the chunks that cover the range are read.
+ */
+
+int
+dump_capture (const char *path, double from, double to)
+{
+	const struct mcp2210_capture_index *index;
+	struct mcp2210_capture_record rec;
+	struct mcp2210_capture *cap;
+	unsigned long long chunks, start;
+	const unsigned char *data;
+	unsigned int i;
+	int ret;
+
+	cap = mcp2210_capture_open (path);
+	if (cap == NULL) {
+		perror (path);
+		return 1;
+	}
+
+	index = mcp2210_capture_get_index (cap, &chunks);
+	start = chunks ? index[0].first_ns : 0;
+	mcp2210_capture_seek (cap, start + from * 1e9);
+
+	while ((ret = mcp2210_capture_read (cap, &rec, (const void **)&data)) == 1) {
+		if (rec.time_ns > start + to * 1e9)
+			break;
+		printf ("%12.6f %3u %03x %3u %c %5u ", (rec.time_ns - start) / 1e9,
+			rec.device, rec.cs, rec.job, rec.type, rec.len);
+		for (i = 0; i < rec.len; i++)
+			printf ("%02x", data[i]);
+		printf ("\n");
+	}
+	if (ret == -1)
+		perror (path);
+
+	mcp2210_capture_close (cap);
+	return ret == -1;
+}
+
+int
+main (int argc, char *argv[])
+{
+	struct mcp2210_trace_header *trace;
+	const char *listen_addr = NULL;
+	double from = 0, to = 1e12;
+	int capture = 0;
+	int timed = 0;
+	int dump = 0;
+	int status;
+	int sv[2];
+	pid_t pid;
+	int ret;
+	int i;
+
+	for (i = 1; i < argc - 1; i++) {
+		if (strcmp (argv[i], "--timed") == 0) {
+			timed = 1;
+		} else if (strcmp (argv[i], "--dump") == 0) {
+			dump = 1;
+		} else if (strcmp (argv[i], "--listen") == 0 && i + 2 < argc) {
+			listen_addr = argv[++i];
+		} else if (strcmp (argv[i], "--capture") == 0) {
+			capture = 1;
+		} else if (strcmp (argv[i], "--from") == 0 && i + 2 < argc) {
+			from = strtod (argv[++i], NULL);
+		} else if (strcmp (argv[i], "--to") == 0 && i + 2 < argc) {
+			to = strtod (argv[++i], NULL);
+		} else {
+			fprintf (stderr, "Unknown option: '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (i != argc - 1) {
+		fprintf (stderr, "Usage: %s [--timed] [--dump] [--listen unix:<path>|tcp:[<host>:]<port>] trace\n", argv[0]);
+		fprintf (stderr, "       %s --capture [--from <seconds>] [--to <seconds>] capture\n", argv[0]);
+		return 1;
+	}
+
+	if (capture)
+		return dump_capture (argv[i], from, to);
+
+	trace = mcp2210_trace_map (argv[i]);
+	if (trace == NULL) {
+		perror (argv[i]);
+		return 1;
+	}
+
+	if (dump) {
+		dump_trace (trace);
+		return 0;
+	}
+
+	if (listen_addr)
+		return listen_trace (listen_addr, trace);
+
+	/* Sequential packets keep the report boundaries, as hidraw does. */
+	if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror ("socketpair");
+		return 1;
+	}
+
+	pid = fork ();
+	if (pid == -1) {
+		perror ("fork");
+		return 1;
+	}
+
+	if (pid == 0) {
+		close (sv[0]);
+		ret = mcp2210_trace_serve (sv[1], trace);
+		if (ret < 0) {
+			fprintf (stderr, "Device: %s\n", mcp2210_strerror (ret));
+			_exit (255);
+		}
+		_exit (ret > 254 ? 254 : ret);
+	}
+
+	close (sv[1]);
+	ret = replay_trace (sv[0], trace, timed);
+	close (sv[0]);
+
+	if (waitpid (pid, &status, 0) == -1) {
+		perror ("waitpid");
+		return 1;
+	}
+	if (!WIFEXITED (status) || WEXITSTATUS (status) == 255)
+		return 1;
+	printf ("Requests mismatched: %d\n", WEXITSTATUS (status));
+
+	return ret || WEXITSTATUS (status) ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Real-time execution. The thread doing the I/O can be pinned to CPUs and
+ * given a real-time priority, the memory locked, and the waits for the
+ * device are done to absolute deadlines, with the wakeup latency measured.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "mcp2210.h"
+
+/* Wakeup latency statistics of all the threads.  */
+
+static struct mcp2210_rt_stats rt_stats = { 0, };
+
+/*
+ * Set up the calling thread for real-time work. It's pinned to the ncpus
+ * CPUs listed in cpus, unless ncpus is zero, and scheduled with SCHED_FIFO
+ * at the given priority, unless it's zero. With lock set, all the memory
+ * of the process, present and future, is locked. The threads the calling
+ * thread creates afterwards inherit the settings.
+ */
+
+int
+mcp2210_rt_setup (const int *cpus, int ncpus, int priority, int lock)
+{
+	struct sched_param param = { 0, };
+	cpu_set_t set;
+	int i;
+
+	if (ncpus) {
+		CPU_ZERO (&set);
+		for (i = 0; i < ncpus; i++) {
+			if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+				errno = EINVAL;
+				return -1;
+			}
+			CPU_SET (cpus[i], &set);
+		}
+		errno = pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+		if (errno)
+			return -1;
+	}
+
+	if (priority) {
+		param.sched_priority = priority;
+		errno = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+		if (errno)
+			return -1;
+	}
+
+	if (lock && mlockall (MCL_CURRENT | MCL_FUTURE) == -1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Add a number of nanoseconds to a point in time.
+ */
+
+void
+mcp2210_rt_deadline (struct timespec *deadline, unsigned long long ns)
+{
+	ns += deadline->tv_nsec;
+	deadline->tv_sec += ns / 1000000000ULL;
+	deadline->tv_nsec = ns % 1000000000ULL;
+}
+
+/*
+ * Sleep until the deadline on the monotonic clock, then account how late
+ * the thread woke up. A deadline that has already passed, such as when
+ * the command took longer than the delay, doesn't count as a wakeup.
+ */
+
+void
+mcp2210_rt_sleep_until (const struct timespec *deadline)
+{
+	struct timespec now;
+	unsigned long long max;
+	long long late;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > deadline->tv_sec
+	    || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec))
+		return;
+
+	while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR);
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	late = (now.tv_sec - deadline->tv_sec) * 1000000000LL + now.tv_nsec - deadline->tv_nsec;
+	if (late < 0)
+		late = 0;
+
+	__atomic_add_fetch (&rt_stats.wakeups, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&rt_stats.total_ns, late, __ATOMIC_RELAXED);
+	max = __atomic_load_n (&rt_stats.max_ns, __ATOMIC_RELAXED);
+	while (late > max && !__atomic_compare_exchange_n (&rt_stats.max_ns, &max, late, 1,
+							    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * Get the wakeup latency statistics and optionally start over.
+ */
+
+void
+mcp2210_rt_get_stats (struct mcp2210_rt_stats *stats, int reset)
+{
+	stats->wakeups = __atomic_load_n (&rt_stats.wakeups, __ATOMIC_RELAXED);
+	stats->total_ns = __atomic_load_n (&rt_stats.total_ns, __ATOMIC_RELAXED);
+	stats->max_ns = __atomic_load_n (&rt_stats.max_ns, __ATOMIC_RELAXED);
+
+	if (reset) {
+		__atomic_store_n (&rt_stats.wakeups, 0, __ATOMIC_RELAXED);
+		__atomic_store_n (&rt_stats.total_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n (&rt_stats.max_ns, 0, __ATOMIC_RELAXED);
+	}
+}
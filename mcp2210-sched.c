@@ -0,0 +1,468 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Periodic SPI transfers to multiple slaves. The jobs are laid out into a
+ * cyclic schedule of slots, one slot per tick of the greatest common
+ * divisor of their periods, for as many ticks as it takes until they all
+ * line up again. Within a slot, the jobs that share the SPI settings run
+ * one after another, so that the settings change as rarely as possible.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mcp2210.h"
+
+struct sched_job {
+	mcp2210_packet spi_packet;
+	unsigned char *tx;
+	unsigned short len;
+	unsigned int ticks;
+	int class;
+
+	/* The samples, written by the scheduler and read by anyone else. */
+	struct mcp2210_sched_sample *samples;
+	unsigned char *data;
+	unsigned int nsamples;
+	unsigned int head, tail;
+
+	struct mcp2210_sched_stats stats;
+};
+
+struct mcp2210_sched {
+	int fd;
+	struct sched_job *jobs;
+	int njobs;
+
+	unsigned long long tick_ns;
+	unsigned int slots;
+	unsigned int *slot_start;
+	int *order;
+
+	char *buf;
+};
+
+static unsigned long long
+gcd (unsigned long long a, unsigned long long b)
+{
+	unsigned long long t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+static int
+due (const struct sched_job *job, unsigned int slot)
+{
+	return slot % job->ticks == 0;
+}
+
+/*
+ * Order the jobs due in the slot. The ones with the settings that are in
+ * effect from the previous slot go first and the ones with the settings
+ * that are needed in the next slot go last, the rest are grouped by their
+ * settings in between. Returns the settings in effect at the end.
+ */
+
+static int
+sched_order_slot (struct mcp2210_sched *sched, unsigned int slot, int prev)
+{
+	int *e = &sched->order[sched->slot_start[slot]];
+	int n = sched->slot_start[slot + 1] - sched->slot_start[slot];
+	unsigned int next = (slot + 1) % sched->slots;
+	int first, last = -1;
+	/* Sized by all the jobs, a slot may have none due. */
+	int rank[sched->njobs];
+	int i, j, t;
+
+	if (n == 0)
+		return prev;
+	for (i = 0, j = 0; j < sched->njobs; j++) {
+		if (due (&sched->jobs[j], slot))
+			e[i++] = j;
+	}
+
+	first = sched->jobs[e[0]].class;
+	for (i = 0; i < n; i++) {
+		if (sched->jobs[e[i]].class == prev)
+			first = prev;
+	}
+
+	for (i = 0; i < n && last == -1; i++) {
+		if (sched->jobs[e[i]].class == first)
+			continue;
+		for (j = 0; j < sched->njobs; j++) {
+			if (due (&sched->jobs[j], next) && sched->jobs[j].class == sched->jobs[e[i]].class)
+				last = sched->jobs[j].class;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		rank[i] = sched->jobs[e[i]].class;
+		if (rank[i] == first)
+			rank[i] = -1;
+		else if (rank[i] == last)
+			rank[i] = sched->njobs;
+	}
+
+	/* A stable insertion sort, there are few jobs to a slot. */
+	for (i = 1; i < n; i++) {
+		for (j = i; j > 0 && rank[j - 1] > rank[j]; j--) {
+			t = rank[j];
+			rank[j] = rank[j - 1];
+			rank[j - 1] = t;
+			t = e[j];
+			e[j] = e[j - 1];
+			e[j - 1] = t;
+		}
+	}
+
+	return sched->jobs[e[n - 1]].class;
+}
+
+/*
+ * Lay out the schedule for njobs jobs that transfer on fd. The job table
+ * and the data it points to are copied.
+ */
+
+struct mcp2210_sched *
+mcp2210_sched_new (int fd, const struct mcp2210_sched_job *jobs, int njobs)
+{
+	struct mcp2210_sched *sched;
+	unsigned long long tick = 0, cycle = 1;
+	unsigned short maxlen = 0;
+	unsigned int slot;
+	int i, j, n;
+	int prev;
+
+	if (njobs <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].period_us == 0 || jobs[i].len == 0 || jobs[i].samples == 0) {
+			errno = EINVAL;
+			return NULL;
+		}
+		tick = gcd (tick, jobs[i].period_us);
+		if (jobs[i].len > maxlen)
+			maxlen = jobs[i].len;
+	}
+	for (i = 0; i < njobs; i++) {
+		cycle = cycle / gcd (cycle, jobs[i].period_us / tick) * (jobs[i].period_us / tick);
+		if (cycle > MCP2210_SCHED_SLOTS_MAX) {
+			errno = E2BIG;
+			return NULL;
+		}
+	}
+
+	sched = calloc (1, sizeof (*sched));
+	if (sched == NULL)
+		return NULL;
+
+	sched->fd = fd;
+	sched->tick_ns = tick * 1000;
+	sched->slots = cycle;
+	sched->njobs = njobs;
+	sched->jobs = calloc (njobs, sizeof (*sched->jobs));
+	sched->slot_start = calloc (cycle + 1, sizeof (*sched->slot_start));
+	sched->buf = malloc (maxlen);
+	if (sched->jobs == NULL || sched->slot_start == NULL || sched->buf == NULL)
+		goto nomem;
+
+	for (i = 0; i < njobs; i++) {
+		struct sched_job *job = &sched->jobs[i];
+
+		memcpy (job->spi_packet, jobs[i].spi_packet, MCP2210_PACKET_SIZE);
+		mcp2210_spi_set_transaction_size (job->spi_packet, jobs[i].len);
+		job->len = jobs[i].len;
+		job->ticks = jobs[i].period_us / tick;
+		job->nsamples = jobs[i].samples;
+		job->tx = malloc (job->len);
+		job->samples = calloc (job->nsamples, sizeof (*job->samples));
+		job->data = malloc ((size_t)job->nsamples * job->len);
+		if (job->tx == NULL || job->samples == NULL || job->data == NULL)
+			goto nomem;
+		if (jobs[i].tx)
+			memcpy (job->tx, jobs[i].tx, job->len);
+		else
+			memset (job->tx, 0, job->len);
+
+		/* The jobs with the same settings are of the same class. */
+		job->class = i;
+		for (j = 0; j < i; j++) {
+			if (mcp2210_settings_cmp (sched->jobs[j].spi_packet, job->spi_packet,
+						  MCP2210_NVRAM_PARAM_SPI) == 0) {
+				job->class = sched->jobs[j].class;
+				break;
+			}
+		}
+	}
+
+	for (slot = 0, n = 0; slot < cycle; slot++) {
+		sched->slot_start[slot] = n;
+		for (i = 0; i < njobs; i++)
+			n += due (&sched->jobs[i], slot);
+	}
+	sched->slot_start[cycle] = n;
+
+	sched->order = calloc (n, sizeof (*sched->order));
+	if (sched->order == NULL)
+		goto nomem;
+
+	/* The first slot follows the last one. */
+	prev = -1;
+	for (slot = 0; slot < cycle; slot++)
+		prev = sched_order_slot (sched, slot, prev);
+	sched_order_slot (sched, 0, prev);
+
+	return sched;
+
+nomem:
+	mcp2210_sched_free (sched);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void
+mcp2210_sched_free (struct mcp2210_sched *sched)
+{
+	int i;
+
+	if (sched->jobs) {
+		for (i = 0; i < sched->njobs; i++) {
+			free (sched->jobs[i].tx);
+			free (sched->jobs[i].samples);
+			free (sched->jobs[i].data);
+		}
+	}
+	free (sched->jobs);
+	free (sched->slot_start);
+	free (sched->order);
+	free (sched->buf);
+	free (sched);
+}
+
+static unsigned long long
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+stat_add (unsigned long long *stat, unsigned long long val)
+{
+	__atomic_add_fetch (stat, val, __ATOMIC_RELAXED);
+}
+
+static void
+sched_push (struct sched_job *job, unsigned long long time_ns, int result, const char *data)
+{
+	unsigned int head = job->head;
+	unsigned int tail = __atomic_load_n (&job->tail, __ATOMIC_ACQUIRE);
+	struct mcp2210_sched_sample *sample;
+
+	if (head - tail == job->nsamples) {
+		stat_add (&job->stats.dropped, 1);
+		return;
+	}
+
+	sample = &job->samples[head % job->nsamples];
+	sample->time_ns = time_ns;
+	sample->result = result;
+	sample->len = job->len;
+	memcpy (&job->data[(size_t)(head % job->nsamples) * job->len], data, job->len);
+
+	__atomic_store_n (&job->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Run a job released at the given time, changing the settings if the
+ * previous job used different ones.
+ */
+
+static int
+sched_job_run (struct mcp2210_sched *sched, struct sched_job *job, unsigned long long release, int *class)
+{
+	unsigned long long start, jitter, max;
+	mcp2210_packet packet;
+	int ret = 0;
+
+	start = now_ns ();
+	jitter = start - release;
+	stat_add (&job->stats.runs, 1);
+	stat_add (&job->stats.jitter_total_ns, jitter);
+	max = __atomic_load_n (&job->stats.jitter_max_ns, __ATOMIC_RELAXED);
+	if (jitter > max)
+		__atomic_store_n (&job->stats.jitter_max_ns, jitter, __ATOMIC_RELAXED);
+
+	if (*class != job->class) {
+		memcpy (packet, job->spi_packet, MCP2210_PACKET_SIZE);
+		stat_add (&job->stats.sets, 1);
+		ret = mcp2210_command (sched->fd, packet, MCP2210_SPI_SET);
+		if (ret == 0)
+			*class = job->class;
+	}
+
+	memcpy (sched->buf, job->tx, job->len);
+	if (ret == 0)
+		ret = mcp2210_spi_transfer (sched->fd, job->spi_packet, sched->buf, job->len);
+	if (ret < 0) {
+		/* Not sure what state the device is in. */
+		*class = -1;
+		stat_add (&job->stats.errors, 1);
+	}
+
+	if (now_ns () > release + job->ticks * sched->tick_ns)
+		stat_add (&job->stats.missed, 1);
+
+	sched_push (job, start, ret, sched->buf);
+
+	return ret;
+}
+
+/*
+ * Run the schedule for the number of cycles, or until cancelled if that
+ * is zero. The slots that start too late to be run before the next one
+ * are skipped, with their jobs counted as missed.
+ */
+
+int
+mcp2210_sched_run (struct mcp2210_sched *sched, unsigned long long cycles)
+{
+	unsigned long long release, cycle;
+	struct timespec deadline;
+	unsigned int slot, i;
+	int class = -1;
+	int ret;
+
+	clock_gettime (CLOCK_MONOTONIC, &deadline);
+
+	for (cycle = 0; cycles == 0 || cycle < cycles; cycle++) {
+		for (slot = 0; slot < sched->slots; slot++) {
+			if (mcp2210_cancelled (sched->fd))
+				return -MCP2210_ECANCELED;
+
+			mcp2210_rt_sleep_until (&deadline);
+			release = deadline.tv_sec * 1000000000ULL + deadline.tv_nsec;
+			mcp2210_rt_deadline (&deadline, sched->tick_ns);
+
+			for (i = sched->slot_start[slot]; i < sched->slot_start[slot + 1]; i++) {
+				struct sched_job *job = &sched->jobs[sched->order[i]];
+
+				if (now_ns () >= release + sched->tick_ns) {
+					stat_add (&job->stats.missed, 1);
+					continue;
+				}
+
+				ret = sched_job_run (sched, job, release, &class);
+				if (ret == -1 || ret == -MCP2210_ECANCELED)
+					return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Take the oldest sample of a job, with its data copied to data. Returns
+ * one if there was a sample and zero if there was none. Can be called
+ * from a thread other than the one that runs the schedule.
+ */
+
+int
+mcp2210_sched_read (struct mcp2210_sched *sched, int job, struct mcp2210_sched_sample *sample, void *data)
+{
+	struct sched_job *j = &sched->jobs[job];
+	unsigned int tail = j->tail;
+	unsigned int head = __atomic_load_n (&j->head, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return 0;
+
+	*sample = j->samples[tail % j->nsamples];
+	memcpy (data, &j->data[(size_t)(tail % j->nsamples) * j->len], j->len);
+
+	__atomic_store_n (&j->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Get the statistics of a job and optionally start over.
+ */
+
+static unsigned long long
+stat_take (unsigned long long *stat, int reset)
+{
+	if (reset)
+		return __atomic_exchange_n (stat, 0, __ATOMIC_RELAXED);
+	return __atomic_load_n (stat, __ATOMIC_RELAXED);
+}
+
+void
+mcp2210_sched_get_stats (struct mcp2210_sched *sched, int job, struct mcp2210_sched_stats *stats, int reset)
+{
+	struct mcp2210_sched_stats *s = &sched->jobs[job].stats;
+
+	stats->runs = stat_take (&s->runs, reset);
+	stats->missed = stat_take (&s->missed, reset);
+	stats->sets = stat_take (&s->sets, reset);
+	stats->errors = stat_take (&s->errors, reset);
+	stats->dropped = stat_take (&s->dropped, reset);
+	stats->jitter_total_ns = stat_take (&s->jitter_total_ns, reset);
+	stats->jitter_max_ns = stat_take (&s->jitter_max_ns, reset);
+}
+
+/*
+ * The number of slots in a cycle and the number of times the settings
+ * change over it, with the jobs in the order they are run.
+ */
+
+unsigned int
+mcp2210_sched_changes (struct mcp2210_sched *sched, unsigned int *slots)
+{
+	unsigned int changes = 0;
+	unsigned int i, n;
+	int class;
+
+	if (slots)
+		*slots = sched->slots;
+
+	n = sched->slot_start[sched->slots];
+	if (n == 0)
+		return 0;
+
+	class = sched->jobs[sched->order[n - 1]].class;
+	for (i = 0; i < n; i++) {
+		if (sched->jobs[sched->order[i]].class != class)
+			changes++;
+		class = sched->jobs[sched->order[i]].class;
+	}
+
+	return changes;
+}
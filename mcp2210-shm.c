@@ -0,0 +1,230 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Device state shared with other processes. A single poller publishes the
+ * responses to the GET commands in a shared mapping, under a sequence lock,
+ * and any number of readers take consistent copies of them without issuing
+ * commands or even system calls of their own.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mcp2210.h"
+
+/* The commands that fill the sections.  */
+
+static const unsigned short shm_get[MCP2210_SHM_SECTIONS] = {
+	[MCP2210_SHM_STATUS] = MCP2210_STATUS_GET,
+	[MCP2210_SHM_GPIO_VAL] = MCP2210_GPIO_VAL_GET,
+	[MCP2210_SHM_GPIO_DIR] = MCP2210_GPIO_DIR_GET,
+	[MCP2210_SHM_CHIP] = MCP2210_CHIP_GET,
+	[MCP2210_SHM_SPI] = MCP2210_SPI_GET,
+	[MCP2210_SHM_GP6_COUNT] = MCP2210_GP6_COUNT_GET,
+};
+
+/*
+ * Create the shared state at path, such as a file in /dev/shm, for the
+ * poller to publish into.
+ */
+
+struct mcp2210_shm *
+mcp2210_shm_create (const char *path)
+{
+	struct mcp2210_shm *shm;
+	int fd;
+
+	fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return NULL;
+	if (ftruncate (fd, sizeof (*shm)) == -1) {
+		close (fd);
+		return NULL;
+	}
+	shm = mmap (NULL, sizeof (*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	shm->version = MCP2210_SHM_VERSION;
+	__atomic_store_n (&shm->seq, 0, __ATOMIC_RELAXED);
+	memcpy (shm->magic, MCP2210_SHM_MAGIC, sizeof (shm->magic));
+
+	return shm;
+}
+
+/*
+ * Map the shared state at path for reading.
+ */
+
+const struct mcp2210_shm *
+mcp2210_shm_open (const char *path)
+{
+	struct mcp2210_shm *shm;
+	struct stat st;
+	int fd;
+
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+	if (fstat (fd, &st) == -1) {
+		close (fd);
+		return NULL;
+	}
+	if (st.st_size != sizeof (*shm)) {
+		close (fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	shm = mmap (NULL, sizeof (*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	if (memcmp (shm->magic, MCP2210_SHM_MAGIC, sizeof (shm->magic)) != 0
+	    || shm->version != MCP2210_SHM_VERSION) {
+		munmap (shm, sizeof (*shm));
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return shm;
+}
+
+void
+mcp2210_shm_close (const struct mcp2210_shm *shm)
+{
+	munmap ((void *)shm, sizeof (*shm));
+}
+
+/*
+ * Publish the response packet for a section, with the result of the
+ * command and the time it was taken at. Only a single process or thread
+ * may publish into the state.
+ */
+
+void
+mcp2210_shm_publish (struct mcp2210_shm *shm, const mcp2210_packet *packets, const int *results,
+		unsigned int sections)
+{
+	unsigned long long now;
+	struct timespec ts;
+	unsigned int seq;
+	int i;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	/* An odd sequence number tells the readers to wait. */
+	seq = __atomic_load_n (&shm->seq, __ATOMIC_RELAXED);
+	__atomic_store_n (&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	for (i = 0; i < MCP2210_SHM_SECTIONS; i++) {
+		if (!(sections & (1 << i)))
+			continue;
+		shm->sections[i].time_ns = now;
+		shm->sections[i].result = results[i];
+		memcpy (shm->sections[i].packet, packets[i], MCP2210_PACKET_SIZE);
+	}
+	shm->updates++;
+
+	__atomic_store_n (&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Issue the GET commands for the sections in the bit mask, as a single
+ * batch, and publish the responses. The GP6 counter is not reset. Returns
+ * the first error. The sections that failed on the device are published
+ * along with their results; nothing is published if the batch didn't
+ * complete.
+ */
+
+int
+mcp2210_shm_poll (int fd, struct mcp2210_shm *shm, unsigned int sections)
+{
+	mcp2210_packet packets[MCP2210_SHM_SECTIONS];
+	mcp2210_packet batch[MCP2210_SHM_SECTIONS];
+	int results[MCP2210_SHM_SECTIONS];
+	int n = 0;
+	int ret;
+	int i;
+
+	memset (batch, 0, sizeof (batch));
+	for (i = 0; i < MCP2210_SHM_SECTIONS; i++) {
+		if (!(sections & (1 << i)))
+			continue;
+		batch[n][0] = shm_get[i];
+		if (i == MCP2210_SHM_GP6_COUNT)
+			batch[n][1] = 1;
+		n++;
+	}
+
+	/* The batch was cut short; the packets are not all responses. */
+	ret = mcp2210_commands (fd, batch, n);
+	if (ret == -1 || ret == -MCP2210_EWRSHORT || ret == -MCP2210_ERDSHORT)
+		return ret;
+
+	for (i = 0, n = 0; i < MCP2210_SHM_SECTIONS; i++) {
+		if (!(sections & (1 << i)))
+			continue;
+		memcpy (packets[i], batch[n], MCP2210_PACKET_SIZE);
+		if (batch[n][1])
+			results[i] = -batch[n][1];
+		else if (batch[n][0] != shm_get[i])
+			results[i] = -MCP2210_EBADCMD;
+		else
+			results[i] = 0;
+		n++;
+	}
+	mcp2210_shm_publish (shm, packets, results, sections);
+
+	return ret;
+}
+
+/*
+ * Take a consistent copy of the sections, retrying while the poller
+ * is publishing. Returns the number of updates published so far.
+ */
+
+unsigned long long
+mcp2210_shm_read (const struct mcp2210_shm *shm, struct mcp2210_shm_section *sections)
+{
+	unsigned long long updates;
+	unsigned int seq;
+
+	while (1) {
+		seq = __atomic_load_n (&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield ();
+			continue;
+		}
+
+		memcpy (sections, shm->sections, sizeof (shm->sections));
+		updates = shm->updates;
+
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (__atomic_load_n (&shm->seq, __ATOMIC_RELAXED) == seq)
+			return updates;
+	}
+}
@@ -0,0 +1,673 @@
+/*
+ * MCP2210 USB SPI bridge spidev emulation
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * A library to be preloaded into programs that use the Linux spidev
+ * interface. Opening the path in MCP2210_SPIDEV opens the MCP2210 device
+ * in MCP2210_DEVICE instead, and the spidev ioctls, reads and writes are
+ * turned into MCP2210 transactions.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/spi/spidev.h>
+
+#include "mcp2210.h"
+
+#define SPIDEV_MAX	16
+
+/* Mode bits that can be emulated.  */
+#define SPIDEV_MODES	(SPI_CPHA | SPI_CPOL | SPI_CS_HIGH | SPI_NO_CS)
+
+struct spidev {
+	pthread_mutex_t lock;	/* Held for the transfers. */
+	int fd;			/* The handle given to the program. */
+	int dev;		/* The MCP2210 device. */
+	mcp2210_packet chip;	/* Runtime settings as on the device. */
+	mcp2210_packet spi;
+	uint32_t mode;
+	uint32_t speed;
+};
+
+/*
+ * Every read(), write(), ioctl() and close() in the program looks the
+ * descriptor up, so the lookup takes no locks: the handles are published
+ * with atomic stores once the device is set up, and there's nothing to
+ * look through unless a device is open. That keeps the calls on other
+ * descriptors safe in signal handlers too. The lock only guards taking
+ * a free slot.
+ */
+
+static struct spidev spidevs[SPIDEV_MAX];
+static int spidev_count = 0;
+static pthread_mutex_t spidev_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Whether open() has the mode argument, as glibc has it.  */
+#define NEEDS_MODE(flags)	(((flags) & O_CREAT) || ((flags) & O_TMPFILE) == O_TMPFILE)
+
+static int (*real_open) (const char *path, int flags, ...);
+static int (*real_open64) (const char *path, int flags, ...);
+static int (*real_openat) (int dirfd, const char *path, int flags, ...);
+static int (*real_openat64) (int dirfd, const char *path, int flags, ...);
+static int (*real_close) (int fd);
+static int (*real_ioctl) (int fd, unsigned long request, ...);
+static ssize_t (*real_read) (int fd, void *buf, size_t count);
+static ssize_t (*real_write) (int fd, const void *buf, size_t count);
+
+static void __attribute__((constructor))
+spidev_init (void)
+{
+	int i;
+
+	real_open = dlsym (RTLD_NEXT, "open");
+	real_open64 = dlsym (RTLD_NEXT, "open64");
+	real_openat = dlsym (RTLD_NEXT, "openat");
+	real_openat64 = dlsym (RTLD_NEXT, "openat64");
+	real_close = dlsym (RTLD_NEXT, "close");
+	real_ioctl = dlsym (RTLD_NEXT, "ioctl");
+	real_read = dlsym (RTLD_NEXT, "read");
+	real_write = dlsym (RTLD_NEXT, "write");
+
+	for (i = 0; i < SPIDEV_MAX; i++) {
+		pthread_mutex_init (&spidevs[i].lock, NULL);
+		spidevs[i].fd = -1;
+	}
+}
+
+static struct spidev *
+spidev_get (int fd)
+{
+	int i;
+
+	if (fd < 0 || __atomic_load_n (&spidev_count, __ATOMIC_ACQUIRE) == 0)
+		return NULL;
+
+	for (i = 0; i < SPIDEV_MAX; i++) {
+		if (__atomic_load_n (&spidevs[i].fd, __ATOMIC_ACQUIRE) == fd)
+			return &spidevs[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Look the descriptor up and lock the device. It's checked again with the
+ * lock held, since it may have been closed in the meantime.
+ */
+
+static struct spidev *
+spidev_acquire (int fd)
+{
+	struct spidev *s;
+
+	s = spidev_get (fd);
+	if (s == NULL)
+		return NULL;
+
+	pthread_mutex_lock (&s->lock);
+	if (__atomic_load_n (&s->fd, __ATOMIC_RELAXED) != fd) {
+		pthread_mutex_unlock (&s->lock);
+		return NULL;
+	}
+
+	return s;
+}
+
+/* Set the device errno from a library return value.  */
+
+static int
+spidev_error (int ret)
+{
+	if (ret == -1)
+		return -1;
+
+	switch (-ret) {
+	case MCP2210_ESPIBUSY:
+	case MCP2210_ESPIINPROGRESS:
+		errno = EBUSY;
+		break;
+	default:
+		errno = EIO;
+		break;
+	}
+
+	return -1;
+}
+
+/*
+ * Bring the runtime SPI settings to the wanted ones, if they differ.
+ * The transaction size is left to mcp2210_spi_transfer_large().
+ */
+
+static int
+spidev_apply (struct spidev *s, mcp2210_packet want)
+{
+	mcp2210_packet packet;
+	int ret;
+
+	mcp2210_spi_set_transaction_size (want, mcp2210_spi_get_transaction_size (s->spi));
+	if (mcp2210_settings_cmp (want, s->spi, MCP2210_NVRAM_PARAM_SPI) == 0)
+		return 0;
+
+	memcpy (packet, want, MCP2210_PACKET_SIZE);
+	ret = mcp2210_command (s->dev, packet, MCP2210_SPI_SET);
+	if (ret < 0)
+		return spidev_error (ret);
+	memcpy (s->spi, want, MCP2210_PACKET_SIZE);
+
+	return 0;
+}
+
+/*
+ * Fill in the settings that follow from the spidev mode. With SPI_NO_CS
+ * the CS pins are kept at their idle level. If MCP2210_CS is set, only
+ * that pin acts as a chip select.
+ */
+
+static void
+spidev_mode (struct spidev *s, mcp2210_packet spi, uint32_t speed, unsigned int delay,
+		unsigned int byte_delay)
+{
+	const char *cs = getenv ("MCP2210_CS");
+	int active = !!(s->mode & SPI_CS_HIGH);
+	int pin;
+
+	memcpy (spi, s->spi, MCP2210_PACKET_SIZE);
+	mcp2210_spi_set_mode (spi, s->mode & (SPI_CPHA | SPI_CPOL));
+
+	for (pin = 0; pin <= MCP2210_GPIO_PINS; pin++) {
+		mcp2210_spi_set_pin_idle_cs (spi, pin, !active);
+		if ((s->mode & SPI_NO_CS) || (cs && atoi (cs) != pin))
+			mcp2210_spi_set_pin_active_cs (spi, pin, !active);
+		else
+			mcp2210_spi_set_pin_active_cs (spi, pin, active);
+	}
+
+	if (speed > 12000000)
+		speed = 12000000;
+	if (speed < 1464)
+		speed = 1464;
+	mcp2210_spi_set_bitrate (spi, speed);
+
+	/* The delays are in 100 us units; don't make them shorter. */
+	mcp2210_spi_set_cs_data_delay_100us (spi, 0);
+	mcp2210_spi_set_data_cs_delay_100us (spi, (delay + 99) / 100);
+	mcp2210_spi_set_byte_delay_100us (spi, (byte_delay + 99) / 100);
+}
+
+static void
+spidev_sleep (unsigned int usecs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = usecs / 1000000;
+	ts.tv_nsec = usecs % 1000000 * 1000;
+	while (nanosleep (&ts, &ts) == -1 && errno == EINTR);
+}
+
+/*
+ * Do the transfers that share an assertion of the chip select. They are
+ * merged into a single transaction, unless there are delays between them,
+ * in which case the chip select is held asserted across the transactions.
+ */
+
+static int
+spidev_group (struct spidev *s, struct spi_ioc_transfer *xfers, int n)
+{
+	unsigned int byte_delay = 0;
+	uint32_t speed = 0, v;
+	mcp2210_packet want;
+	size_t len = 0, off;
+	int segments = 1;
+	char *buf;
+	int ret = 0, ret2;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (xfers[i].bits_per_word != 0 && xfers[i].bits_per_word != 8)
+			goto inval;
+		if (xfers[i].tx_nbits > 1 || xfers[i].rx_nbits > 1)
+			goto inval;
+		/* One transaction can only have one bit rate. */
+		v = xfers[i].speed_hz ? xfers[i].speed_hz : s->speed;
+		if (speed == 0 || v < speed)
+			speed = v;
+		if (xfers[i].word_delay_usecs > byte_delay)
+			byte_delay = xfers[i].word_delay_usecs;
+		if (i < n - 1 && xfers[i].delay_usecs)
+			segments++;
+		len += xfers[i].len;
+	}
+
+	if (len == 0) {
+		spidev_sleep (xfers[n - 1].delay_usecs);
+		return 0;
+	}
+
+	buf = malloc (len);
+	if (buf == NULL)
+		return -1;
+
+	for (i = 0, off = 0; i < n; off += xfers[i++].len) {
+		if (xfers[i].tx_buf)
+			memcpy (&buf[off], (void *)(uintptr_t)xfers[i].tx_buf, xfers[i].len);
+		else
+			memset (&buf[off], 0, xfers[i].len);
+	}
+
+	if (segments == 1) {
+		spidev_mode (s, want, speed, xfers[n - 1].delay_usecs, byte_delay);
+		ret = spidev_apply (s, want);
+		if (ret == 0) {
+			ret = mcp2210_spi_transfer_large (s->dev, s->chip, s->spi, buf, len);
+			if (ret < 0)
+				ret = spidev_error (ret);
+		}
+	} else {
+		spidev_mode (s, want, speed, 0, byte_delay);
+		ret = spidev_apply (s, want);
+		if (ret == 0) {
+			ret = mcp2210_spi_cs_hold (s->dev, s->chip, s->spi, 1);
+			if (ret < 0)
+				ret = spidev_error (ret);
+		}
+
+		for (i = 0, off = 0; ret == 0 && i < n; ) {
+			size_t seg = 0;
+
+			/* Up to the next transfer with a delay. */
+			do {
+				seg += xfers[i].len;
+			} while (xfers[i++].delay_usecs == 0 && i < n);
+
+			if (seg > MCP2210_SPI_TX_MAX) {
+				errno = EMSGSIZE;
+				ret = -1;
+				break;
+			}
+
+			if (seg) {
+				ret = mcp2210_spi_transfer_large (s->dev, s->chip, s->spi, &buf[off], seg);
+				if (ret < 0) {
+					ret = spidev_error (ret);
+					break;
+				}
+			}
+			off += seg;
+			spidev_sleep (xfers[i - 1].delay_usecs);
+		}
+
+		ret2 = mcp2210_spi_cs_hold (s->dev, s->chip, s->spi, 0);
+		if (ret2 < 0 && ret == 0)
+			ret = spidev_error (ret2);
+	}
+
+	for (i = 0, off = 0; ret == 0 && i < n; off += xfers[i++].len) {
+		if (xfers[i].rx_buf)
+			memcpy ((void *)(uintptr_t)xfers[i].rx_buf, &buf[off], xfers[i].len);
+	}
+
+	free (buf);
+	return ret ? ret : len;
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * SPI_IOC_MESSAGE: the transfers are grouped by the chip select changes.
+ * A cs_change on the last transfer, asking to keep the chip selected
+ * until the next message, is not honored.
+ */
+
+static int
+spidev_message (struct spidev *s, struct spi_ioc_transfer *xfers, int n)
+{
+	int total = 0;
+	int first, i;
+	int ret;
+
+	for (first = 0, i = 0; i < n; i++) {
+		if (i < n - 1 && !xfers[i].cs_change)
+			continue;
+
+		ret = spidev_group (s, &xfers[first], i - first + 1);
+		if (ret < 0)
+			return ret;
+		total += ret;
+		first = i + 1;
+	}
+
+	return total;
+}
+
+static int
+spidev_ioctl (struct spidev *s, unsigned long request, void *arg)
+{
+	mcp2210_packet want;
+	uint32_t val;
+
+	if (_IOC_TYPE (request) == SPI_IOC_MAGIC && _IOC_NR (request) == 0
+	    && _IOC_DIR (request) == _IOC_WRITE) {
+		if (_IOC_SIZE (request) % sizeof (struct spi_ioc_transfer)) {
+			errno = EINVAL;
+			return -1;
+		}
+		return spidev_message (s, arg, _IOC_SIZE (request) / sizeof (struct spi_ioc_transfer));
+	}
+
+	switch (request) {
+	case SPI_IOC_RD_MODE:
+		*(uint8_t *)arg = s->mode;
+		return 0;
+	case SPI_IOC_RD_MODE32:
+		*(uint32_t *)arg = s->mode;
+		return 0;
+	case SPI_IOC_WR_MODE:
+	case SPI_IOC_WR_MODE32:
+		val = request == SPI_IOC_WR_MODE ? *(uint8_t *)arg : *(uint32_t *)arg;
+		if (val & ~SPIDEV_MODES) {
+			errno = EINVAL;
+			return -1;
+		}
+		s->mode = val;
+		spidev_mode (s, want, s->speed, 0, 0);
+		return spidev_apply (s, want);
+	case SPI_IOC_RD_LSB_FIRST:
+		*(uint8_t *)arg = 0;
+		return 0;
+	case SPI_IOC_WR_LSB_FIRST:
+		if (*(uint8_t *)arg) {
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	case SPI_IOC_RD_BITS_PER_WORD:
+		*(uint8_t *)arg = 8;
+		return 0;
+	case SPI_IOC_WR_BITS_PER_WORD:
+		if (*(uint8_t *)arg != 0 && *(uint8_t *)arg != 8) {
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	case SPI_IOC_RD_MAX_SPEED_HZ:
+		*(uint32_t *)arg = s->speed;
+		return 0;
+	case SPI_IOC_WR_MAX_SPEED_HZ:
+		if (*(uint32_t *)arg == 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		s->speed = *(uint32_t *)arg;
+		return 0;
+	}
+
+	errno = ENOTTY;
+	return -1;
+}
+
+/*
+ * Open the MCP2210 device in place of the spidev path. The program gets
+ * a descriptor of /dev/null as a handle, so that it doesn't end up doing
+ * I/O on the device itself.
+ */
+
+static int
+spidev_open (const char *path, int flags)
+{
+	const char *spidev = getenv ("MCP2210_SPIDEV");
+	const char *device = getenv ("MCP2210_DEVICE");
+	struct spidev *s;
+	int ret, i, fd;
+
+	if (spidev == NULL || device == NULL || strcmp (path, spidev) != 0)
+		return -2;
+
+	pthread_mutex_lock (&spidev_lock);
+	s = NULL;
+	for (i = 0; i < SPIDEV_MAX && s == NULL; i++) {
+		if (__atomic_load_n (&spidevs[i].fd, __ATOMIC_ACQUIRE) == -1)
+			s = &spidevs[i];
+	}
+	if (s == NULL) {
+		pthread_mutex_unlock (&spidev_lock);
+		errno = EMFILE;
+		return -1;
+	}
+	pthread_mutex_lock (&s->lock);
+
+	s->dev = mcp2210_open (device);
+	if (s->dev == -1)
+		goto err;
+
+	ret = mcp2210_get_command (s->dev, s->chip, MCP2210_CHIP_GET);
+	if (ret == 0)
+		ret = mcp2210_get_command (s->dev, s->spi, MCP2210_SPI_GET);
+	if (ret < 0) {
+		mcp2210_close (s->dev);
+		spidev_error (ret);
+		goto err;
+	}
+
+	s->mode = mcp2210_spi_get_mode (s->spi);
+	s->speed = mcp2210_spi_get_bitrate (s->spi);
+
+	fd = real_open ("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+	if (fd == -1) {
+		mcp2210_close (s->dev);
+		goto err;
+	}
+
+	__atomic_add_fetch (&spidev_count, 1, __ATOMIC_RELEASE);
+	__atomic_store_n (&s->fd, fd, __ATOMIC_RELEASE);
+	pthread_mutex_unlock (&s->lock);
+	pthread_mutex_unlock (&spidev_lock);
+	return fd;
+err:
+	pthread_mutex_unlock (&s->lock);
+	pthread_mutex_unlock (&spidev_lock);
+	return -1;
+}
+
+/*
+ * The intercepted calls.
+ */
+
+int
+open (const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+	int ret;
+
+	va_start (ap, flags);
+	if (NEEDS_MODE (flags))
+		mode = va_arg (ap, mode_t);
+	va_end (ap);
+
+	ret = spidev_open (path, flags);
+	if (ret != -2)
+		return ret;
+
+	return real_open (path, flags, mode);
+}
+
+int
+open64 (const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+	int ret;
+
+	va_start (ap, flags);
+	if (NEEDS_MODE (flags))
+		mode = va_arg (ap, mode_t);
+	va_end (ap);
+
+	ret = spidev_open (path, flags);
+	if (ret != -2)
+		return ret;
+
+	return real_open64 (path, flags, mode);
+}
+
+int
+openat (int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+	int ret;
+
+	va_start (ap, flags);
+	if (NEEDS_MODE (flags))
+		mode = va_arg (ap, mode_t);
+	va_end (ap);
+
+	ret = spidev_open (path, flags);
+	if (ret != -2)
+		return ret;
+
+	return real_openat (dirfd, path, flags, mode);
+}
+
+int
+openat64 (int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+	int ret;
+
+	va_start (ap, flags);
+	if (NEEDS_MODE (flags))
+		mode = va_arg (ap, mode_t);
+	va_end (ap);
+
+	ret = spidev_open (path, flags);
+	if (ret != -2)
+		return ret;
+
+	return real_openat64 (dirfd, path, flags, mode);
+}
+
+/* What the fortified open() calls end up in.  */
+
+int
+__open_2 (const char *path, int flags)
+{
+	return open (path, flags);
+}
+
+int
+__open64_2 (const char *path, int flags)
+{
+	return open64 (path, flags);
+}
+
+int
+close (int fd)
+{
+	struct spidev *s;
+
+	s = spidev_acquire (fd);
+	if (s) {
+		mcp2210_close (s->dev);
+		__atomic_store_n (&s->fd, -1, __ATOMIC_RELEASE);
+		__atomic_sub_fetch (&spidev_count, 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock (&s->lock);
+	}
+
+	return real_close (fd);
+}
+
+int
+ioctl (int fd, unsigned long request, ...)
+{
+	struct spidev *s;
+	va_list ap;
+	void *arg;
+	int ret;
+
+	va_start (ap, request);
+	arg = va_arg (ap, void *);
+	va_end (ap);
+
+	s = spidev_acquire (fd);
+	if (s) {
+		ret = spidev_ioctl (s, request, arg);
+		pthread_mutex_unlock (&s->lock);
+		return ret;
+	}
+
+	return real_ioctl (fd, request, arg);
+}
+
+/*
+ * The spidev read() and write() are half duplex transfers; whatever is
+ * received on write() is thrown away and read() sends zeros.
+ */
+
+ssize_t
+read (int fd, void *buf, size_t count)
+{
+	struct spi_ioc_transfer xfer = { 0, };
+	struct spidev *s;
+	ssize_t ret;
+
+	xfer.rx_buf = (uintptr_t)buf;
+	xfer.len = count;
+
+	s = spidev_acquire (fd);
+	if (s) {
+		ret = spidev_message (s, &xfer, 1);
+		pthread_mutex_unlock (&s->lock);
+		return ret;
+	}
+
+	return real_read (fd, buf, count);
+}
+
+ssize_t
+write (int fd, const void *buf, size_t count)
+{
+	struct spi_ioc_transfer xfer = { 0, };
+	struct spidev *s;
+	ssize_t ret;
+
+	xfer.tx_buf = (uintptr_t)buf;
+	xfer.len = count;
+
+	s = spidev_acquire (fd);
+	if (s) {
+		ret = spidev_message (s, &xfer, 1);
+		pthread_mutex_unlock (&s->lock);
+		return ret;
+	}
+
+	return real_write (fd, buf, count);
+}
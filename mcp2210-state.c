@@ -0,0 +1,230 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Device state snapshots. The state is kept as raw response packets, so
+ * that the usual accessors work on it and it can be saved to a file and
+ * mapped back as it is.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mcp2210.h"
+
+/* NVRAM sub-commands for the NVRAM sections of the state.  */
+
+static const unsigned short state_nvram[MCP2210_STATE_PACKETS] = {
+	[MCP2210_STATE_NVRAM_SPI] = MCP2210_NVRAM_PARAM_SPI,
+	[MCP2210_STATE_NVRAM_CHIP] = MCP2210_NVRAM_PARAM_CHIP,
+	[MCP2210_STATE_NVRAM_USB_KEY] = MCP2210_NVRAM_PARAM_USB_KEY,
+	[MCP2210_STATE_NVRAM_PRODUCT] = MCP2210_NVRAM_PARAM_PRODUCT,
+	[MCP2210_STATE_NVRAM_MANUFACT] = MCP2210_NVRAM_PARAM_MANUFACT,
+};
+
+/* Commands that read the runtime sections of the state.  */
+
+static const unsigned short state_get[MCP2210_STATE_PACKETS] = {
+	[MCP2210_STATE_STATUS] = MCP2210_STATUS_GET,
+	[MCP2210_STATE_SPI] = MCP2210_SPI_GET,
+	[MCP2210_STATE_GPIO_VAL] = MCP2210_GPIO_VAL_GET,
+	[MCP2210_STATE_GPIO_DIR] = MCP2210_GPIO_DIR_GET,
+	[MCP2210_STATE_CHIP] = MCP2210_CHIP_GET,
+};
+
+/*
+ * Read the complete device state. The EEPROM takes a command per byte
+ * to read, therefore it's only read if requested.
+ */
+
+int
+mcp2210_state_get (int fd, struct mcp2210_state *state, int eeprom)
+{
+	mcp2210_packet *packets;
+	int ret;
+	int i;
+
+	memset (state, 0, sizeof (*state));
+	memcpy (state->magic, MCP2210_STATE_MAGIC, sizeof (state->magic));
+	state->version = MCP2210_STATE_VERSION;
+
+	for (i = 0; i < MCP2210_STATE_PACKETS; i++) {
+		if (state_nvram[i])
+			ret = mcp2210_get_nvram (fd, state->packets[i], state_nvram[i]);
+		else
+			ret = mcp2210_get_command (fd, state->packets[i], state_get[i]);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (!eeprom)
+		return 0;
+
+	/* Issued as a batch, so that the transport can pipeline them. */
+	packets = calloc (MCP2210_EEPROM_SIZE, MCP2210_PACKET_SIZE);
+	if (packets == NULL)
+		return -1;
+
+	for (i = 0; i < MCP2210_EEPROM_SIZE; i++) {
+		packets[i][0] = MCP2210_EEPROM_READ;
+		packets[i][1] = i;
+	}
+
+	ret = mcp2210_commands (fd, packets, MCP2210_EEPROM_SIZE);
+	for (i = 0; ret == 0 && i < MCP2210_EEPROM_SIZE; i++) {
+		if (packets[i][2] != i)
+			ret = -MCP2210_EBADADDR;
+		state->eeprom[i] = packets[i][3];
+	}
+	free (packets);
+	if (ret < 0)
+		return ret;
+	state->has_eeprom = 1;
+
+	return 0;
+}
+
+/*
+ * Return a bit mask of the sections that differ between two states.
+ * Sections that are missing from either of the states are not compared.
+ */
+
+unsigned int
+mcp2210_state_diff (struct mcp2210_state *a, struct mcp2210_state *b)
+{
+	unsigned int diff = 0;
+	int i;
+
+	for (i = 0; i < MCP2210_STATE_PACKETS; i++) {
+		unsigned char *pa = a->packets[i];
+		unsigned char *pb = b->packets[i];
+
+		if (!pa[0] || !pb[0])
+			continue;
+
+		switch (i) {
+		case MCP2210_STATE_STATUS:
+			if (memcmp (&pa[2], &pb[2], 4))
+				diff |= 1 << i;
+			break;
+		case MCP2210_STATE_GPIO_VAL:
+		case MCP2210_STATE_GPIO_DIR:
+			if (memcmp (&pa[4], &pb[4], 2))
+				diff |= 1 << i;
+			break;
+		case MCP2210_STATE_SPI:
+			if (mcp2210_settings_cmp (pa, pb, MCP2210_NVRAM_PARAM_SPI))
+				diff |= 1 << i;
+			break;
+		case MCP2210_STATE_CHIP:
+			if (mcp2210_settings_cmp (pa, pb, MCP2210_NVRAM_PARAM_CHIP))
+				diff |= 1 << i;
+			break;
+		default:
+			if (mcp2210_settings_cmp (pa, pb, state_nvram[i]))
+				diff |= 1 << i;
+			break;
+		}
+	}
+
+	if (a->has_eeprom && b->has_eeprom && memcmp (a->eeprom, b->eeprom, sizeof (a->eeprom)))
+		diff |= 1 << MCP2210_STATE_EEPROM;
+
+	return diff;
+}
+
+/*
+ * Bring the device from the state in cur to the state in want, issuing
+ * only the commands needed for the sections that differ. The cur state
+ * is updated as the sections are written.
+ */
+
+int
+mcp2210_state_restore (int fd, struct mcp2210_state *cur, struct mcp2210_state *want)
+{
+	/* Pin functions first, then directions and values. */
+	static const int order[] = {
+		MCP2210_STATE_CHIP,
+		MCP2210_STATE_GPIO_DIR,
+		MCP2210_STATE_GPIO_VAL,
+		MCP2210_STATE_SPI,
+		MCP2210_STATE_NVRAM_SPI,
+		MCP2210_STATE_NVRAM_CHIP,
+		MCP2210_STATE_NVRAM_USB_KEY,
+		MCP2210_STATE_NVRAM_PRODUCT,
+		MCP2210_STATE_NVRAM_MANUFACT,
+	};
+	static const unsigned short state_set[MCP2210_STATE_PACKETS] = {
+		[MCP2210_STATE_SPI] = MCP2210_SPI_SET,
+		[MCP2210_STATE_GPIO_VAL] = MCP2210_GPIO_VAL_SET,
+		[MCP2210_STATE_GPIO_DIR] = MCP2210_GPIO_DIR_SET,
+		[MCP2210_STATE_CHIP] = MCP2210_CHIP_SET,
+	};
+	unsigned int diff;
+	mcp2210_packet packet;
+	int ret;
+	int i, j;
+
+	diff = mcp2210_state_diff (cur, want);
+
+	for (j = 0; j < sizeof (order) / sizeof (order[0]); j++) {
+		i = order[j];
+		if (!(diff & (1 << i)))
+			continue;
+
+		memset (packet, 0, MCP2210_PACKET_SIZE);
+		switch (i) {
+		case MCP2210_STATE_NVRAM_CHIP:
+			/*
+			 * The password is not readable, so it's not in the
+			 * snapshot. Don't risk clobbering it.
+			 */
+			if (mcp2210_chip_get_access_control (cur->packets[i]) != MCP2210_CHIP_PROTECT_NONE
+			    || mcp2210_chip_get_access_control (want->packets[i]) != MCP2210_CHIP_PROTECT_NONE)
+				return -MCP2210_ENOACCESS;
+			memcpy (packet, want->packets[i], MCP2210_PACKET_SIZE);
+			break;
+		case MCP2210_STATE_NVRAM_USB_KEY:
+			mcp2210_usb_key_get_to_set (want->packets[i], packet);
+			break;
+		default:
+			memcpy (packet, want->packets[i], MCP2210_PACKET_SIZE);
+			break;
+		}
+
+		if (state_nvram[i])
+			ret = mcp2210_set_nvram (fd, packet, state_nvram[i]);
+		else
+			ret = mcp2210_command (fd, packet, state_set[i]);
+		if (ret < 0)
+			return ret;
+
+		memcpy (cur->packets[i], want->packets[i], MCP2210_PACKET_SIZE);
+	}
+
+	if (diff & (1 << MCP2210_STATE_EEPROM)) {
+		for (i = 0; i < sizeof (cur->eeprom); i++) {
+			if (cur->eeprom[i] == want->eeprom[i])
+				continue;
+			ret = mcp2210_write_eeprom (fd, packet, i, want->eeprom[i]);
+			if (ret < 0)
+				return ret;
+			cur->eeprom[i] = want->eeprom[i];
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * SPI transfers of streams, possibly gzip-compressed, such as firmware
+ * images. A thread decompresses the stream into a few blocks ahead of the
+ * transfer, so that the decompression overlaps with the USB traffic and
+ * the memory used doesn't depend on the size of the stream.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "mcp2210.h"
+
+/* Each block is a single SPI transaction.  */
+
+#define STREAM_BLOCK	MCP2210_SPI_TX_MAX
+#define STREAM_BLOCKS	4
+
+struct stream {
+	gzFile gz;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* A ring of the blocks decompressed and not yet transferred. */
+	char *blocks[STREAM_BLOCKS];
+	size_t lens[STREAM_BLOCKS];
+	int head;
+	int count;
+
+	int eof;
+	int error;
+	int stop;
+};
+
+/*
+ * The producer. Fills the free blocks until the end of the stream, an
+ * error or until the consumer tells it to stop.
+ */
+
+static void *
+stream_decompress (void *data)
+{
+	struct stream *stream = data;
+	int errnum;
+	size_t len;
+	char *block;
+	int n;
+
+	pthread_mutex_lock (&stream->lock);
+	while (1) {
+		while (stream->count == STREAM_BLOCKS && !stream->stop)
+			pthread_cond_wait (&stream->cond, &stream->lock);
+		if (stream->stop)
+			break;
+		block = stream->blocks[(stream->head + stream->count) % STREAM_BLOCKS];
+		pthread_mutex_unlock (&stream->lock);
+
+		/* Short only at the end of the stream. */
+		len = 0;
+		do {
+			n = gzread (stream->gz, &block[len], STREAM_BLOCK - len);
+			if (n > 0)
+				len += n;
+		} while (n > 0 && len < STREAM_BLOCK);
+
+		/* A truncated stream ends without an error from gzread(). */
+		gzerror (stream->gz, &errnum);
+
+		pthread_mutex_lock (&stream->lock);
+		if (n < 0 || errnum != Z_OK) {
+			stream->error = errnum == Z_ERRNO ? errno : EBADMSG;
+			break;
+		}
+		stream->lens[(stream->head + stream->count) % STREAM_BLOCKS] = len;
+		stream->count++;
+		pthread_cond_signal (&stream->cond);
+		if (len < STREAM_BLOCK) {
+			stream->eof = 1;
+			break;
+		}
+	}
+	pthread_cond_signal (&stream->cond);
+	pthread_mutex_unlock (&stream->lock);
+
+	return NULL;
+}
+
+static int
+write_all (int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write (fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Transfer the stream read from in_fd as a single SPI transfer, holding
+ * the CS asserted if it's longer than a transaction. The stream can be
+ * gzip-compressed. The data received is written to out_fd, unless it's
+ * -1. The chip_packet and spi_packet are the runtime settings, as with
+ * mcp2210_spi_transfer_large().
+ */
+
+int
+mcp2210_spi_transfer_stream (int fd, mcp2210_packet chip_packet, mcp2210_packet spi_packet,
+		int in_fd, int out_fd)
+{
+	struct stream stream = { 0, };
+	mcp2210_packet packet;
+	pthread_t thread;
+	int hold = 0;
+	int ret = 0, ret2;
+	char *block;
+	size_t len;
+	int saved;
+	int dup_fd;
+	int i;
+
+	dup_fd = dup (in_fd);
+	if (dup_fd == -1)
+		return -1;
+	stream.gz = gzdopen (dup_fd, "rb");
+	if (stream.gz == NULL) {
+		close (dup_fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	gzbuffer (stream.gz, STREAM_BLOCK);
+
+	for (i = 0; i < STREAM_BLOCKS; i++) {
+		stream.blocks[i] = malloc (STREAM_BLOCK);
+		if (stream.blocks[i] == NULL) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	pthread_mutex_init (&stream.lock, NULL);
+	pthread_cond_init (&stream.cond, NULL);
+	errno = pthread_create (&thread, NULL, stream_decompress, &stream);
+	if (errno) {
+		ret = -1;
+		goto out_cond;
+	}
+
+	pthread_mutex_lock (&stream.lock);
+	while (1) {
+		while (stream.count == 0 && !stream.eof && !stream.error)
+			pthread_cond_wait (&stream.cond, &stream.lock);
+		if (stream.count == 0)
+			break;
+		block = stream.blocks[stream.head];
+		len = stream.lens[stream.head];
+
+		/* No need for the hold if the first block is all there is. */
+		if (!hold && (len == STREAM_BLOCK || stream.count > 1)) {
+			pthread_mutex_unlock (&stream.lock);
+			ret = mcp2210_spi_cs_hold (fd, chip_packet, spi_packet, 1);
+			pthread_mutex_lock (&stream.lock);
+			if (ret < 0)
+				break;
+			hold = 1;
+		}
+		pthread_mutex_unlock (&stream.lock);
+
+		if (len && mcp2210_spi_get_transaction_size (spi_packet) != len) {
+			mcp2210_spi_set_transaction_size (spi_packet, len);
+			memcpy (packet, spi_packet, MCP2210_PACKET_SIZE);
+			ret = mcp2210_command (fd, packet, MCP2210_SPI_SET);
+		}
+		if (len && ret == 0)
+			ret = mcp2210_spi_transfer (fd, spi_packet, block, len);
+		if (len && ret == 0 && out_fd != -1 && write_all (out_fd, block, len) == -1)
+			ret = -1;
+
+		pthread_mutex_lock (&stream.lock);
+		if (ret < 0)
+			break;
+		stream.head = (stream.head + 1) % STREAM_BLOCKS;
+		stream.count--;
+		pthread_cond_signal (&stream.cond);
+	}
+	if (ret == 0 && stream.error) {
+		errno = stream.error;
+		ret = -1;
+	}
+	stream.stop = 1;
+	pthread_cond_signal (&stream.cond);
+	pthread_mutex_unlock (&stream.lock);
+	pthread_join (thread, NULL);
+
+	if (hold) {
+		ret2 = mcp2210_spi_cs_hold (fd, chip_packet, spi_packet, 0);
+		if (ret == 0)
+			ret = ret2;
+	}
+
+out_cond:
+	pthread_cond_destroy (&stream.cond);
+	pthread_mutex_destroy (&stream.lock);
+out:
+	saved = errno;
+	for (i = 0; i < STREAM_BLOCKS; i++)
+		free (stream.blocks[i]);
+	gzclose (stream.gz);
+	errno = saved;
+
+	return ret;
+}
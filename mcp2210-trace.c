@@ -0,0 +1,222 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Report trace recording. Every packet that goes through mcp2210_command()
+ * is copied into a ring of records in a memory mapped file, so that the
+ * cost is a memcpy() and there's something to look at after a crash.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mcp2210.h"
+
+struct mcp2210_trace_header *mcp2210_trace = NULL;
+static size_t trace_size;
+
+int
+mcp2210_trace_open (const char *path, unsigned int records)
+{
+	struct mcp2210_trace_header *trace;
+	size_t size;
+	int fd;
+
+	if (records == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	size = sizeof (*trace) + (size_t)records * sizeof (struct mcp2210_trace_record);
+	fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -1;
+	if (ftruncate (fd, size) == -1) {
+		close (fd);
+		return -1;
+	}
+	trace = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (trace == MAP_FAILED)
+		return -1;
+
+	memcpy (trace->magic, MCP2210_TRACE_MAGIC, sizeof (trace->magic));
+	trace->version = MCP2210_TRACE_VERSION;
+	trace->records = records;
+
+	mcp2210_trace_close ();
+	trace_size = size;
+	mcp2210_trace = trace;
+
+	return 0;
+}
+
+void
+mcp2210_trace_close (void)
+{
+	if (mcp2210_trace == NULL)
+		return;
+
+	munmap (mcp2210_trace, trace_size);
+	mcp2210_trace = NULL;
+}
+
+/*
+ * Called from mcp2210_command() for each packet written or read.
+ */
+
+void
+mcp2210_trace_packet (int fd, unsigned char dir, int result, const mcp2210_packet packet)
+{
+	struct mcp2210_trace_header *trace = mcp2210_trace;
+	struct mcp2210_trace_record *rec;
+	struct timespec now;
+	unsigned long long n;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	n = __atomic_fetch_add (&trace->count, 1, __ATOMIC_RELAXED);
+
+	rec = mcp2210_trace_record (trace, n);
+	rec->time_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	rec->fd = fd;
+	rec->result = result;
+	rec->dir = dir;
+	memcpy (rec->packet, packet, MCP2210_PACKET_SIZE);
+}
+
+/*
+ * Map a trace file for reading.
+ */
+
+struct mcp2210_trace_header *
+mcp2210_trace_map (const char *path)
+{
+	struct mcp2210_trace_header *trace;
+	struct stat st;
+	int fd;
+
+	fd = open (path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	if (fstat (fd, &st) == -1) {
+		close (fd);
+		return NULL;
+	}
+	if (st.st_size < sizeof (*trace)) {
+		close (fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	trace = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (trace == MAP_FAILED)
+		return NULL;
+
+	if (memcmp (trace->magic, MCP2210_TRACE_MAGIC, sizeof (trace->magic))
+	    || trace->version != MCP2210_TRACE_VERSION
+	    || trace->records == 0
+	    || st.st_size < sizeof (*trace) + (size_t)trace->records * sizeof (struct mcp2210_trace_record)) {
+		munmap (trace, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return trace;
+}
+
+void
+mcp2210_trace_unmap (struct mcp2210_trace_header *trace)
+{
+	munmap (trace, sizeof (*trace) + (size_t)trace->records * sizeof (struct mcp2210_trace_record));
+}
+
+/*
+ * Find the next complete command in the trace, starting at record *n: a
+ * report written and the response read on the same fd. The commands that
+ * failed are skipped. Returns zero when there are no more.
+ */
+
+int
+mcp2210_trace_next (const struct mcp2210_trace_header *trace, unsigned long long *n,
+		struct mcp2210_trace_record **w, struct mcp2210_trace_record **r)
+{
+	unsigned long long i;
+
+	for (; *n < trace->count; (*n)++) {
+		*w = mcp2210_trace_record (trace, *n);
+		if ((*w)->dir != MCP2210_TRACE_WRITE || (*w)->result != MCP2210_PACKET_SIZE)
+			continue;
+
+		for (i = *n + 1; i < trace->count; i++) {
+			*r = mcp2210_trace_record (trace, i);
+			if ((*r)->fd == (*w)->fd)
+				break;
+		}
+		if (i == trace->count)
+			break;
+
+		if ((*r)->dir == MCP2210_TRACE_READ && (*r)->result == MCP2210_PACKET_SIZE) {
+			*n = i + 1;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Act as a device, answering the packets that arrive on fd with the
+ * responses recorded in the trace, regardless of what they are. Returns
+ * the number of packets that didn't match the recorded ones, or a negative
+ * error code.
+ */
+
+int
+mcp2210_trace_serve (int fd, const struct mcp2210_trace_header *trace)
+{
+	struct mcp2210_trace_record *w, *r;
+	unsigned long long n;
+	mcp2210_packet packet;
+	int mismatches = 0;
+	ssize_t ret;
+
+	n = mcp2210_trace_first (trace);
+	while (mcp2210_trace_next (trace, &n, &w, &r)) {
+		ret = mcp2210_read_report (fd, packet);
+		if (ret == 0)
+			break;
+		if (ret == -1)
+			return -1;
+		if (ret != MCP2210_PACKET_SIZE)
+			return -MCP2210_ERDSHORT;
+		if (memcmp (packet, w->packet, MCP2210_PACKET_SIZE))
+			mismatches++;
+
+		ret = mcp2210_write_report (fd, r->packet);
+		if (ret == -1)
+			return -1;
+		if (ret != MCP2210_PACKET_SIZE)
+			return -MCP2210_EWRSHORT;
+	}
+
+	return mismatches;
+}
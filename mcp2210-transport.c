@@ -0,0 +1,660 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Transports that move the reports between the library and the device.
+ * A file descriptor without a transport registered is assumed to be a
+ * hidraw device.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mcp2210.h"
+
+/*
+ * The transports are looked up by the file descriptor number in a table
+ * of pages that are never freed, so that the lookup needs no locking.
+ * Only mcp2210_close() clears a slot: a descriptor closed with close()
+ * leaves its transport to whatever reuses the number.
+ */
+
+#define SLOT_PAGE	256
+#define SLOT_PAGES	256
+
+struct slot {
+	const struct mcp2210_transport *ops;
+	void *priv;
+	struct mcp2210_cancel *cancel;
+	int broken;	/* Responses lost track of, see mcp2210_commands(). */
+	int spi_state;	/* What's known of the SPI settings, see below. */
+	mcp2210_packet spi;
+};
+
+/* The SPI settings of a device, as last set or read through its fd. */
+
+#define SPI_UNKNOWN	0
+#define SPI_PENDING	1	/* Set, waiting for the response. */
+#define SPI_KNOWN	2
+
+static struct slot *slot_pages[SLOT_PAGES];
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct slot *
+get_slot (int fd, int create)
+{
+	struct slot *page;
+
+	if (fd < 0 || fd >= SLOT_PAGE * SLOT_PAGES)
+		return NULL;
+
+	page = __atomic_load_n (&slot_pages[fd / SLOT_PAGE], __ATOMIC_ACQUIRE);
+	if (page == NULL && create) {
+		pthread_mutex_lock (&slot_lock);
+		page = slot_pages[fd / SLOT_PAGE];
+		if (page == NULL) {
+			page = calloc (SLOT_PAGE, sizeof (*page));
+			__atomic_store_n (&slot_pages[fd / SLOT_PAGE], page, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock (&slot_lock);
+	}
+	if (page == NULL)
+		return NULL;
+
+	return &page[fd % SLOT_PAGE];
+}
+
+/*
+ * Look up the transport for a file descriptor, along with its private
+ * data.
+ */
+
+const struct mcp2210_transport *
+mcp2210_get_transport (int fd, void **priv)
+{
+	struct slot *slot = get_slot (fd, 0);
+
+	if (slot == NULL || slot->ops == NULL) {
+		*priv = NULL;
+		return &mcp2210_hidraw_transport;
+	}
+
+	*priv = slot->priv;
+	return slot->ops;
+}
+
+/*
+ * Register a transport for a file descriptor. The fd doesn't need to be
+ * used for I/O by the transport, it's just a handle.
+ */
+
+int
+mcp2210_set_transport (int fd, const struct mcp2210_transport *ops, void *priv)
+{
+	struct slot *slot = get_slot (fd, 1);
+
+	if (slot == NULL) {
+		errno = fd < 0 ? EBADF : ENOMEM;
+		return -1;
+	}
+
+	slot->priv = priv;
+	slot->ops = ops;
+	slot->spi_state = SPI_UNKNOWN;
+	__atomic_store_n (&slot->broken, 0, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/*
+ * Attach a cancellation token to a file descriptor. The long running
+ * routines check it between the commands they issue. NULL detaches it.
+ */
+
+int
+mcp2210_set_cancel (int fd, struct mcp2210_cancel *cancel)
+{
+	struct slot *slot = get_slot (fd, cancel != NULL);
+
+	if (slot == NULL) {
+		if (cancel == NULL)
+			return 0;
+		errno = fd < 0 ? EBADF : ENOMEM;
+		return -1;
+	}
+
+	__atomic_store_n (&slot->cancel, cancel, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * Check whether cancellation was requested with the token attached to fd.
+ */
+
+int
+mcp2210_cancelled (int fd)
+{
+	struct slot *slot = get_slot (fd, 0);
+	struct mcp2210_cancel *cancel;
+
+	if (slot == NULL)
+		return 0;
+
+	cancel = __atomic_load_n (&slot->cancel, __ATOMIC_ACQUIRE);
+	return cancel && mcp2210_cancel_requested (cancel);
+}
+
+/*
+ * A transport that lost track of which response belongs to which command
+ * fails all the reports until it's registered again.
+ */
+
+static int
+is_broken (int fd)
+{
+	struct slot *slot = get_slot (fd, 0);
+
+	if (slot && __atomic_load_n (&slot->broken, __ATOMIC_RELAXED)) {
+		errno = EIO;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Keep track of the SPI settings the device was last set to or read with,
+ * so that the routines that share a device, such as the register maps,
+ * only issue SPI_SET when someone else changed them. The responses come
+ * in the order of the commands, so a SPI_SET is only taken as done when
+ * its response follows with nothing else written in between; anything
+ * less certain forgets the settings.
+ */
+
+static void
+spi_track_write (int fd, const mcp2210_packet packet)
+{
+	struct slot *slot = get_slot (fd, packet[0] == MCP2210_SPI_SET);
+
+	if (slot == NULL)
+		return;
+
+	if (packet[0] == MCP2210_SPI_SET) {
+		memcpy (slot->spi, packet, MCP2210_PACKET_SIZE);
+		slot->spi_state = SPI_PENDING;
+	} else if (slot->spi_state == SPI_PENDING) {
+		slot->spi_state = SPI_UNKNOWN;
+	}
+}
+
+static void
+spi_track_read (int fd, const mcp2210_packet packet)
+{
+	struct slot *slot;
+
+	if (packet[0] != MCP2210_SPI_SET && packet[0] != MCP2210_SPI_GET)
+		return;
+
+	slot = get_slot (fd, 1);
+	if (slot == NULL)
+		return;
+
+	if (packet[1] != 0) {
+		if (packet[0] == MCP2210_SPI_SET)
+			slot->spi_state = SPI_UNKNOWN;
+	} else if (packet[0] == MCP2210_SPI_SET) {
+		if (slot->spi_state == SPI_PENDING)
+			slot->spi_state = SPI_KNOWN;
+	} else if (slot->spi_state != SPI_PENDING) {
+		memcpy (slot->spi, packet, MCP2210_PACKET_SIZE);
+		slot->spi_state = SPI_KNOWN;
+	}
+}
+
+/*
+ * Issue SPI_SET with the settings in spi_packet, unless they're the ones
+ * the device at fd is known to have already.
+ */
+
+int
+mcp2210_spi_apply (int fd, mcp2210_packet spi_packet)
+{
+	struct slot *slot = get_slot (fd, 0);
+	mcp2210_packet packet;
+
+	if (slot && slot->spi_state == SPI_KNOWN
+	    && mcp2210_settings_cmp (slot->spi, spi_packet, MCP2210_NVRAM_PARAM_SPI) == 0)
+		return 0;
+
+	memcpy (packet, spi_packet, MCP2210_PACKET_SIZE);
+	return mcp2210_command (fd, packet, MCP2210_SPI_SET);
+}
+
+/*
+ * Forget the SPI settings of the device at fd, such as after they were
+ * changed some other way, so that the next mcp2210_spi_apply() sets them.
+ */
+
+void
+mcp2210_spi_forget (int fd)
+{
+	struct slot *slot = get_slot (fd, 0);
+
+	if (slot)
+		slot->spi_state = SPI_UNKNOWN;
+}
+
+/*
+ * Transfer a single report with the transport registered for fd.
+ */
+
+ssize_t
+mcp2210_write_report (int fd, const mcp2210_packet packet)
+{
+	const struct mcp2210_transport *ops;
+	void *priv;
+	ssize_t ret;
+
+	ops = mcp2210_get_transport (fd, &priv);
+	spi_track_write (fd, packet);
+	ret = is_broken (fd) ? -1 : ops->write (fd, priv, packet);
+	if (mcp2210_trace)
+		mcp2210_trace_packet (fd, MCP2210_TRACE_WRITE, ret, packet);
+
+	return ret;
+}
+
+ssize_t
+mcp2210_read_report (int fd, mcp2210_packet packet)
+{
+	const struct mcp2210_transport *ops;
+	void *priv;
+	ssize_t ret;
+
+	ops = mcp2210_get_transport (fd, &priv);
+	ret = is_broken (fd) ? -1 : ops->read (fd, priv, packet);
+	if (mcp2210_trace)
+		mcp2210_trace_packet (fd, MCP2210_TRACE_READ, ret, packet);
+	if (ret == MCP2210_PACKET_SIZE)
+		spi_track_read (fd, packet);
+
+	return ret;
+}
+
+static ssize_t
+write_report_intr (int fd, const mcp2210_packet packet)
+{
+	ssize_t ret;
+
+	do
+		ret = mcp2210_write_report (fd, packet);
+	while (ret == -1 && errno == EINTR);
+
+	return ret;
+}
+
+static ssize_t
+read_report_intr (int fd, mcp2210_packet packet)
+{
+	ssize_t ret;
+
+	do
+		ret = mcp2210_read_report (fd, packet);
+	while (ret == -1 && errno == EINTR);
+
+	return ret;
+}
+
+/*
+ * A batch failed with the commands between done and sent in flight. Read
+ * their responses, so that they're not taken for the responses to the
+ * commands that follow. If that fails too, the transport is marked broken.
+ * So is a socket, which may have been left in the middle of a report.
+ */
+
+static void
+commands_drain (int fd, const struct mcp2210_transport *ops, int done, int sent)
+{
+	mcp2210_packet packet;
+	struct slot *slot;
+	int saved = errno;
+
+	if (ops == &mcp2210_socket_transport)
+		done = -1;
+	for (; done >= 0 && done < sent; done++) {
+		if (read_report_intr (fd, packet) != MCP2210_PACKET_SIZE)
+			break;
+	}
+
+	slot = get_slot (fd, 0);
+	if (done < sent && slot)
+		__atomic_store_n (&slot->broken, 1, __ATOMIC_RELAXED);
+	errno = saved;
+}
+
+/*
+ * Issue a batch of commands. The command codes are taken from the first
+ * byte of each packet and the packets are replaced with the responses.
+ * As many commands as the transport allows are written ahead of reading
+ * the responses. A command that fails on the device doesn't stop the
+ * batch; its status is in the response. Returns the first error.
+ */
+
+int
+mcp2210_commands (int fd, mcp2210_packet *packets, int n)
+{
+	const struct mcp2210_transport *ops;
+	unsigned char command;
+	int sent = 0, done = 0;
+	int depth;
+	int ret = 0;
+	void *priv;
+
+	ops = mcp2210_get_transport (fd, &priv);
+	depth = ops->depth > 0 ? ops->depth : 1;
+
+	while (done < n) {
+		while (sent < n && sent - done < depth) {
+			switch (write_report_intr (fd, packets[sent])) {
+			case MCP2210_PACKET_SIZE:
+				break;
+			case -1:
+				commands_drain (fd, ops, done, sent);
+				return -1;
+			default:
+				commands_drain (fd, ops, done, sent);
+				return -MCP2210_EWRSHORT;
+			}
+			sent++;
+		}
+
+		command = packets[done][0];
+		memset (packets[done], 0, MCP2210_PACKET_SIZE);
+		switch (read_report_intr (fd, packets[done])) {
+		case MCP2210_PACKET_SIZE:
+			break;
+		case -1:
+			commands_drain (fd, ops, done + 1, sent);
+			return -1;
+		default:
+			commands_drain (fd, ops, done + 1, sent);
+			return -MCP2210_ERDSHORT;
+		}
+
+		if (ret == 0 && packets[done][1] != 0)
+			ret = -packets[done][1];
+		else if (ret == 0 && packets[done][0] != command)
+			ret = -MCP2210_EBADCMD;
+		done++;
+	}
+
+	return ret;
+}
+
+/*
+ * hidraw: each read() or write() is a report.
+ */
+
+static ssize_t
+hidraw_write (int fd, void *priv, const mcp2210_packet packet)
+{
+	return write (fd, packet, MCP2210_PACKET_SIZE);
+}
+
+static ssize_t
+hidraw_read (int fd, void *priv, mcp2210_packet packet)
+{
+	return read (fd, packet, MCP2210_PACKET_SIZE);
+}
+
+static int
+hidraw_close (int fd, void *priv)
+{
+	return close (fd);
+}
+
+const struct mcp2210_transport mcp2210_hidraw_transport = {
+	.name = "hidraw",
+	.depth = 1,
+	.write = hidraw_write,
+	.read = hidraw_read,
+	.close = hidraw_close,
+};
+
+/*
+ * Sockets: a stream of reports, that may arrive in pieces. The remote
+ * end queues the commands, so that a number of them can be in flight.
+ */
+
+static ssize_t
+socket_write (int fd, void *priv, const mcp2210_packet packet)
+{
+	ssize_t len = 0;
+	ssize_t ret;
+
+	while (len < MCP2210_PACKET_SIZE) {
+		ret = send (fd, packet + len, MCP2210_PACKET_SIZE - len, MSG_NOSIGNAL);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			return -1;
+		len += ret;
+	}
+
+	return len;
+}
+
+static ssize_t
+socket_read (int fd, void *priv, mcp2210_packet packet)
+{
+	ssize_t len = 0;
+	ssize_t ret;
+
+	while (len < MCP2210_PACKET_SIZE) {
+		ret = read (fd, packet + len, MCP2210_PACKET_SIZE - len);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			return -1;
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+
+	return len;
+}
+
+const struct mcp2210_transport mcp2210_socket_transport = {
+	.name = "socket",
+	.depth = 16,
+	.write = socket_write,
+	.read = socket_read,
+	.close = hidraw_close,
+};
+
+/*
+ * Turn an "unix:/path" or "tcp:host:port" address into a socket, either
+ * connected or listening.
+ */
+
+int
+mcp2210_socket (const char *addr, int listening)
+{
+	struct addrinfo hints = { 0, };
+	struct addrinfo *res, *ai;
+	struct sockaddr_un sun = { 0, };
+	char host[256];
+	const char *port;
+	int one = 1;
+	int fd = -1;
+	int ret;
+
+	if (strncmp (addr, "unix:", 5) == 0) {
+		addr += 5;
+		if (strlen (addr) >= sizeof (sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		sun.sun_family = AF_UNIX;
+		strcpy (sun.sun_path, addr);
+
+		fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+			return -1;
+		if (listening) {
+			unlink (addr);
+			ret = bind (fd, (struct sockaddr *)&sun, sizeof (sun));
+			if (ret == 0)
+				ret = listen (fd, 8);
+		} else {
+			ret = connect (fd, (struct sockaddr *)&sun, sizeof (sun));
+		}
+		if (ret == -1) {
+			close (fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	if (strncmp (addr, "tcp:", 4) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	addr += 4;
+
+	/* "tcp:port" for listening on all addresses. */
+	port = strrchr (addr, ':');
+	if (port == NULL) {
+		port = addr;
+		host[0] = '\0';
+	} else if (port - addr < sizeof (host)) {
+		memcpy (host, addr, port - addr);
+		host[port - addr] = '\0';
+		port++;
+	} else {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	ret = getaddrinfo (host[0] ? host : NULL, port, &hints, &res);
+	if (ret != 0) {
+		errno = ret == EAI_SYSTEM ? errno : EHOSTUNREACH;
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket (ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (listening) {
+			setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+			ret = bind (fd, ai->ai_addr, ai->ai_addrlen);
+			if (ret == 0)
+				ret = listen (fd, 8);
+		} else {
+			ret = connect (fd, ai->ai_addr, ai->ai_addrlen);
+		}
+		if (ret == 0)
+			break;
+		close (fd);
+		fd = -1;
+	}
+	freeaddrinfo (res);
+
+	/* The reports are small; don't let them wait for more. */
+	if (fd != -1)
+		setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+	return fd;
+}
+
+#ifndef MCP2210_LIBUSB
+/*
+ * Built without libusb. Keep the symbol, so that programs link with the
+ * library whichever way it was built.
+ */
+
+int
+mcp2210_libusb_open (const char *spec)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
+
+/*
+ * Open a device: a hidraw device node, an "unix:" or "tcp:" address of
+ * a device served over a socket, or an "usb:" device when built with
+ * libusb.
+ */
+
+int
+mcp2210_open (const char *path)
+{
+	int fd;
+
+	if (strncmp (path, "usb:", 4) == 0)
+		return mcp2210_libusb_open (path + 4);
+
+	if (strncmp (path, "unix:", 5) == 0 || strncmp (path, "tcp:", 4) == 0) {
+		fd = mcp2210_socket (path, 0);
+		if (fd == -1)
+			return -1;
+		if (mcp2210_set_transport (fd, &mcp2210_socket_transport, NULL) == -1) {
+			close (fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	fd = open (path, O_RDWR | O_CLOEXEC);
+	if (fd != -1)
+		mcp2210_spi_forget (fd);
+
+	return fd;
+}
+
+int
+mcp2210_close (int fd)
+{
+	const struct mcp2210_transport *ops;
+	struct slot *slot;
+	void *priv;
+
+	ops = mcp2210_get_transport (fd, &priv);
+	slot = get_slot (fd, 0);
+	if (slot) {
+		slot->ops = NULL;
+		slot->cancel = NULL;
+		slot->broken = 0;
+		slot->spi_state = SPI_UNKNOWN;
+	}
+
+	return ops->close (fd, priv);
+}
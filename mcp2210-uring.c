@@ -0,0 +1,347 @@
+/*
+ * MCP2210 USB SPI bridge library
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Commands to many devices at once with io_uring. The report writes and
+ * reads for all the devices go through a single ring, each write linked
+ * to the read of its response, with the packets in registered buffers.
+ * A batch costs a single system call instead of a pair per command.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "mcp2210.h"
+
+struct mcp2210_ring {
+	int fd;
+	unsigned int commands;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* A request and a response buffer per command, registered. */
+	unsigned char (*bufs)[2][MCP2210_PACKET_SIZE];
+
+	/* The commands sorted by fd. */
+	struct ring_order {
+		int fd;
+		int i;
+	} *order;
+};
+
+static int
+io_uring_setup (unsigned int entries, struct io_uring_params *p)
+{
+	return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter (int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+io_uring_register (int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Set up a ring for batches of up to the given number of commands.
+ * Larger batches are done in parts.
+ */
+
+struct mcp2210_ring *
+mcp2210_ring_new (unsigned int commands)
+{
+	struct io_uring_params p = { 0, };
+	struct mcp2210_ring *ring;
+	struct iovec iov;
+	int saved;
+
+	if (commands == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ring = calloc (1, sizeof (*ring));
+	if (ring == NULL)
+		return NULL;
+	ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+	ring->fd = -1;
+
+	ring->commands = commands;
+	ring->order = calloc (commands, sizeof (*ring->order));
+	if (ring->order == NULL)
+		goto err;
+
+	ring->fd = io_uring_setup (commands * 2, &p);
+	if (ring->fd == -1)
+		goto err;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap (NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto err;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err;
+
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	iov.iov_len = commands * sizeof (*ring->bufs);
+	ring->bufs = mmap (NULL, iov.iov_len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->bufs == MAP_FAILED) {
+		ring->bufs = NULL;
+		goto err;
+	}
+	iov.iov_base = ring->bufs;
+	if (io_uring_register (ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == -1)
+		goto err;
+
+	return ring;
+err:
+	saved = errno;
+	mcp2210_ring_free (ring);
+	errno = saved;
+	return NULL;
+}
+
+void
+mcp2210_ring_free (struct mcp2210_ring *ring)
+{
+	if (ring->bufs)
+		munmap (ring->bufs, ring->commands * sizeof (*ring->bufs));
+	if (ring->sqes != MAP_FAILED)
+		munmap (ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap (ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring != MAP_FAILED)
+		munmap (ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd != -1)
+		close (ring->fd);
+	free (ring->order);
+	free (ring);
+}
+
+static int
+order_cmp (const void *a, const void *b)
+{
+	const struct ring_order *oa = a, *ob = b;
+
+	if (oa->fd != ob->fd)
+		return oa->fd < ob->fd ? -1 : 1;
+	return oa->i < ob->i ? -1 : oa->i > ob->i;
+}
+
+static void
+ring_sqe (struct mcp2210_ring *ring, unsigned int n, unsigned char opcode, int fd,
+		unsigned char *buf, unsigned long long user_data, unsigned char flags)
+{
+	unsigned int tail = *ring->sq_tail + n;
+	unsigned int idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset (sqe, 0, sizeof (*sqe));
+	sqe->opcode = opcode;
+	sqe->flags = flags;
+	sqe->fd = fd;
+	sqe->off = -1;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = MCP2210_PACKET_SIZE;
+	sqe->buf_index = 0;
+	sqe->user_data = user_data;
+	ring->sq_array[idx] = idx;
+}
+
+/*
+ * Submit the commands in the order array and wait for them to complete.
+ * The commands for the same fd are chained, so that they're issued one
+ * after another and a failure cancels the rest of them.
+ */
+
+static int
+ring_submit (struct mcp2210_ring *ring, const int *fds, mcp2210_packet *packets,
+		int *results, int count)
+{
+	unsigned int submit = count * 2, done = 0;
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	int slot, dir, i, k;
+	int ret;
+
+	for (k = 0; k < count; k++) {
+		struct ring_order *o = &ring->order[k];
+		int chained = k + 1 < count && ring->order[k + 1].fd == o->fd;
+
+		/* The responses bypass mcp2210_read_report(). */
+		if (packets[o->i][0] == MCP2210_SPI_SET)
+			mcp2210_spi_forget (o->fd);
+		memcpy (ring->bufs[k][0], packets[o->i], MCP2210_PACKET_SIZE);
+		memset (ring->bufs[k][1], 0, MCP2210_PACKET_SIZE);
+		ring_sqe (ring, k * 2, IORING_OP_WRITE_FIXED, o->fd, ring->bufs[k][0],
+			k << 1, IOSQE_IO_LINK);
+		ring_sqe (ring, k * 2 + 1, IORING_OP_READ_FIXED, o->fd, ring->bufs[k][1],
+			k << 1 | 1, chained ? IOSQE_IO_LINK : 0);
+	}
+	__atomic_store_n (ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+
+	while (done < count * 2) {
+		ret = io_uring_enter (ring->fd, submit, 1, IORING_ENTER_GETEVENTS);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		submit -= ret;
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			slot = cqe->user_data >> 1;
+			dir = cqe->user_data & 1;
+			i = ring->order[slot].i;
+			ret = cqe->res;
+
+			if (mcp2210_trace) {
+				mcp2210_trace_packet (fds[i], dir ? MCP2210_TRACE_READ : MCP2210_TRACE_WRITE,
+					ret < 0 ? -1 : ret, ring->bufs[slot][dir]);
+			}
+
+			/* The first failure of a command is what counts. */
+			if (results[i] != 0) {
+				/* Nothing. */
+			} else if (ret < 0) {
+				results[i] = -ret;
+			} else if (dir) {
+				unsigned char command = packets[i][0];
+
+				memcpy (packets[i], ring->bufs[slot][1], MCP2210_PACKET_SIZE);
+				if (ret != MCP2210_PACKET_SIZE)
+					results[i] = -MCP2210_ERDSHORT;
+				else if (packets[i][1] != 0)
+					results[i] = -packets[i][1];
+				else if (packets[i][0] != command)
+					results[i] = -MCP2210_EBADCMD;
+			} else if (ret != MCP2210_PACKET_SIZE) {
+				results[i] = -MCP2210_EWRSHORT;
+			}
+
+			head++;
+			done++;
+		}
+		__atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/*
+ * Issue a command on each of the n file descriptors. The command codes are
+ * taken from the first byte of each packet and the packets are replaced
+ * with the responses. A descriptor can appear more than once; its commands
+ * are then issued in order. The result for each command is stored in
+ * results: zero on success, a negative library error code, or a positive
+ * errno value if the transfer failed. Descriptors with a transport other
+ * than hidraw registered are served with mcp2210_command(). Returns the
+ * number of commands that failed, or -1 with errno set if the ring
+ * couldn't be used at all.
+ */
+
+int
+mcp2210_ring_commands (struct mcp2210_ring *ring, const int *fds, mcp2210_packet *packets,
+		int *results, int n)
+{
+	int failed = 0;
+	int count;
+	void *priv;
+	int i = 0;
+
+	while (i < n) {
+		count = 0;
+		for (; i < n && count < ring->commands; i++) {
+			results[i] = 0;
+			if (mcp2210_get_transport (fds[i], &priv) != &mcp2210_hidraw_transport) {
+				results[i] = mcp2210_command (fds[i], packets[i], packets[i][0]);
+				if (results[i] == -1)
+					results[i] = errno;
+				continue;
+			}
+			ring->order[count].fd = fds[i];
+			ring->order[count].i = i;
+			count++;
+		}
+
+		qsort (ring->order, count, sizeof (*ring->order), order_cmp);
+		if (ring_submit (ring, fds, packets, results, count) == -1)
+			return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (results[i] != 0)
+			failed++;
+	}
+
+	return failed;
+}
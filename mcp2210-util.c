@@ -19,7 +19,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -36,6 +40,8 @@ unsigned short nvram_usb_key_mod = 0;
 unsigned short spi_mod = 0;
 unsigned short chip_mod = 0;
 unsigned short spi_tx_len = 0;
+unsigned short runtime = 1;
+unsigned short nvram = 0;
 
 mcp2210_packet gpio_val_packet = { 0, };
 mcp2210_packet gpio_dir_packet = { 0, };
@@ -48,7 +54,67 @@ mcp2210_packet nvram_usb_key_packet = { 0, };
 mcp2210_packet spi_packet = { 0, };
 mcp2210_packet chip_packet = { 0, };
 
+/* NVRAM sections as read from the device, indexed by sub-command >> 4. */
+mcp2210_packet nvram_orig[6];
+
+/* The NVRAM sections above that came from the device rather than the cache. */
+unsigned int nvram_fresh;
+
+/* The last 32768 commands, about 2 MB of SPI data, in a 5 MB file. */
+#define TRACE_RECORDS		65536
+
 char spi_tx[MCP2210_SPI_TX_MAX];
+char *spi_tx_file = NULL;
+size_t spi_tx_file_len = 0;
+int spi_tx_stream = -1;
+
+/* The expected response, compared as it arrives. */
+char *spi_verify = NULL;
+size_t spi_verify_len = 0;
+unsigned int spi_crc = 0;
+
+/* Requested with SIGINT; the next one terminates as usual. */
+struct mcp2210_cancel cancel = { 0, };
+
+/* The SPI transfers wait for an external master unless bus_wait_ms is 0. */
+int bus_wait_ms = 0;
+int bus_release = -1;
+
+/* Publish the state for other processes every shm_interval_ms. */
+const char *shm_path = NULL;
+int shm_interval_ms = 0;
+
+/* The data received by the SPI transfers goes to a capture file, if set. */
+const char *capture_path = NULL;
+struct mcp2210_capture *capture = NULL;
+
+/* The settings are read from and saved to a cache, if set. */
+const char *cache_dir = NULL;
+struct mcp2210_cache *cache = NULL;
+
+/* Real-time mode for the transfers, if any of these is set. */
+int rt_cpus[64];
+int rt_ncpus = 0;
+int rt_priority = 0;
+int rt_lock = 0;
+
+#define FORMAT_TEXT	0
+#define FORMAT_JSON	1
+#define FORMAT_CSV	2
+
+/* Sections collected for the structured output, MCP2210_STATE_* bits. */
+unsigned short output_format = FORMAT_TEXT;
+
+#define HEX_DEFAULT	0
+#define HEX_CANONICAL	1
+#define HEX_PLAIN	2
+#define HEX_C		3
+
+unsigned short hex_format = HEX_DEFAULT;
+unsigned int record_sections = 0;
+struct mcp2210_state record_state;
+const char *changed_since = NULL;
+unsigned char eeprom_data[MCP2210_EEPROM_SIZE];
 
 static void
 print_in_out (int i)
@@ -56,6 +122,28 @@ print_in_out (int i)
 	printf ("%s", i ? "in" : "out");
 }
 
+/* The state section a command reads, for the cache. */
+
+static int
+get_section (unsigned short command)
+{
+	switch (command) {
+	case MCP2210_SPI_GET:
+		return MCP2210_STATE_SPI;
+	case MCP2210_GPIO_VAL_GET:
+		return MCP2210_STATE_GPIO_VAL;
+	case MCP2210_GPIO_DIR_GET:
+		return MCP2210_STATE_GPIO_DIR;
+	case MCP2210_CHIP_GET:
+		return MCP2210_STATE_CHIP;
+	default:
+		return MCP2210_STATE_STATUS;
+	}
+}
+
+/* The NVRAM sections follow each other in the sub-command order. */
+#define NVRAM_SECTION(subcommand)	(MCP2210_STATE_NVRAM_SPI + ((subcommand) >> 4) - 1)
+
 static inline void
 maybe_get (int fd, mcp2210_packet packet, unsigned short command)
 {
@@ -63,7 +151,10 @@ maybe_get (int fd, mcp2210_packet packet, unsigned short command)
 
 	if (packet[0])
 		return;
-	ret = mcp2210_command (fd, packet, command);
+	if (cache)
+		ret = mcp2210_cache_get (cache, get_section (command), packet);
+	else
+		ret = mcp2210_command (fd, packet, command);
 	if (ret < 0) {
 		fprintf (stderr, "Error reading from the device: %s\n",
 			mcp2210_strerror (ret));
@@ -74,54 +165,344 @@ maybe_get (int fd, mcp2210_packet packet, unsigned short command)
 static inline void
 maybe_get_nvram (int fd, mcp2210_packet packet, unsigned short subcommand)
 {
+	struct mcp2210_cache_stats stats;
+	unsigned long long hits = 0;
 	int ret;
 
 	if (packet[0])
 		return;
-	ret = mcp2210_subcommand (fd, packet, MCP2210_NVRAM_GET, subcommand);
+	if (cache) {
+		mcp2210_cache_get_stats (cache, &stats);
+		hits = stats.hits;
+		ret = mcp2210_cache_get (cache, NVRAM_SECTION (subcommand), packet);
+		mcp2210_cache_get_stats (cache, &stats);
+	} else {
+		ret = mcp2210_subcommand (fd, packet, MCP2210_NVRAM_GET, subcommand);
+	}
 	if (ret < 0) {
 		fprintf (stderr, "Error reading NVRAM: %s\n",
 			mcp2210_strerror (ret));
 		exit (1);
 	}
+	memcpy (nvram_orig[subcommand >> 4], packet, MCP2210_PACKET_SIZE);
+	if (cache == NULL || stats.hits == hits)
+		nvram_fresh |= 1 << (subcommand >> 4);
 }
 
-void
-hex_dump (const char *data, int len)
+/*
+ * Write a NVRAM section back, unless it's unchanged from what we've read.
+ * The NVRAM is slow and wears out, so we skip the needless writes and read
+ * back the ones we do to make sure the settings made it. A cached section
+ * may be out of date, so it's read from the device before it's trusted to
+ * skip a write.
+ */
+
+static int
+write_nvram (int fd, mcp2210_packet packet, unsigned short subcommand)
 {
+	mcp2210_packet set = { 0, };
+	int ret;
+
+	if (memcmp (packet, nvram_orig[subcommand >> 4], MCP2210_PACKET_SIZE) == 0) {
+		if (nvram_fresh & (1 << (subcommand >> 4)))
+			return 0;
+
+		ret = mcp2210_get_nvram (fd, set, subcommand);
+		if (ret < 0)
+			return ret;
+		memcpy (nvram_orig[subcommand >> 4], set, MCP2210_PACKET_SIZE);
+		nvram_fresh |= 1 << (subcommand >> 4);
+		if (cache)
+			mcp2210_cache_put (cache, NVRAM_SECTION (subcommand), set);
+		if (mcp2210_settings_cmp (set, packet, subcommand) == 0)
+			return 0;
+		memset (set, 0, MCP2210_PACKET_SIZE);
+	}
+
+	if (subcommand == MCP2210_NVRAM_PARAM_USB_KEY)
+		mcp2210_usb_key_get_to_set (packet, set);
+	else
+		memcpy (set, packet, MCP2210_PACKET_SIZE);
+
+	ret = mcp2210_set_nvram (fd, set, subcommand);
+	if (ret < 0)
+		return ret;
+
+	ret = mcp2210_get_nvram (fd, set, subcommand);
+	if (ret < 0)
+		return ret;
+	if (mcp2210_settings_cmp (set, packet, subcommand))
+		return -MCP2210_EVERIFY;
+
+	memcpy (nvram_orig[subcommand >> 4], packet, MCP2210_PACKET_SIZE);
+	nvram_fresh |= 1 << (subcommand >> 4);
+	if (cache)
+		mcp2210_cache_put (cache, NVRAM_SECTION (subcommand), packet);
+	return 0;
+}
+
+/*
+ * Same for the user EEPROM: only the bytes that differ are written,
+ * each is read back.
+ */
+
+static int
+write_eeprom (int fd, unsigned short addr, const char *data, int len)
+{
+	mcp2210_packet packet;
+	unsigned char val;
+	int ret;
 	int i;
 
-	printf ("      ");
-	for (i = 0; i < 16; i++)
-		printf ("%02x ", i);
 	for (i = 0; i < len; i++) {
-		if (i % 16 == 0)
-			printf ("\n%04x:", i);
-		printf (" %02x", data[i]);
+		val = data[i];
+		ret = mcp2210_read_eeprom (fd, packet, addr + i);
+		if (ret < 0)
+			return ret;
+		if (ret == val)
+			continue;
+
+		ret = mcp2210_write_eeprom (fd, packet, addr + i, val);
+		if (ret < 0)
+			return ret;
+
+		ret = mcp2210_read_eeprom (fd, packet, addr + i);
+		if (ret < 0)
+			return ret;
+		if (ret != val)
+			return -MCP2210_EVERIFY;
 	}
-	putchar ('\n');
+
+	return 0;
+}
+
+/*
+ * Hex dumps of the SPI data. These can get large, so the lines are formatted
+ * with a lookup table into a buffer that's written out in big pieces instead
+ * of going through printf for each byte.
+ */
+
+static char hex_pairs[256][2];
+static char hex_out[65536];
+static size_t hex_out_len;
+
+static void
+hex_flush (void)
+{
+	fwrite (hex_out, 1, hex_out_len, stdout);
+	hex_out_len = 0;
+}
+
+static inline char *
+hex_reserve (size_t len)
+{
+	if (hex_out_len + len > sizeof (hex_out))
+		hex_flush ();
+	return &hex_out[hex_out_len];
+}
+
+static inline char *
+hex_byte (char *p, unsigned char b)
+{
+	*p++ = hex_pairs[b][0];
+	*p++ = hex_pairs[b][1];
+	return p;
+}
+
+static char *
+hex_offset (char *p, size_t off, int digits)
+{
+	int i;
+
+	for (i = digits - 1; i >= 0; i--)
+		*p++ = "0123456789abcdef"[(off >> (i * 4)) & 0xf];
+	return p;
 }
 
 void
-status_dump (mcp2210_packet packet)
+hex_dump (const char *data, size_t len)
 {
-	printf ("External SPI bus request: %s\n",
-		mcp2210_status_no_ext_request (packet) ? "no" : "yes");
-	printf ("Current SPI bus owner: ");
-	switch (mcp2210_status_bus_owner (packet)) {
-	case MCP2210_STATUS_SPI_OWNER_NONE:
-		printf ("none\n");
+	const unsigned char *d = (const unsigned char *)data;
+	int digits = 4;
+	size_t i, j, n;
+	char *p;
+
+	if (!hex_pairs[0][0]) {
+		for (i = 0; i < 256; i++) {
+			hex_pairs[i][0] = "0123456789abcdef"[i >> 4];
+			hex_pairs[i][1] = "0123456789abcdef"[i & 0xf];
+		}
+	}
+
+	while (digits < 16 && len > (size_t)1 << (digits * 4))
+		digits++;
+
+	switch (hex_format) {
+	case HEX_CANONICAL:
+		for (i = 0; i < len; i += 16) {
+			n = len - i < 16 ? len - i : 16;
+			p = hex_reserve (80);
+			p = hex_offset (p, i, 8);
+			*p++ = ' ';
+			for (j = 0; j < 16; j++) {
+				*p++ = ' ';
+				if (j < n) {
+					p = hex_byte (p, d[i + j]);
+				} else {
+					*p++ = ' ';
+					*p++ = ' ';
+				}
+				if (j == 7)
+					*p++ = ' ';
+			}
+			*p++ = ' ';
+			*p++ = ' ';
+			*p++ = '|';
+			for (j = 0; j < n; j++)
+				*p++ = d[i + j] >= 0x20 && d[i + j] < 0x7f ? d[i + j] : '.';
+			*p++ = '|';
+			*p++ = '\n';
+			hex_out_len = p - hex_out;
+		}
+		p = hex_reserve (16);
+		p = hex_offset (p, len, 8);
+		*p++ = '\n';
 		break;
-	case MCP2210_STATUS_SPI_OWNER_US:
-		printf ("USB\n");
+	case HEX_PLAIN:
+		for (i = 0; i < len; i += 32) {
+			n = len - i < 32 ? len - i : 32;
+			p = hex_reserve (66);
+			for (j = 0; j < n; j++)
+				p = hex_byte (p, d[i + j]);
+			*p++ = '\n';
+			hex_out_len = p - hex_out;
+		}
+		p = hex_reserve (0);
 		break;
-	case MCP2210_STATUS_SPI_OWNER_EXT:
-		printf ("external\n");
+	case HEX_C:
+		p = hex_reserve (64);
+		p += sprintf (p, "unsigned char spi_data[%zu] = {\n", len);
+		for (i = 0; i < len; i += 12) {
+			n = len - i < 12 ? len - i : 12;
+			hex_out_len = p - hex_out;
+			p = hex_reserve (80);
+			*p++ = '\t';
+			for (j = 0; j < n; j++) {
+				*p++ = '0';
+				*p++ = 'x';
+				p = hex_byte (p, d[i + j]);
+				*p++ = ',';
+				*p++ = j + 1 < n ? ' ' : '\n';
+			}
+		}
+		hex_out_len = p - hex_out;
+		p = hex_reserve (4);
+		*p++ = '}';
+		*p++ = ';';
+		*p++ = '\n';
 		break;
 	default:
-		printf ("unknown\n");
+		p = hex_reserve (80);
+		for (i = 0; i < digits + 2; i++)
+			*p++ = ' ';
+		for (i = 0; i < 16; i++) {
+			p = hex_byte (p, i);
+			*p++ = ' ';
+		}
+		for (i = 0; i < len; i += 16) {
+			n = len - i < 16 ? len - i : 16;
+			hex_out_len = p - hex_out;
+			p = hex_reserve (80);
+			*p++ = '\n';
+			p = hex_offset (p, i, digits);
+			*p++ = ':';
+			for (j = 0; j < n; j++) {
+				*p++ = ' ';
+				p = hex_byte (p, d[i + j]);
+			}
+		}
+		hex_out_len = p - hex_out;
+		p = hex_reserve (1);
+		*p++ = '\n';
 		break;
 	}
+
+	hex_out_len = p - hex_out;
+	hex_flush ();
+	fflush (stdout);
+}
+
+static const char *
+bus_owner_name (unsigned short owner)
+{
+	switch (owner) {
+	case MCP2210_STATUS_SPI_OWNER_NONE:
+		return "none";
+	case MCP2210_STATUS_SPI_OWNER_US:
+		return "USB";
+	case MCP2210_STATUS_SPI_OWNER_EXT:
+		return "external";
+	}
+
+	return "unknown";
+}
+
+static const char *
+pin_function_name (unsigned short func)
+{
+	switch (func) {
+	case MCP2210_CHIP_PIN_GPIO:
+		return "gpio";
+	case MCP2210_CHIP_PIN_CS:
+		return "cs";
+	case MCP2210_CHIP_PIN_FUNC:
+		return "func";
+	}
+
+	return "unknown";
+}
+
+static const char *
+gp6_mode_name (unsigned short mode)
+{
+	switch (mode) {
+	case MCP2210_CHIP_GP6_CNT_HI_PULSE:
+		return "high pulses";
+	case MCP2210_CHIP_GP6_CNT_LO_PULSE:
+		return "low pulses";
+	case MCP2210_CHIP_GP6_CNT_UP_EDGE:
+		return "rising edges";
+	case MCP2210_CHIP_GP6_CNT_DN_EDGE:
+		return "falling edges";
+	case MCP2210_CHIP_GP6_CNT_NONE:
+		return "none";
+	}
+
+	return "unknown";
+}
+
+static const char *
+access_control_name (unsigned short setting)
+{
+	switch (setting) {
+	case MCP2210_CHIP_PROTECT_NONE:
+		return "not protected";
+	case MCP2210_CHIP_PROTECT_PASSWD:
+		return "protected with password";
+	case MCP2210_CHIP_PROTECT_LOCKED:
+		return "permanently locked";
+	}
+
+	return "unknown";
+}
+
+void
+status_dump (mcp2210_packet packet)
+{
+	printf ("External SPI bus request: %s\n",
+		mcp2210_status_no_ext_request (packet) ? "no" : "yes");
+	printf ("Current SPI bus owner: %s\n",
+		bus_owner_name (mcp2210_status_bus_owner (packet)));
 	printf ("Attempted password accesses: %d\n",
 		mcp2210_status_password_count (packet));
 	printf ("Password guessed: %s\n",
@@ -135,20 +516,7 @@ chip_dump (mcp2210_packet packet)
 
 	printf ("Pin designation: ");
 	for (i = MCP2210_GPIO_PINS; i >= 0; i--) {
-		switch (mcp2210_chip_get_function (packet, i)) {
-		case MCP2210_CHIP_PIN_GPIO:
-			printf ("gpio");
-			break;
-		case MCP2210_CHIP_PIN_CS:
-			printf ("cs");
-			break;
-		case MCP2210_CHIP_PIN_FUNC:
-			printf ("func");
-			break;
-		default:
-			printf ("unknown");
-			break;
-		}
+		printf ("%s", pin_function_name (mcp2210_chip_get_function (packet, i)));
 		putchar (i ? ' ' : '\n');
 	}
 
@@ -165,47 +533,12 @@ chip_dump (mcp2210_packet packet)
 
 	printf ("Remote wake-up: %s\n", mcp2210_chip_get_wakeup (packet) ? "enabled" : "disabled");
 
-	printf ("GP6 count mode: ");
-	switch (mcp2210_chip_get_gp6_mode (packet)) {
-	case MCP2210_CHIP_GP6_CNT_HI_PULSE:
-		printf ("high pulses");
-		break;
-	case MCP2210_CHIP_GP6_CNT_LO_PULSE:
-		printf ("low pulses");
-		break;
-	case MCP2210_CHIP_GP6_CNT_UP_EDGE:
-		printf ("rising edges");
-		break;
-	case MCP2210_CHIP_GP6_CNT_DN_EDGE:
-		printf ("falling edges");
-		break;
-	case MCP2210_CHIP_GP6_CNT_NONE:
-		printf ("none");
-		break;
-	default:
-		printf ("unknown");
-		break;
-	}
-	putchar ('\n');
+	printf ("GP6 count mode: %s\n", gp6_mode_name (mcp2210_chip_get_gp6_mode (packet)));
 
 	printf ("Release bus between transfers: %s\n", mcp2210_chip_get_no_spi_release (packet) ? "no" : "yes");
 
-	printf ("Settings access control: ");
-	switch (mcp2210_chip_get_access_control (packet)) {
-	case MCP2210_CHIP_PROTECT_NONE:
-		printf ("not protected");
-		break;
-	case MCP2210_CHIP_PROTECT_PASSWD:
-		printf ("protected with password");
-		break;
-	case MCP2210_CHIP_PROTECT_LOCKED:
-		printf ("permanently locked");
-		break;
-	default:
-		printf ("unknown");
-		break;
-	}
-	putchar ('\n');
+	printf ("Settings access control: %s\n",
+		access_control_name (mcp2210_chip_get_access_control (packet)));
 }
 
 void
@@ -268,6 +601,34 @@ usb_string_dump (mcp2210_packet packet)
 
 /*********************************************************************/
 
+/*
+ * The dumps only collect the sections when structured output
+ * was requested. They're copied as they're dumped, the later
+ * options may change the packets. See print_record().
+ */
+
+static int
+record_section (unsigned int section, const mcp2210_packet packet)
+{
+	if (output_format == FORMAT_TEXT)
+		return 0;
+	record_sections |= 1 << section;
+	if (section == MCP2210_STATE_EEPROM) {
+		memcpy (record_state.eeprom, eeprom_data, MCP2210_EEPROM_SIZE);
+		record_state.has_eeprom = 1;
+	} else {
+		memcpy (record_state.packets[section], packet, MCP2210_PACKET_SIZE);
+	}
+	return 1;
+}
+
+static void
+separator (void)
+{
+	if (output_format == FORMAT_TEXT)
+		putchar ('\n');
+}
+
 void
 dump_eeprom (int fd)
 {
@@ -275,7 +636,6 @@ dump_eeprom (int fd)
 	int i;
 	int b;
 
-	printf ("EEPROM dump:\n\n");
 	for (i = 0; i <= 0xff; i++) {
 		b = mcp2210_read_eeprom (fd, packet, i);
 		if (b < 0) {
@@ -283,75 +643,100 @@ dump_eeprom (int fd)
 				i, mcp2210_strerror (b));
 			exit (1);
 		}
-		printf ("%02x%c", b, (i + 1) % 16 ? ' ' : '\n');
+		eeprom_data[i] = b;
 	}
+
+	if (record_section (MCP2210_STATE_EEPROM, NULL))
+		return;
+
+	printf ("EEPROM dump:\n\n");
+	for (i = 0; i <= 0xff; i++)
+		printf ("%02x%c", eeprom_data[i], (i + 1) % 16 ? ' ' : '\n');
 }
 
 void
 dump_status (int fd)
 {
-	printf ("Runtime status:\n\n");
 	maybe_get (fd, status_packet, MCP2210_STATUS_GET);
+	if (record_section (MCP2210_STATE_STATUS, status_packet))
+		return;
+	printf ("Runtime status:\n\n");
 	status_dump (status_packet);
 
 }
 void
 dump_runtime_spi (int fd)
 {
-	printf ("Runtime SPI settings:\n\n");
 	maybe_get (fd, spi_packet, MCP2210_SPI_GET);
+	if (record_section (MCP2210_STATE_SPI, spi_packet))
+		return;
+	printf ("Runtime SPI settings:\n\n");
 	spi_dump (spi_packet);
 }
 
 void
 dump_runtime_gpio (int fd)
 {
-	printf ("Runtime GPIO values: ");
 	maybe_get (fd, gpio_val_packet, MCP2210_GPIO_VAL_GET);
+	maybe_get (fd, gpio_dir_packet, MCP2210_GPIO_DIR_GET);
+	if (record_section (MCP2210_STATE_GPIO_VAL, gpio_val_packet) && record_section (MCP2210_STATE_GPIO_DIR, gpio_dir_packet))
+		return;
+
+	printf ("Runtime GPIO values: ");
 	gpio_dump (gpio_val_packet);
 
 	printf ("Runtime GPIO directions: ");
-	maybe_get (fd, gpio_dir_packet, MCP2210_GPIO_DIR_GET);
 	gpio_dump (gpio_dir_packet);
 }
 
 void
 dump_runtime_chip (int fd)
 {
-	printf ("Runtime chip settings:\n\n");
 	maybe_get (fd, chip_packet, MCP2210_CHIP_GET);
+	if (record_section (MCP2210_STATE_CHIP, chip_packet))
+		return;
+	printf ("Runtime chip settings:\n\n");
 	chip_dump (chip_packet);
 }
 
 void
 dump_nvram_spi (int fd)
 {
-	printf ("NVRAM SPI settings:\n\n");
 	maybe_get_nvram (fd, nvram_spi_packet, MCP2210_NVRAM_PARAM_SPI);
+	if (record_section (MCP2210_STATE_NVRAM_SPI, nvram_spi_packet))
+		return;
+	printf ("NVRAM SPI settings:\n\n");
 	spi_dump (nvram_spi_packet);
 }
 
 void
 dump_nvram_chip (int fd)
 {
-	printf ("NVRAM chip settings:\n\n");
 	maybe_get_nvram (fd, nvram_chip_packet, MCP2210_NVRAM_PARAM_CHIP);
+	if (record_section (MCP2210_STATE_NVRAM_CHIP, nvram_chip_packet))
+		return;
+	printf ("NVRAM chip settings:\n\n");
 	chip_dump (nvram_chip_packet);
 }
 
 void
 dump_nvram_usb (int fd)
 {
-	printf ("NVRAM USB key settings:\n\n");
 	maybe_get_nvram (fd, nvram_usb_key_packet, MCP2210_NVRAM_PARAM_USB_KEY);
+	maybe_get_nvram (fd, nvram_product_packet, MCP2210_NVRAM_PARAM_PRODUCT);
+	maybe_get_nvram (fd, nvram_manufact_packet, MCP2210_NVRAM_PARAM_MANUFACT);
+	if (record_section (MCP2210_STATE_NVRAM_USB_KEY, nvram_usb_key_packet)
+	    && record_section (MCP2210_STATE_NVRAM_PRODUCT, nvram_product_packet)
+	    && record_section (MCP2210_STATE_NVRAM_MANUFACT, nvram_manufact_packet))
+		return;
+
+	printf ("NVRAM USB key settings:\n\n");
 	usb_key_dump (nvram_usb_key_packet);
 
 	printf ("\nNVRAM USB product: ");
-	maybe_get_nvram (fd, nvram_product_packet, MCP2210_NVRAM_PARAM_PRODUCT);
 	usb_string_dump (nvram_product_packet);
 
 	printf ("NVRAM USB manufacturer: ");
-	maybe_get_nvram (fd, nvram_manufact_packet, MCP2210_NVRAM_PARAM_MANUFACT);
 	usb_string_dump (nvram_manufact_packet);
 }
 
@@ -359,32 +744,528 @@ void
 dump_runtime (int fd)
 {
 	dump_status (fd);
-	putchar ('\n');
+	separator ();
 	dump_runtime_spi (fd);
-	putchar ('\n');
+	separator ();
 	dump_runtime_gpio (fd);
-	putchar ('\n');
+	separator ();
 	dump_runtime_chip (fd);
 }
 
 void
 dump_nvram (int fd)
 {
-	dump_nvram_spi (fd);
-	putchar ('\n');
-	dump_nvram_chip (fd);
-	putchar ('\n');
-	dump_nvram_usb (fd);
+	dump_nvram_spi (fd);
+	separator ();
+	dump_nvram_chip (fd);
+	separator ();
+	dump_nvram_usb (fd);
+}
+
+void
+dump_all (int fd)
+{
+	dump_runtime (fd);
+	separator ();
+	dump_nvram (fd);
+	separator ();
+	dump_eeprom (fd);
+}
+
+/*********************************************************************/
+
+static const char *state_names[] = {
+	[MCP2210_STATE_STATUS] = "status",
+	[MCP2210_STATE_SPI] = "spi",
+	[MCP2210_STATE_GPIO_VAL] = "gpio-val",
+	[MCP2210_STATE_GPIO_DIR] = "gpio-dir",
+	[MCP2210_STATE_CHIP] = "chip",
+	[MCP2210_STATE_NVRAM_SPI] = "nvram-spi",
+	[MCP2210_STATE_NVRAM_CHIP] = "nvram-chip",
+	[MCP2210_STATE_NVRAM_USB_KEY] = "nvram-usb-key",
+	[MCP2210_STATE_NVRAM_PRODUCT] = "nvram-product",
+	[MCP2210_STATE_NVRAM_MANUFACT] = "nvram-manufacturer",
+	[MCP2210_STATE_EEPROM] = "eeprom",
+};
+
+void
+get_state (int fd, struct mcp2210_state *state, int eeprom)
+{
+	int ret;
+
+	ret = mcp2210_state_get (fd, state, eeprom);
+	if (ret < 0) {
+		fprintf (stderr, "Error reading from the device: %s\n",
+			mcp2210_strerror (ret));
+		exit (1);
+	}
+}
+
+void
+read_state (const char *path, struct mcp2210_state *state)
+{
+	FILE *f;
+
+	f = fopen (path, "r");
+	if (f == NULL) {
+		perror (path);
+		exit (1);
+	}
+	if (fread (state, sizeof (*state), 1, f) != 1 || !mcp2210_state_valid (state)) {
+		fprintf (stderr, "%s: Not a MCP2210 state snapshot\n", path);
+		exit (1);
+	}
+	fclose (f);
+}
+
+void
+save_state (int fd, const char *path)
+{
+	struct mcp2210_state state;
+	FILE *f;
+
+	get_state (fd, &state, 1);
+
+	f = fopen (path, "w");
+	if (f == NULL) {
+		perror (path);
+		exit (1);
+	}
+	if (fwrite (&state, sizeof (state), 1, f) != 1 || fclose (f) != 0) {
+		perror (path);
+		exit (1);
+	}
+}
+
+void
+restore_state (int fd, const char *path)
+{
+	struct mcp2210_state cur, want;
+	int ret;
+	int i;
+
+	read_state (path, &want);
+	get_state (fd, &cur, want.has_eeprom);
+
+	/* Whatever was cached is read again next time, even if this fails. */
+	for (i = 0; cache && i < MCP2210_STATE_PACKETS; i++)
+		mcp2210_cache_put (cache, i, NULL);
+
+	ret = mcp2210_state_restore (fd, &cur, &want);
+	if (ret < 0) {
+		fprintf (stderr, "Error restoring the state: %s\n",
+			mcp2210_strerror (ret));
+		if (cache && mcp2210_cache_close (cache) == -1)
+			perror (cache_dir);
+		exit (1);
+	}
+}
+
+void
+diff_state (int fd, const char *path)
+{
+	struct mcp2210_state cur, want;
+	unsigned int diff;
+	int i;
+
+	read_state (path, &want);
+	get_state (fd, &cur, want.has_eeprom);
+
+	diff = mcp2210_state_diff (&cur, &want);
+	for (i = 0; i <= MCP2210_STATE_EEPROM; i++) {
+		if (diff & (1 << i))
+			printf ("%s\n", state_names[i]);
+	}
+}
+
+/*
+ * Tune the SPI timing against the expected response, or against the
+ * data itself with MISO looped back to MOSI. The result is printed in
+ * the form of options that can be used as a profile.
+ */
+
+#define AUTOTUNE_ROUNDS		8
+#define AUTOTUNE_MARGIN		1
+#define AUTOTUNE_LEN		64
+
+void
+spi_autotune (int fd, const char *tx, const char *expect, unsigned short len)
+{
+	char pattern[AUTOTUNE_LEN];
+	unsigned short lfsr = 0xace1;
+	int ret;
+	int i;
+
+	/* Edges first, then a pseudo-random sequence. */
+	if (tx == NULL) {
+		static const unsigned char edges[] = { 0x00, 0xff, 0x55, 0xaa, 0x0f, 0xf0, 0x33, 0xcc };
+
+		for (i = 0; i < sizeof (pattern); i++) {
+			if (i < sizeof (edges)) {
+				pattern[i] = edges[i];
+				continue;
+			}
+			lfsr = (lfsr >> 1) ^ (-(lfsr & 1) & 0xb400);
+			pattern[i] = lfsr;
+		}
+		tx = pattern;
+		len = sizeof (pattern);
+	}
+
+	maybe_get (fd, spi_packet, MCP2210_SPI_GET);
+	ret = mcp2210_spi_autotune (fd, spi_packet, tx, expect, len,
+		AUTOTUNE_ROUNDS, AUTOTUNE_MARGIN);
+	if (ret < 0) {
+		fprintf (stderr, "SPI auto-tuning failed: %s\n", mcp2210_strerror (ret));
+		exit (1);
+	}
+
+	printf ("--bit-rate %ld --cs-to-data-delay %u --data-to-cs-delay %u --byte-delay %u\n",
+		mcp2210_spi_get_bitrate (spi_packet),
+		mcp2210_spi_get_cs_data_delay_100us (spi_packet) * 100,
+		mcp2210_spi_get_data_cs_delay_100us (spi_packet) * 100,
+		mcp2210_spi_get_byte_delay_100us (spi_packet) * 100);
+
+	if (nvram) {
+		maybe_get_nvram (fd, nvram_spi_packet, MCP2210_NVRAM_PARAM_SPI);
+		nvram_spi_mod = 1;
+		mcp2210_spi_set_bitrate (nvram_spi_packet, mcp2210_spi_get_bitrate (spi_packet));
+		mcp2210_spi_set_cs_data_delay_100us (nvram_spi_packet,
+			mcp2210_spi_get_cs_data_delay_100us (spi_packet));
+		mcp2210_spi_set_data_cs_delay_100us (nvram_spi_packet,
+			mcp2210_spi_get_data_cs_delay_100us (spi_packet));
+		mcp2210_spi_set_byte_delay_100us (nvram_spi_packet,
+			mcp2210_spi_get_byte_delay_100us (spi_packet));
+	}
+}
+
+/*
+ * Structured output. Instead of printing the dumps right away, the fields
+ * are collected into a record that's printed once in JSON or CSV form when
+ * all the options are processed.
+ */
+
+struct field {
+	char *name;
+	char *value;
+	int string;
+};
+
+struct record {
+	struct field *fields;
+	int count;
+};
+
+static void
+field_add (struct record *rec, int string, const char *prefix, const char *name, const char *fmt, ...)
+{
+	struct field *f;
+	va_list ap;
+
+	rec->fields = realloc (rec->fields, (rec->count + 1) * sizeof (*rec->fields));
+	f = &rec->fields[rec->count++];
+	f->string = string;
+	if (asprintf (&f->name, "%s%s", prefix, name) == -1)
+		abort ();
+	va_start (ap, fmt);
+	if (vasprintf (&f->value, fmt, ap) == -1)
+		abort ();
+	va_end (ap);
+}
+
+#define field_str(rec, prefix, name, fmt, ...) \
+	field_add (rec, 1, prefix, name, fmt, ##__VA_ARGS__)
+#define field_num(rec, prefix, name, fmt, ...) \
+	field_add (rec, 0, prefix, name, fmt, ##__VA_ARGS__)
+#define field_bool(rec, prefix, name, val) \
+	field_add (rec, 0, prefix, name, "%s", (val) ? "true" : "false")
+
+static void
+record_free (struct record *rec)
+{
+	int i;
+
+	for (i = 0; i < rec->count; i++) {
+		free (rec->fields[i].name);
+		free (rec->fields[i].value);
+	}
+	free (rec->fields);
+	rec->fields = NULL;
+	rec->count = 0;
+}
+
+static void
+status_record (struct record *rec, const char *p, mcp2210_packet packet)
+{
+	field_bool (rec, p, "ext_request", !mcp2210_status_no_ext_request (packet));
+	field_str (rec, p, "bus_owner", "%s", bus_owner_name (mcp2210_status_bus_owner (packet)));
+	field_num (rec, p, "password_count", "%d", mcp2210_status_password_count (packet));
+	field_bool (rec, p, "password_guessed", mcp2210_status_password_guessed (packet));
+}
+
+static void
+chip_record (struct record *rec, const char *p, mcp2210_packet packet)
+{
+	char name[32];
+	int i;
+
+	for (i = 0; i <= MCP2210_GPIO_PINS; i++) {
+		sprintf (name, "gp%d.function", i);
+		field_str (rec, p, name, "%s", pin_function_name (mcp2210_chip_get_function (packet, i)));
+		sprintf (name, "gp%d.default_output", i);
+		field_num (rec, p, name, "%d", mcp2210_chip_get_default_output (packet, i));
+		sprintf (name, "gp%d.default_direction", i);
+		field_str (rec, p, name, "%s", mcp2210_chip_get_default_direction (packet, i) ? "in" : "out");
+	}
+	field_bool (rec, p, "wakeup", mcp2210_chip_get_wakeup (packet));
+	field_str (rec, p, "gp6_mode", "%s", gp6_mode_name (mcp2210_chip_get_gp6_mode (packet)));
+	field_bool (rec, p, "spi_release", !mcp2210_chip_get_no_spi_release (packet));
+	field_str (rec, p, "access_control", "%s",
+		access_control_name (mcp2210_chip_get_access_control (packet)));
+}
+
+static void
+gpio_record (struct record *rec, const char *p, mcp2210_packet packet)
+{
+	char name[8];
+	int i;
+
+	for (i = 0; i <= MCP2210_GPIO_PINS; i++) {
+		sprintf (name, "gp%d", i);
+		field_num (rec, p, name, "%d", mcp2210_gpio_get_pin (packet, i));
+	}
+}
+
+static void
+spi_record (struct record *rec, const char *p, mcp2210_packet packet)
+{
+	char name[32];
+	int i;
+
+	field_num (rec, p, "bit_rate", "%ld", mcp2210_spi_get_bitrate (packet));
+	for (i = 0; i <= MCP2210_GPIO_PINS; i++) {
+		sprintf (name, "gp%d.active_cs", i);
+		field_num (rec, p, name, "%d", mcp2210_spi_get_pin_active_cs (packet, i));
+		sprintf (name, "gp%d.idle_cs", i);
+		field_num (rec, p, name, "%d", mcp2210_spi_get_pin_idle_cs (packet, i));
+	}
+	field_num (rec, p, "cs_data_delay_us", "%d", mcp2210_spi_get_cs_data_delay_100us (packet) * 100);
+	field_num (rec, p, "data_cs_delay_us", "%d", mcp2210_spi_get_data_cs_delay_100us (packet) * 100);
+	field_num (rec, p, "byte_delay_us", "%d", mcp2210_spi_get_byte_delay_100us (packet) * 100);
+	field_num (rec, p, "transaction_size", "%d", mcp2210_spi_get_transaction_size (packet));
+	field_num (rec, p, "mode", "%d", mcp2210_spi_get_mode (packet));
+}
+
+static void
+usb_key_record (struct record *rec, const char *p, mcp2210_packet packet)
+{
+	field_num (rec, p, "vendor_id", "%d", mcp2210_usb_key_get_vid (packet));
+	field_num (rec, p, "product_id", "%d", mcp2210_usb_key_get_pid (packet));
+	field_bool (rec, p, "host_powered", mcp2210_usb_key_get_host_powered (packet));
+	field_bool (rec, p, "self_powered", mcp2210_usb_key_get_self_powered (packet));
+	field_bool (rec, p, "remote_wakeup", mcp2210_usb_key_get_remote_wakeup (packet));
+	field_num (rec, p, "current_ma", "%d", mcp2210_usb_key_get_current_2ma (packet) * 2);
+}
+
+/* Convert the UTF-16LE string descriptor to UTF-8. */
+
+static void
+usb_string_record (struct record *rec, const char *p, const char *name, mcp2210_packet packet)
+{
+	const unsigned char *string = (unsigned char *)mcp2210_usb_string_get (packet);
+	char buf[MCP2210_USB_STRING * 2 + 1];
+	char *q = buf;
+	unsigned int c;
+	int i;
+
+	for (i = 0; i + 1 < mcp2210_usb_string_get_len (packet) && i + 1 < MCP2210_USB_STRING; i += 2) {
+		c = string[i] | string[i + 1] << 8;
+		if (c < 0x80) {
+			*q++ = c;
+		} else if (c < 0x800) {
+			*q++ = 0xc0 | c >> 6;
+			*q++ = 0x80 | (c & 0x3f);
+		} else {
+			*q++ = 0xe0 | c >> 12;
+			*q++ = 0x80 | ((c >> 6) & 0x3f);
+			*q++ = 0x80 | (c & 0x3f);
+		}
+	}
+	*q = '\0';
+
+	field_str (rec, p, name, "%s", buf);
+}
+
+static void
+eeprom_record (struct record *rec, const char *p, const unsigned char *data)
+{
+	char buf[MCP2210_EEPROM_SIZE * 2 + 1];
+	int i;
+
+	for (i = 0; i < MCP2210_EEPROM_SIZE; i++)
+		sprintf (&buf[i * 2], "%02x", data[i]);
+	field_str (rec, p, "eeprom", "%s", buf);
+}
+
+/* Decode the collected sections of the state. */
+
+static void
+state_record (struct record *rec, struct mcp2210_state *state, unsigned int sections)
+{
+	unsigned char (*packets)[MCP2210_PACKET_SIZE] = state->packets;
+
+	if (sections & (1 << MCP2210_STATE_STATUS) && packets[MCP2210_STATE_STATUS][0])
+		status_record (rec, "status.", packets[MCP2210_STATE_STATUS]);
+	if (sections & (1 << MCP2210_STATE_SPI) && packets[MCP2210_STATE_SPI][0])
+		spi_record (rec, "spi.", packets[MCP2210_STATE_SPI]);
+	if (sections & (1 << MCP2210_STATE_GPIO_VAL) && packets[MCP2210_STATE_GPIO_VAL][0])
+		gpio_record (rec, "gpio.value.", packets[MCP2210_STATE_GPIO_VAL]);
+	if (sections & (1 << MCP2210_STATE_GPIO_DIR) && packets[MCP2210_STATE_GPIO_DIR][0])
+		gpio_record (rec, "gpio.direction.", packets[MCP2210_STATE_GPIO_DIR]);
+	if (sections & (1 << MCP2210_STATE_CHIP) && packets[MCP2210_STATE_CHIP][0])
+		chip_record (rec, "chip.", packets[MCP2210_STATE_CHIP]);
+	if (sections & (1 << MCP2210_STATE_NVRAM_SPI) && packets[MCP2210_STATE_NVRAM_SPI][0])
+		spi_record (rec, "nvram.spi.", packets[MCP2210_STATE_NVRAM_SPI]);
+	if (sections & (1 << MCP2210_STATE_NVRAM_CHIP) && packets[MCP2210_STATE_NVRAM_CHIP][0])
+		chip_record (rec, "nvram.chip.", packets[MCP2210_STATE_NVRAM_CHIP]);
+	if (sections & (1 << MCP2210_STATE_NVRAM_USB_KEY) && packets[MCP2210_STATE_NVRAM_USB_KEY][0])
+		usb_key_record (rec, "nvram.usb.", packets[MCP2210_STATE_NVRAM_USB_KEY]);
+	if (sections & (1 << MCP2210_STATE_NVRAM_PRODUCT) && packets[MCP2210_STATE_NVRAM_PRODUCT][0])
+		usb_string_record (rec, "nvram.usb.", "product", packets[MCP2210_STATE_NVRAM_PRODUCT]);
+	if (sections & (1 << MCP2210_STATE_NVRAM_MANUFACT) && packets[MCP2210_STATE_NVRAM_MANUFACT][0])
+		usb_string_record (rec, "nvram.usb.", "manufacturer", packets[MCP2210_STATE_NVRAM_MANUFACT]);
+	if (sections & (1 << MCP2210_STATE_EEPROM) && state->has_eeprom)
+		eeprom_record (rec, "", state->eeprom);
+}
+
+static void
+json_string (FILE *f, const char *s)
+{
+	fputc ('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf (f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf (f, "\\u%04x", *s);
+		else
+			fputc (*s, f);
+	}
+	fputc ('"', f);
+}
+
+static void
+csv_string (FILE *f, const char *s)
+{
+	if (!strpbrk (s, ",\"\r\n")) {
+		fputs (s, f);
+		return;
+	}
+
+	fputc ('"', f);
+	for (; *s; s++) {
+		if (*s == '"')
+			fputc ('"', f);
+		fputc (*s, f);
+	}
+	fputc ('"', f);
 }
 
+/*
+ * Print the collected sections as a single record, built in memory and
+ * written out at once. With --changed-since only the fields that differ
+ * from the saved state are included and the saved state is updated.
+ */
+
 void
-dump_all (int fd)
+print_record (const char *device)
 {
-	dump_runtime (fd);
-	putchar ('\n');
-	dump_nvram (fd);
-	putchar ('\n');
-	dump_eeprom (fd);
+	struct mcp2210_state cur, old;
+	struct record rec = { NULL, 0 }, old_rec = { NULL, 0 };
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+	int i, j;
+
+	cur = record_state;
+	memcpy (cur.magic, MCP2210_STATE_MAGIC, sizeof (cur.magic));
+	cur.version = MCP2210_STATE_VERSION;
+
+	state_record (&rec, &cur, record_sections);
+
+	if (changed_since && access (changed_since, F_OK) == 0) {
+		read_state (changed_since, &old);
+		state_record (&old_rec, &old, record_sections);
+
+		/* Keep the sections we didn't look at this time. */
+		for (i = 0; i < MCP2210_STATE_PACKETS; i++) {
+			if (!cur.packets[i][0])
+				memcpy (cur.packets[i], old.packets[i], MCP2210_PACKET_SIZE);
+		}
+		if (!cur.has_eeprom && old.has_eeprom) {
+			memcpy (cur.eeprom, old.eeprom, MCP2210_EEPROM_SIZE);
+			cur.has_eeprom = 1;
+		}
+	}
+
+	f = open_memstream (&buf, &len);
+	if (output_format == FORMAT_JSON) {
+		fputs ("{\"device\":", f);
+		json_string (f, device);
+	} else {
+		fputs ("device", f);
+	}
+
+	for (i = 0; i < rec.count; i++) {
+		for (j = 0; j < old_rec.count; j++) {
+			if (strcmp (rec.fields[i].name, old_rec.fields[j].name) == 0)
+				break;
+		}
+		if (j < old_rec.count && strcmp (rec.fields[i].value, old_rec.fields[j].value) == 0) {
+			rec.fields[i].name[0] = '\0';
+			continue;
+		}
+
+		if (output_format == FORMAT_JSON) {
+			fputc (',', f);
+			json_string (f, rec.fields[i].name);
+			fputc (':', f);
+			if (rec.fields[i].string)
+				json_string (f, rec.fields[i].value);
+			else
+				fputs (rec.fields[i].value, f);
+		} else {
+			fputc (',', f);
+			fputs (rec.fields[i].name, f);
+		}
+	}
+
+	if (output_format == FORMAT_JSON) {
+		fputs ("}\n", f);
+	} else {
+		fputc ('\n', f);
+		csv_string (f, device);
+		for (i = 0; i < rec.count; i++) {
+			if (!rec.fields[i].name[0])
+				continue;
+			fputc (',', f);
+			csv_string (f, rec.fields[i].value);
+		}
+		fputc ('\n', f);
+	}
+	fclose (f);
+
+	fwrite (buf, len, 1, stdout);
+	free (buf);
+	record_free (&rec);
+	record_free (&old_rec);
+
+	if (changed_since) {
+		f = fopen (changed_since, "w");
+		if (f == NULL || fwrite (&cur, sizeof (cur), 1, f) != 1 || fclose (f) != 0) {
+			perror (changed_since);
+			exit (1);
+		}
+	}
 }
 
 /*********************************************************************/
@@ -513,12 +1394,83 @@ get_current (int argc, char *argv[], int i)
 	return current / 2;
 }
 
+const char *
+get_file_name (int argc, char *argv[], int i)
+{
+	if (i + 1 >= argc) {
+		fprintf (stderr, "Missing file name argument to '%s'\n", argv[i]);
+		exit (1);
+	}
+
+	return argv[i + 1];
+}
+
+/* Read in a whole file, "-" meaning standard input. */
+
+char *
+read_file (const char *path, size_t *len)
+{
+	FILE *f = stdin;
+	char *buf = NULL;
+	size_t size = 0;
+	size_t n;
+
+	if (strcmp (path, "-") != 0)
+		f = fopen (path, "r");
+	if (f == NULL) {
+		perror (path);
+		exit (1);
+	}
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 65536;
+			buf = realloc (buf, size);
+			if (buf == NULL) {
+				perror (path);
+				exit (1);
+			}
+		}
+		n = fread (&buf[*len], 1, size - *len, f);
+		*len += n;
+	} while (n);
+
+	if (ferror (f)) {
+		perror (path);
+		exit (1);
+	}
+	if (f != stdin)
+		fclose (f);
+
+	return buf;
+}
+
+unsigned short
+get_eeprom_addr (int argc, char *argv[], int i)
+{
+	long long addr;
+
+	addr = get_num (argc, argv, i);
+	if (addr < 0 || addr > 0xff) {
+		fprintf (stderr, "EEPROM address out of range (0 - 255): '%lld'\n", addr);
+		exit (1);
+	}
+
+	return addr;
+}
+
 unsigned short
 get_usb_string (int argc, char *argv[], int i, char string[])
 {
 	char *p;
 	short c = 0;
 
+	if (i + 1 >= argc) {
+		fprintf (stderr, "Missing string argument to '%s'\n", argv[i]);
+		exit (1);
+	}
+
 	for (p = argv[i + 1]; *p; p++) {
 		if (c >= MCP2210_USB_STRING) {
 			fprintf (stderr, "Parameter to '%s' too long.\n", argv[i]);
@@ -557,6 +1509,11 @@ get_string (int argc, char *argv[], int i, char string[], int len)
 	char *p;
 	int c = 0;
 
+	if (i + 1 >= argc) {
+		fprintf (stderr, "Missing string argument to '%s'\n", argv[i]);
+		exit (1);
+	}
+
 	for (p = argv[i + 1]; *p; p++) {
 		if (c >= len) {
 			fprintf (stderr, "Parameter to '%s' too long.\n", argv[i]);
@@ -590,27 +1547,19 @@ get_string (int argc, char *argv[], int i, char string[], int len)
 	return c;
 }
 
+int load_profile (int fd, const char *path);
+
+/*
+ * Walk the options, starting at index i. Settings are collected in the
+ * global packets and written out by main() once all options are processed.
+ */
+
 int
-main (int argc, char *argv[])
+process_options (int fd, int argc, char *argv[], int i)
 {
-	int fd;
-	int i;
-	unsigned short runtime = 1;
-	unsigned short nvram = 0;
 	int ret;
 
-	if (argc < 3) {
-		fprintf (stderr, "Usage: %s /dev/hidraw<n> option [option ...]\n", argv[0]);
-		return 1;
-	}
-
-	fd = open (argv[1], O_RDWR);
-	if (fd == -1) {
-		perror (argv[1]);
-		return 1;
-	}
-
-	for (i = 2; i < argc; i++) {
+	for (; i < argc; i++) {
 		if (strcmp (argv[i], "--runtime") == 0) {
 			runtime = 1;
 			nvram = 0;
@@ -635,18 +1584,46 @@ main (int argc, char *argv[])
 			if (runtime)
 				dump_runtime_spi (fd);
 			if (runtime && nvram)
-				putchar ('\n');
+				separator ();
 			if (nvram)
 				dump_nvram_spi (fd);
 		} else if (strcmp (argv[i], "--dump-chip") == 0) {
 			if (runtime)
 				dump_runtime_chip (fd);
 			if (runtime && nvram)
-				putchar ('\n');
+				separator ();
 			if (nvram)
 				dump_nvram_chip (fd);
 		} else if (strcmp (argv[i], "--dump-eeprom") == 0) {
 			dump_eeprom (fd);
+		} else if (strcmp (argv[i], "--format") == 0) {
+			if (i + 1 < argc && strcmp (argv[i + 1], "text") == 0) {
+				output_format = FORMAT_TEXT;
+			} else if (i + 1 < argc && strcmp (argv[i + 1], "json") == 0) {
+				output_format = FORMAT_JSON;
+			} else if (i + 1 < argc && strcmp (argv[i + 1], "csv") == 0) {
+				output_format = FORMAT_CSV;
+			} else {
+				fprintf (stderr, "Unknown format for '%s' (text, json or csv)\n", argv[i]);
+				return 1;
+			}
+			i++;
+		} else if (strcmp (argv[i], "--hex-format") == 0) {
+			if (i + 1 < argc && strcmp (argv[i + 1], "default") == 0) {
+				hex_format = HEX_DEFAULT;
+			} else if (i + 1 < argc && strcmp (argv[i + 1], "canonical") == 0) {
+				hex_format = HEX_CANONICAL;
+			} else if (i + 1 < argc && strcmp (argv[i + 1], "plain") == 0) {
+				hex_format = HEX_PLAIN;
+			} else if (i + 1 < argc && strcmp (argv[i + 1], "c") == 0) {
+				hex_format = HEX_C;
+			} else {
+				fprintf (stderr, "Unknown format for '%s' (default, canonical, plain or c)\n", argv[i]);
+				return 1;
+			}
+			i++;
+		} else if (strcmp (argv[i], "--changed-since") == 0) {
+			changed_since = get_file_name (argc, argv, i++);
 		} else if (strcmp (argv[i], "--on") == 0) {
 			short pin = get_pin (argc, argv, i++);
 
@@ -809,7 +1786,7 @@ main (int argc, char *argv[])
 				mcp2210_chip_set_gp6_mode (chip_packet, MCP2210_CHIP_GP6_CNT_HI_PULSE);
 			}
 			if (nvram) {
-				maybe_get (fd, chip_packet, MCP2210_CHIP_GET);
+				maybe_get_nvram (fd, nvram_chip_packet, MCP2210_NVRAM_PARAM_CHIP);
 				nvram_chip_mod = 1;
 				mcp2210_chip_set_gp6_mode (nvram_chip_packet, MCP2210_CHIP_GP6_CNT_HI_PULSE);
 			}
@@ -1167,6 +2144,54 @@ main (int argc, char *argv[])
 				fprintf (stderr, "Error unlocking device: %s\n", mcp2210_strerror (ret));
 				return 1;
 			}
+		} else if (strcmp (argv[i], "--eeprom-write") == 0) {
+			char string[MCP2210_EEPROM_SIZE];
+			unsigned short addr = get_eeprom_addr (argc, argv, i++);
+			int len = get_string (argc, argv, i++, string, sizeof (string) - addr);
+
+			ret = write_eeprom (fd, addr, string, len);
+			if (ret < 0) {
+				fprintf (stderr, "Error writing EEPROM: %s\n", mcp2210_strerror (ret));
+				return 1;
+			}
+		} else if (strcmp (argv[i], "--profile") == 0) {
+			ret = load_profile (fd, get_file_name (argc, argv, i++));
+			if (ret)
+				return ret;
+		} else if (strcmp (argv[i], "--trace") == 0) {
+			const char *path = get_file_name (argc, argv, i++);
+
+			if (mcp2210_trace_open (path, TRACE_RECORDS) == -1) {
+				perror (path);
+				return 1;
+			}
+		} else if (strcmp (argv[i], "--save-state") == 0) {
+			save_state (fd, get_file_name (argc, argv, i++));
+		} else if (strcmp (argv[i], "--restore-state") == 0) {
+			restore_state (fd, get_file_name (argc, argv, i++));
+		} else if (strcmp (argv[i], "--diff-state") == 0) {
+			diff_state (fd, get_file_name (argc, argv, i++));
+		} else if (strcmp (argv[i], "--spi-autotune") == 0) {
+			spi_autotune (fd, NULL, NULL, 0);
+		} else if (strcmp (argv[i], "--spi-autotune-expect") == 0) {
+			char *expect = malloc (MCP2210_SPI_TX_MAX);
+			char *tx = malloc (MCP2210_SPI_TX_MAX);
+			unsigned short tx_len, expect_len;
+
+			if (tx == NULL || expect == NULL) {
+				perror ("malloc");
+				return 1;
+			}
+			tx_len = get_string (argc, argv, i++, tx, MCP2210_SPI_TX_MAX);
+			expect_len = get_string (argc, argv, i++, expect, MCP2210_SPI_TX_MAX);
+			if (!tx_len || tx_len != expect_len) {
+				fprintf (stderr, "The data and the response for '%s' must be of the same non-zero length\n",
+					argv[i - 2]);
+				return 1;
+			}
+			spi_autotune (fd, tx, expect, tx_len);
+			free (tx);
+			free (expect);
 		} else if (strcmp (argv[i], "--spi-tx") == 0) {
 			spi_tx_len = get_string (argc, argv, i++, spi_tx, sizeof (spi_tx));
 			if (!spi_tx_len) {
@@ -1177,6 +2202,85 @@ main (int argc, char *argv[])
 			maybe_get (fd, spi_packet, MCP2210_SPI_GET);
 			spi_mod = 1;
 			mcp2210_spi_set_transaction_size (spi_packet, spi_tx_len);
+		} else if (strcmp (argv[i], "--spi-tx-file") == 0) {
+			free (spi_tx_file);
+			spi_tx_file = read_file (get_file_name (argc, argv, i++), &spi_tx_file_len);
+			if (!spi_tx_file_len) {
+				fprintf (stderr, "Empty SPI transfer not allowed\n");
+				return 1;
+			}
+
+			maybe_get (fd, spi_packet, MCP2210_SPI_GET);
+		} else if (strcmp (argv[i], "--spi-tx-stream") == 0) {
+			const char *path = get_file_name (argc, argv, i++);
+
+			if (spi_tx_stream > 0)
+				close (spi_tx_stream);
+			spi_tx_stream = strcmp (path, "-") ? open (path, O_RDONLY) : 0;
+			if (spi_tx_stream == -1) {
+				perror (path);
+				return 1;
+			}
+
+			maybe_get (fd, spi_packet, MCP2210_SPI_GET);
+		} else if (strcmp (argv[i], "--spi-verify") == 0) {
+			free (spi_verify);
+			spi_verify = read_file (get_file_name (argc, argv, i++), &spi_verify_len);
+		} else if (strcmp (argv[i], "--bus-wait") == 0) {
+			bus_wait_ms = get_num (argc, argv, i++);
+		} else if (strcmp (argv[i], "--bus-release") == 0) {
+			bus_release = get_num (argc, argv, i++);
+			if (bus_release != 0 && bus_release != 1) {
+				fprintf (stderr, "The acknowledge value for '%s' must be 0 or 1\n", argv[i - 1]);
+				return 1;
+			}
+		} else if (strcmp (argv[i], "--shm-publish") == 0) {
+			shm_path = get_file_name (argc, argv, i++);
+			shm_interval_ms = get_num (argc, argv, i++);
+			if (shm_interval_ms <= 0) {
+				fprintf (stderr, "The interval for '%s' must be positive\n", argv[i - 2]);
+				return 1;
+			}
+		} else if (strcmp (argv[i], "--capture") == 0) {
+			capture_path = get_file_name (argc, argv, i++);
+		} else if (strcmp (argv[i], "--cache") == 0) {
+			cache_dir = get_file_name (argc, argv, i++);
+			if (cache == NULL)
+				cache = mcp2210_cache_open (fd, cache_dir);
+			if (cache == NULL)
+				fprintf (stderr, "%s: Not using the cache: %s\n", cache_dir, strerror (errno));
+		} else if (strcmp (argv[i], "--rt-cpu") == 0) {
+			const char *list;
+			char *end;
+			long cpu, last;
+
+			if (i + 1 >= argc) {
+				fprintf (stderr, "Missing CPU list argument to '%s'\n", argv[i]);
+				return 1;
+			}
+			list = argv[++i];
+			rt_ncpus = 0;
+			do {
+				cpu = last = strtol (list, &end, 10);
+				if (end != list && *end == '-')
+					last = strtol (list = end + 1, &end, 10);
+				if (end == list || (*end && *end != ',') || cpu < 0 || last < cpu) {
+					fprintf (stderr, "Bad CPU list for '%s'\n", argv[i - 1]);
+					return 1;
+				}
+				for (; cpu <= last; cpu++) {
+					if (rt_ncpus == sizeof (rt_cpus) / sizeof (rt_cpus[0])) {
+						fprintf (stderr, "Too many CPUs for '%s'\n", argv[i - 1]);
+						return 1;
+					}
+					rt_cpus[rt_ncpus++] = cpu;
+				}
+				list = end + 1;
+			} while (*end);
+		} else if (strcmp (argv[i], "--rt-priority") == 0) {
+			rt_priority = get_num (argc, argv, i++);
+		} else if (strcmp (argv[i], "--rt-lock") == 0) {
+			rt_lock = 1;
 		} else if (strcmp (argv[i], "--spi-cancel") == 0) {
 			mcp2210_packet packet = { 0, };
 
@@ -1191,6 +2295,230 @@ main (int argc, char *argv[])
 		}
 	}
 
+	return 0;
+}
+
+/*
+ * Publish the device state until interrupted.
+ */
+
+static int
+publish_state (int fd)
+{
+	struct mcp2210_shm *shm;
+	struct timespec deadline;
+	int ret = 0;
+
+	shm = mcp2210_shm_create (shm_path);
+	if (shm == NULL) {
+		perror (shm_path);
+		exit (1);
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &deadline);
+	while (!mcp2210_cancel_requested (&cancel)) {
+		/*
+		 * The sections that failed on the device are published anyway,
+		 * a device that stopped responding ends the polling.
+		 */
+		ret = mcp2210_shm_poll (fd, shm, (1 << MCP2210_SHM_SECTIONS) - 1);
+		if (ret == -1 || ret == -MCP2210_EWRSHORT || ret == -MCP2210_ERDSHORT)
+			break;
+		ret = 0;
+		mcp2210_rt_deadline (&deadline, shm_interval_ms * 1000000ULL);
+		mcp2210_rt_sleep_until (&deadline);
+	}
+	mcp2210_shm_close (shm);
+
+	return ret;
+}
+
+static void
+cancel_handler (int sig)
+{
+	mcp2210_cancel_request (&cancel);
+}
+
+/*
+ * Add the data received to the capture, tagged with the chip selects that
+ * were asserted and the job, 0 for --spi-tx and 1 for --spi-tx-file.
+ */
+
+static void
+capture_spi (unsigned short job, const char *data, size_t len)
+{
+	struct mcp2210_capture_record rec = { 0, };
+	struct timespec ts;
+	unsigned short pin;
+	size_t n;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	rec.time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec.type = MCP2210_CAPTURE_SPI;
+	rec.job = job;
+	for (pin = 0; pin < 9; pin++) {
+		if (mcp2210_spi_get_pin_active_cs (spi_packet, pin)
+		    != mcp2210_spi_get_pin_idle_cs (spi_packet, pin))
+			rec.cs |= 1 << pin;
+	}
+
+	/* A record is a transaction at most. */
+	while (len) {
+		n = len < MCP2210_SPI_TX_MAX ? len : MCP2210_SPI_TX_MAX;
+		rec.len = n;
+		if (mcp2210_capture_write (capture, &rec, data) == -1) {
+			perror (capture_path);
+			exit (1);
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * The SPI transfers, run through the bus arbitration queue.
+ */
+
+static int
+spi_tx_job (int fd, void *data)
+{
+	int ret;
+
+	ret = mcp2210_spi_transfer_verify (fd, spi_packet, spi_tx, spi_tx_len,
+		spi_verify, spi_verify ? &spi_crc : NULL);
+	if (ret == 0 && capture)
+		capture_spi (0, spi_tx, spi_tx_len);
+	return ret;
+}
+
+static int
+spi_tx_file_job (int fd, void *data)
+{
+	int ret;
+
+	/* Follows the --spi-tx response, if any. */
+	ret = mcp2210_spi_transfer_large_verify (fd, chip_packet, spi_packet,
+		spi_tx_file, spi_tx_file_len, spi_verify ? &spi_verify[spi_tx_len] : NULL,
+		spi_verify ? &spi_crc : NULL);
+	if (ret == 0 && capture)
+		capture_spi (1, spi_tx_file, spi_tx_file_len);
+	return ret;
+}
+
+static int
+spi_tx_stream_job (int fd, void *data)
+{
+	return mcp2210_spi_transfer_stream (fd, chip_packet, spi_packet, spi_tx_stream, -1);
+}
+
+/*
+ * Read options from a file, as if they were given on the command line
+ * at the point of --profile. The words are separated by white space, can
+ * be enclosed in double quotes and '#' starts a comment.
+ */
+
+int
+load_profile (int fd, const char *path)
+{
+	FILE *f;
+	char *buf = NULL;
+	char **words = NULL;
+	int nwords = 1;
+	size_t len = 0;
+	char *p, *q;
+	int ret;
+
+	f = fopen (path, "r");
+	if (f == NULL) {
+		perror (path);
+		return 1;
+	}
+	if (getdelim (&buf, &len, '\0', f) == -1 && ferror (f)) {
+		perror (path);
+		fclose (f);
+		return 1;
+	}
+	fclose (f);
+	if (buf == NULL)
+		return 0;
+
+	words = malloc (sizeof (*words));
+	words[0] = (char *)path;
+	for (p = q = buf; *p; ) {
+		if (*p == '#') {
+			while (*p && *p != '\n')
+				p++;
+			continue;
+		}
+		if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+			p++;
+			continue;
+		}
+
+		words = realloc (words, (nwords + 1) * sizeof (*words));
+		words[nwords++] = q;
+		if (*p == '"') {
+			for (p++; *p && *p != '"'; p++) {
+				if (*p == '\\' && p[1])
+					*q++ = *p++;
+				*q++ = *p;
+			}
+			if (*p == '"')
+				p++;
+		} else {
+			while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+				*q++ = *p++;
+		}
+		/* The terminating '\0' may go where the separator was. */
+		if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+			p++;
+		*q++ = '\0';
+	}
+
+	ret = process_options (fd, nwords, words, 1);
+
+	free (words);
+	free (buf);
+	return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+	struct sigaction sa = { 0, };
+	struct mcp2210_rt_stats rt_stats;
+	struct mcp2210_bus bus;
+	mcp2210_packet chip_set;
+	int fd;
+	int ret;
+
+	if (argc < 3) {
+		fprintf (stderr, "Usage: %s /dev/hidraw<n>|unix:<path>|tcp:<host>:<port>|usb:[<vid>:<pid>] option [option ...]\n", argv[0]);
+		return 1;
+	}
+
+	fd = mcp2210_open (argv[1]);
+	if (fd == -1) {
+		perror (argv[1]);
+		return 1;
+	}
+
+	/* Let the interrupted transfers leave the device in a usable state. */
+	if (mcp2210_set_cancel (fd, &cancel) == -1) {
+		perror ("mcp2210_set_cancel");
+		return 1;
+	}
+	sa.sa_handler = cancel_handler;
+	sa.sa_flags = SA_RESTART | SA_RESETHAND;
+	sigaction (SIGINT, &sa, NULL);
+
+	ret = process_options (fd, argc, argv, 2);
+	if (ret)
+		return ret;
+
+	if (record_sections)
+		print_record (argv[1]);
+
 	if (gpio_val_mod) {
 		ret = mcp2210_command (fd, gpio_val_packet, MCP2210_GPIO_VAL_SET);
 		if (ret < 0)
@@ -1204,13 +2532,16 @@ main (int argc, char *argv[])
 	}
 
 	if (chip_mod) {
+		memcpy (chip_set, chip_packet, MCP2210_PACKET_SIZE);
 		ret = mcp2210_command (fd, chip_packet, MCP2210_CHIP_SET);
 		if (ret < 0)
 			goto err;
+		if (cache)
+			mcp2210_cache_put (cache, MCP2210_STATE_CHIP, chip_set);
 	}
 
 	if (nvram_chip_mod) {
-		ret = mcp2210_set_nvram (fd, nvram_chip_packet, MCP2210_NVRAM_PARAM_CHIP);
+		ret = write_nvram (fd, nvram_chip_packet, MCP2210_NVRAM_PARAM_CHIP);
 		if (ret < 0)
 			goto err;
 	}
@@ -1222,43 +2553,134 @@ main (int argc, char *argv[])
 	}
 
 	if (nvram_spi_mod) {
-		ret = mcp2210_set_nvram (fd, nvram_spi_packet, MCP2210_NVRAM_PARAM_SPI);
+		ret = write_nvram (fd, nvram_spi_packet, MCP2210_NVRAM_PARAM_SPI);
 		if (ret < 0)
 			goto err;
 	}
 
 	if (nvram_usb_key_mod) {
-		mcp2210_packet set = { 0, };
-		mcp2210_usb_key_get_to_set (nvram_usb_key_packet, set);
-		ret = mcp2210_set_nvram (fd, set, MCP2210_NVRAM_PARAM_USB_KEY);
+		ret = write_nvram (fd, nvram_usb_key_packet, MCP2210_NVRAM_PARAM_USB_KEY);
 		if (ret < 0)
 			goto err;
 	}
 
 	if (nvram_manufact_mod) {
-		ret = mcp2210_set_nvram (fd, nvram_manufact_packet, MCP2210_NVRAM_PARAM_MANUFACT);
+		ret = write_nvram (fd, nvram_manufact_packet, MCP2210_NVRAM_PARAM_MANUFACT);
 		if (ret < 0)
 			goto err;
 	}
 
 	if (nvram_product_mod) {
-		ret = mcp2210_set_nvram (fd, nvram_product_packet, MCP2210_NVRAM_PARAM_PRODUCT);
+		ret = write_nvram (fd, nvram_product_packet, MCP2210_NVRAM_PARAM_PRODUCT);
+		if (ret < 0)
+			goto err;
+	}
+
+	if (spi_tx_file_len || spi_tx_stream != -1) {
+		/* The CHIP_SET response doesn't carry the settings. */
+		if (cache)
+			ret = mcp2210_cache_get (cache, MCP2210_STATE_CHIP, chip_packet);
+		else
+			ret = mcp2210_get_command (fd, chip_packet, MCP2210_CHIP_GET);
 		if (ret < 0)
 			goto err;
 	}
 
-	if (spi_tx_len) {
-		ret = mcp2210_spi_transfer (fd, spi_packet, spi_tx, spi_tx_len);
-		if (ret < 0) {
-			fprintf (stderr, "SPI transaction error: %s\n", mcp2210_strerror (ret));
+	if (spi_verify && spi_tx_len + spi_tx_file_len != spi_verify_len) {
+		fprintf (stderr, "The expected response is %zu bytes long, the transfer %zu bytes\n",
+			spi_verify_len, spi_tx_len + spi_tx_file_len);
+		return 1;
+	}
+
+	if ((rt_ncpus || rt_priority || rt_lock)
+	    && mcp2210_rt_setup (rt_cpus, rt_ncpus, rt_priority, rt_lock) == -1) {
+		perror ("mcp2210_rt_setup");
+		return 1;
+	}
+	mcp2210_rt_get_stats (&rt_stats, 1);
+
+	if (capture_path) {
+		capture = mcp2210_capture_create (capture_path, MCP2210_CAPTURE_COMPRESS, 0);
+		if (capture == NULL) {
+			perror (capture_path);
 			return 1;
 		}
-		hex_dump (spi_tx, spi_tx_len);
+	}
+
+	mcp2210_bus_init (&bus, bus_wait_ms, bus_release);
+	if (spi_tx_len && mcp2210_bus_queue (&bus, spi_tx_job, NULL) == -1) {
+		perror ("mcp2210_bus_queue");
+		return 1;
+	}
+	if (spi_tx_file_len && mcp2210_bus_queue (&bus, spi_tx_file_job, NULL) == -1) {
+		perror ("mcp2210_bus_queue");
+		return 1;
+	}
+	if (spi_tx_stream != -1 && mcp2210_bus_queue (&bus, spi_tx_stream_job, NULL) == -1) {
+		perror ("mcp2210_bus_queue");
+		return 1;
+	}
+
+	ret = mcp2210_bus_run (&bus, fd);
+	if (capture && mcp2210_capture_close (capture) == -1) {
+		perror (capture_path);
+		return 1;
+	}
+	if (bus.waits) {
+		fprintf (stderr, "Waited for the SPI bus %u times, %.3f s in total, %.3f s at most\n",
+			bus.waits, bus.wait_ns / 1e9, bus.max_wait_ns / 1e9);
+	}
+	mcp2210_rt_get_stats (&rt_stats, 0);
+	if ((rt_ncpus || rt_priority || rt_lock) && rt_stats.wakeups) {
+		fprintf (stderr, "Woke up %llu times, %.1f us late on average, %.1f us at most\n",
+			rt_stats.wakeups, rt_stats.total_ns / 1e3 / rt_stats.wakeups,
+			rt_stats.max_ns / 1e3);
+	}
+	if (ret < 0) {
+		fprintf (stderr, "SPI transaction error: %s\n", mcp2210_strerror (ret));
+		return 1;
+	}
+
+	if (spi_verify) {
+		printf ("Verified %zu bytes, CRC-32C 0x%08x\n", spi_verify_len, spi_crc);
+	} else if (!capture_path) {
+		if (spi_tx_len)
+			hex_dump (spi_tx, spi_tx_len);
+		if (spi_tx_file_len)
+			hex_dump (spi_tx_file, spi_tx_file_len);
+	}
+
+	if (shm_path) {
+		ret = publish_state (fd);
+		if (ret < 0)
+			goto err;
+	}
+
+	if (cache && mcp2210_cache_close (cache) == -1) {
+		perror (cache_dir);
+		return 1;
 	}
 
 	return 0;
 
 err:
 	fprintf (stderr, "Error writing to the device: %s\n", mcp2210_strerror (ret));
+	if (cache) {
+		/* Keep what was set, but not what may have been half set. */
+		if (chip_mod)
+			mcp2210_cache_put (cache, MCP2210_STATE_CHIP, NULL);
+		if (nvram_chip_mod)
+			mcp2210_cache_put (cache, MCP2210_STATE_NVRAM_CHIP, NULL);
+		if (nvram_spi_mod)
+			mcp2210_cache_put (cache, MCP2210_STATE_NVRAM_SPI, NULL);
+		if (nvram_usb_key_mod)
+			mcp2210_cache_put (cache, MCP2210_STATE_NVRAM_USB_KEY, NULL);
+		if (nvram_manufact_mod)
+			mcp2210_cache_put (cache, MCP2210_STATE_NVRAM_MANUFACT, NULL);
+		if (nvram_product_mod)
+			mcp2210_cache_put (cache, MCP2210_STATE_NVRAM_PRODUCT, NULL);
+		if (mcp2210_cache_close (cache) == -1)
+			perror (cache_dir);
+	}
 	return 1;
 }
@@ -58,6 +58,10 @@ mcp2210_strerror (int mcp2210_errno)
 		return "Response address mismatch";
 	case MCP2210_EBADTXSTAT:
 		return "Invalid SPI transfer status";
+	case MCP2210_EVERIFY:
+		return "Verification failed";
+	case MCP2210_ECANCELED:
+		return "Cancelled";
 	}
 
 	return "Unknown error";
@@ -74,7 +78,7 @@ mcp2210_command (int fd, mcp2210_packet packet, unsigned short command)
 {
 	packet[0] = command;
 
-	switch (write (fd, packet, MCP2210_PACKET_SIZE)) {
+	switch (mcp2210_write_report (fd, packet)) {
 	case MCP2210_PACKET_SIZE:
 		break;
 	case -1:
@@ -85,7 +89,7 @@ mcp2210_command (int fd, mcp2210_packet packet, unsigned short command)
 
 	memset (packet, 0, MCP2210_PACKET_SIZE);
 
-	switch (read (fd, packet, MCP2210_PACKET_SIZE)) {
+	switch (mcp2210_read_report (fd, packet)) {
 	case MCP2210_PACKET_SIZE:
 		break;
 	case -1:
@@ -193,8 +197,15 @@ mcp2210_gp6_count_get (int fd, mcp2210_packet packet, unsigned short no_reset)
 	return (packet[5] << 8) | packet[4];
 }
 
-int
-mcp2210_spi_transfer (int fd, mcp2210_packet spi_packet, char *data, short len)
+/*
+ * The SPI transfer, optionally checking the data received as it arrives.
+ * The chunks are compared to expect and a CRC-32C of them is accumulated
+ * in crc. A mismatch aborts the transfer right away.
+ */
+
+static int
+spi_transfer (int fd, mcp2210_packet spi_packet, char *data, unsigned short len,
+		const char *expect, unsigned int *crc)
 {
 	int rd = 0, wr = 0;
 	int bit_rate = mcp2210_spi_get_bitrate (spi_packet);
@@ -204,7 +215,7 @@ mcp2210_spi_transfer (int fd, mcp2210_packet spi_packet, char *data, short len)
 		mcp2210_packet packet = { 0, };
 		int wr_len = MCP2210_SPI_CHUNK;
 		int rd_len = MCP2210_SPI_CHUNK;
-		struct timespec delay;
+		struct timespec delay, deadline;
 
 		if (wr + wr_len > len)
 			wr_len = len - wr;
@@ -222,11 +233,25 @@ mcp2210_spi_transfer (int fd, mcp2210_packet spi_packet, char *data, short len)
 		delay.tv_nsec %= 1000000000;
 
 retry:
+		if (mcp2210_cancelled (fd)) {
+			/* Nothing's been sent yet if we're at the start. */
+			if (wr == 0)
+				return -MCP2210_ECANCELED;
+			ret = mcp2210_spi_cancel (fd);
+			return ret < 0 ? ret : -MCP2210_ECANCELED;
+		}
+
 		packet[1] = wr_len;
 		memcpy (&packet[2], &data[wr], wr_len);
-		ret = mcp2210_command (fd, packet, MCP2210_SPI_TRANSFER);
 
-		nanosleep (&delay, NULL);
+		/*
+		 * The chunk is clocked out while the response is on its way
+		 * back, so the delay counts from when it was sent.
+		 */
+		clock_gettime (CLOCK_MONOTONIC, &deadline);
+		ret = mcp2210_command (fd, packet, MCP2210_SPI_TRANSFER);
+		mcp2210_rt_deadline (&deadline, delay.tv_sec * 1000000000ULL + delay.tv_nsec);
+		mcp2210_rt_sleep_until (&deadline);
 
 		if (ret == -MCP2210_ESPIINPROGRESS) {
 			delay.tv_sec = 0;
@@ -247,8 +272,215 @@ retry:
 		}
 
 		memcpy (&data[rd], &packet[4], packet[2]);
+		if (crc)
+			*crc = mcp2210_crc32c (*crc, &data[rd], packet[2]);
+		if (expect && memcmp (&data[rd], &expect[rd], packet[2])) {
+			if (packet[3] != MCP2210_SPI_END) {
+				ret = mcp2210_spi_cancel (fd);
+				if (ret < 0)
+					return ret;
+			}
+			return -MCP2210_EVERIFY;
+		}
 		rd += packet[2];
 	}
 
 	return 0;
 }
+
+int
+mcp2210_spi_transfer (int fd, mcp2210_packet spi_packet, char *data, unsigned short len)
+{
+	return spi_transfer (fd, spi_packet, data, len, NULL, NULL);
+}
+
+/*
+ * Like mcp2210_spi_transfer(), but compare the data received with expect
+ * and update crc with its CRC-32C while the transfer is underway. Either
+ * can be NULL.
+ */
+
+int
+mcp2210_spi_transfer_verify (int fd, mcp2210_packet spi_packet, char *data, unsigned short len,
+		const char *expect, unsigned int *crc)
+{
+	return spi_transfer (fd, spi_packet, data, len, expect, crc);
+}
+
+/*
+ * Abort the SPI transfer in progress. Responses to commands issued earlier
+ * that were not read, for example because a read was interrupted, are
+ * discarded until the response to the cancel arrives, so that the device
+ * can be used right away.
+ */
+
+#define CANCEL_DRAIN_MAX	16
+
+int
+mcp2210_spi_cancel (int fd)
+{
+	mcp2210_packet packet = { 0, };
+	int n;
+
+	packet[0] = MCP2210_SPI_CANCEL;
+	switch (mcp2210_write_report (fd, packet)) {
+	case MCP2210_PACKET_SIZE:
+		break;
+	case -1:
+		return -1;
+	default:
+		return -MCP2210_EWRSHORT;
+	}
+
+	for (n = 0; n < CANCEL_DRAIN_MAX; n++) {
+		switch (mcp2210_read_report (fd, packet)) {
+		case MCP2210_PACKET_SIZE:
+			break;
+		case -1:
+			return -1;
+		default:
+			return -MCP2210_ERDSHORT;
+		}
+
+		if (packet[0] == MCP2210_SPI_CANCEL)
+			return packet[1] ? -packet[1] : 0;
+	}
+
+	return -MCP2210_EBADCMD;
+}
+
+/*
+ * Keep the chip select asserted across multiple SPI transactions. The
+ * device deasserts the CS pins at the end of each transaction, therefore
+ * the pins are turned into GPIO outputs driven at their active level for
+ * the time being. The bus is not released between the transactions either.
+ * The chip_packet and spi_packet are the runtime settings; releasing the
+ * hold puts the chip_packet settings back.
+ */
+
+int
+mcp2210_spi_cs_hold (int fd, mcp2210_packet chip_packet, mcp2210_packet spi_packet, int hold)
+{
+	mcp2210_packet packet;
+	int pin;
+
+	memcpy (packet, chip_packet, MCP2210_PACKET_SIZE);
+	if (!hold)
+		return mcp2210_command (fd, packet, MCP2210_CHIP_SET);
+
+	for (pin = 0; pin <= MCP2210_GPIO_PINS; pin++) {
+		if (mcp2210_chip_get_function (chip_packet, pin) != MCP2210_CHIP_PIN_CS)
+			continue;
+		mcp2210_chip_set_function (packet, pin, MCP2210_CHIP_PIN_GPIO);
+		mcp2210_chip_set_default_output (packet, pin,
+			mcp2210_spi_get_pin_active_cs (spi_packet, pin));
+		mcp2210_chip_set_default_direction (packet, pin, 0);
+	}
+	mcp2210_chip_set_no_spi_release (packet, 1);
+
+	return mcp2210_command (fd, packet, MCP2210_CHIP_SET);
+}
+
+/*
+ * Transfer data of arbitrary length as a single transfer from the slave's
+ * point of view. Anything that doesn't fit into a single MCP2210 transaction
+ * is split into transactions of maximum size while the CS is held asserted.
+ * The transaction size in spi_packet is updated as needed.
+ */
+
+static int
+spi_transfer_large (int fd, mcp2210_packet chip_packet, mcp2210_packet spi_packet,
+		char *data, size_t len, const char *expect, unsigned int *crc)
+{
+	mcp2210_packet packet;
+	size_t off, n;
+	int hold = len > MCP2210_SPI_TX_MAX;
+	int ret = 0, ret2;
+
+	if (hold) {
+		ret = mcp2210_spi_cs_hold (fd, chip_packet, spi_packet, 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	for (off = 0; off < len; off += n) {
+		n = len - off;
+		if (n > MCP2210_SPI_TX_MAX)
+			n = MCP2210_SPI_TX_MAX;
+
+		/* Only the first and the last transaction need a change. */
+		if (mcp2210_spi_get_transaction_size (spi_packet) != n) {
+			mcp2210_spi_set_transaction_size (spi_packet, n);
+			memcpy (packet, spi_packet, MCP2210_PACKET_SIZE);
+			ret = mcp2210_command (fd, packet, MCP2210_SPI_SET);
+			if (ret < 0)
+				break;
+		}
+
+		ret = spi_transfer (fd, spi_packet, &data[off], n, expect ? &expect[off] : NULL, crc);
+		if (ret < 0)
+			break;
+	}
+
+	if (hold) {
+		ret2 = mcp2210_spi_cs_hold (fd, chip_packet, spi_packet, 0);
+		if (ret == 0)
+			ret = ret2;
+	}
+
+	return ret;
+}
+
+int
+mcp2210_spi_transfer_large (int fd, mcp2210_packet chip_packet, mcp2210_packet spi_packet,
+		char *data, size_t len)
+{
+	return spi_transfer_large (fd, chip_packet, spi_packet, data, len, NULL, NULL);
+}
+
+int
+mcp2210_spi_transfer_large_verify (int fd, mcp2210_packet chip_packet, mcp2210_packet spi_packet,
+		char *data, size_t len, const char *expect, unsigned int *crc)
+{
+	return spi_transfer_large (fd, chip_packet, spi_packet, data, len, expect, crc);
+}
+
+/*
+ * Compare two settings packets of the kind given by the NVRAM sub-command,
+ * looking only at the bytes that actually carry the settings. Runtime chip
+ * and SPI settings share the layout with their NVRAM counterparts. USB key
+ * packets can be in either the get or the set layout.
+ */
+
+int
+mcp2210_settings_cmp (mcp2210_packet a, mcp2210_packet b, unsigned short subcommand)
+{
+	unsigned short len;
+
+	switch (subcommand) {
+	case MCP2210_NVRAM_PARAM_SPI:
+		return memcmp (&a[4], &b[4], 17);
+	case MCP2210_NVRAM_PARAM_CHIP:
+		return memcmp (&a[4], &b[4], 15);
+	case MCP2210_NVRAM_PARAM_USB_KEY:
+		return mcp2210_usb_key_get_vid (a) != mcp2210_usb_key_get_vid (b)
+			|| mcp2210_usb_key_get_pid (a) != mcp2210_usb_key_get_pid (b)
+			|| mcp2210_usb_key_get_host_powered (a) != mcp2210_usb_key_get_host_powered (b)
+			|| mcp2210_usb_key_get_self_powered (a) != mcp2210_usb_key_get_self_powered (b)
+			|| mcp2210_usb_key_get_remote_wakeup (a) != mcp2210_usb_key_get_remote_wakeup (b)
+			|| mcp2210_usb_key_get_current_2ma (a) != mcp2210_usb_key_get_current_2ma (b);
+	case MCP2210_NVRAM_PARAM_PRODUCT:
+	case MCP2210_NVRAM_PARAM_MANUFACT:
+		if (a[4] != b[4])
+			return 1;
+		/* The length comes from the packet; it may not be sane. */
+		if (a[4] < 2)
+			return 0;
+		len = mcp2210_usb_string_get_len (a);
+		if (len > MCP2210_PACKET_SIZE - 6)
+			len = MCP2210_PACKET_SIZE - 6;
+		return memcmp (mcp2210_usb_string_get (a), mcp2210_usb_string_get (b), len);
+	}
+
+	return memcmp (a, b, MCP2210_PACKET_SIZE);
+}
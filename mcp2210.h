@@ -23,11 +23,17 @@
 #define __MCP2210_H
 
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define MCP2210_PACKET_SIZE		64
 #define MCP2210_SPI_TX_MAX		65535
 #define MCP2210_SPI_CHUNK		58
+#define MCP2210_FLASH_PAGE		4096
 #define MCP2210_GPIO_PINS		8
 #define MCP2210_USB_STRING		58
 #define MCP2210_PASSWORD_LEN		8
@@ -100,17 +106,473 @@
 #define MCP2210_EBADSUBCMD		0x104
 #define MCP2210_EBADADDR		0x105
 #define MCP2210_EBADTXSTAT		0x106
+#define MCP2210_EVERIFY			0x107
+#define MCP2210_ECANCELED		0x108
 
 typedef unsigned char mcp2210_packet[MCP2210_PACKET_SIZE];
 
+/* Device state snapshot sections.  */
+
+#define MCP2210_STATE_STATUS		0
+#define MCP2210_STATE_SPI		1
+#define MCP2210_STATE_GPIO_VAL		2
+#define MCP2210_STATE_GPIO_DIR		3
+#define MCP2210_STATE_CHIP		4
+#define MCP2210_STATE_NVRAM_SPI		5
+#define MCP2210_STATE_NVRAM_CHIP	6
+#define MCP2210_STATE_NVRAM_USB_KEY	7
+#define MCP2210_STATE_NVRAM_PRODUCT	8
+#define MCP2210_STATE_NVRAM_MANUFACT	9
+#define MCP2210_STATE_PACKETS		10
+#define MCP2210_STATE_EEPROM		10
+
+#define MCP2210_STATE_MAGIC		"M2ST"
+#define MCP2210_STATE_VERSION		1
+#define MCP2210_EEPROM_SIZE		256
+
+/*
+ * The snapshot consists of bytes only, so that it has the same layout
+ * everywhere and can be written out and mapped back as it is.
+ */
+
+struct mcp2210_state {
+	char magic[4];
+	unsigned char version;
+	unsigned char has_eeprom;
+	unsigned char reserved[10];
+	mcp2210_packet packets[MCP2210_STATE_PACKETS];
+	unsigned char eeprom[MCP2210_EEPROM_SIZE];
+};
+
+/* Report trace file.  */
+
+#define MCP2210_TRACE_MAGIC		"M2TR"
+#define MCP2210_TRACE_VERSION		1
+#define MCP2210_TRACE_WRITE		'w'
+#define MCP2210_TRACE_READ		'r'
+
+/*
+ * The trace file is a header followed by a ring of records. The count is
+ * the total number of records ever written; only the last "records" of
+ * them are kept. The fields are in the host byte order.
+ */
+
+struct mcp2210_trace_header {
+	char magic[4];
+	unsigned int version;
+	unsigned int records;
+	unsigned int reserved;
+	unsigned long long count;
+};
+
+struct mcp2210_trace_record {
+	unsigned long long time_ns;
+	int fd;
+	int result;
+	unsigned char dir;
+	unsigned char reserved[7];
+	mcp2210_packet packet;
+};
+
+extern struct mcp2210_trace_header *mcp2210_trace;
+
+/*
+ * A transport moves whole reports to and from the device. The calls return
+ * MCP2210_PACKET_SIZE or -1 with errno set, as the hidraw read() and write()
+ * do. Up to depth reports can be written before reading the responses.
+ */
+
+struct mcp2210_transport {
+	const char *name;
+	int depth;
+	ssize_t (*write) (int fd, void *priv, const mcp2210_packet packet);
+	ssize_t (*read) (int fd, void *priv, mcp2210_packet packet);
+	int (*close) (int fd, void *priv);
+};
+
+extern const struct mcp2210_transport mcp2210_hidraw_transport;
+extern const struct mcp2210_transport mcp2210_socket_transport;
+
+struct mcp2210_ring;
+
+/*
+ * Cancellation token. Requesting the cancellation is safe from another
+ * thread or from a signal handler.
+ */
+
+struct mcp2210_cancel {
+	int requested;
+};
+
+static inline void
+mcp2210_cancel_request (struct mcp2210_cancel *cancel)
+{
+	__atomic_store_n (&cancel->requested, 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+mcp2210_cancel_reset (struct mcp2210_cancel *cancel)
+{
+	__atomic_store_n (&cancel->requested, 0, __ATOMIC_RELEASE);
+}
+
+static inline int
+mcp2210_cancel_requested (struct mcp2210_cancel *cancel)
+{
+	return __atomic_load_n (&cancel->requested, __ATOMIC_ACQUIRE);
+}
+
+/* Wakeup latency statistics, see mcp2210_rt_get_stats().  */
+
+struct mcp2210_rt_stats {
+	unsigned long long wakeups;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+};
+
+/*
+ * SPI bus arbitration queue. The timeout_ms and release are settings, the
+ * waits, wait_ns and max_wait_ns are statistics on the time spent waiting
+ * for an external master to let go of the bus.
+ */
+
+struct mcp2210_bus_job;
+
+struct mcp2210_bus {
+	int timeout_ms;
+	int release;
+	unsigned int waits;
+	unsigned long long wait_ns;
+	unsigned long long max_wait_ns;
+	struct mcp2210_bus_job *head, *tail;
+};
+
+/*
+ * Register map of an SPI slave. The address of reg_bytes is followed by
+ * the values of val_bytes, both big endian, with read_flag or write_flag
+ * set in the address. With burst set the slave increments the address
+ * after each value.
+ */
+
+#define MCP2210_REG_VOLATILE		0x01
+#define MCP2210_REG_WRITE_ONLY		0x02
+#define MCP2210_REG_READ_ONLY		0x04
+
+struct mcp2210_regmap;
+
+struct mcp2210_reg_range {
+	unsigned int first;
+	unsigned int last;
+	unsigned int flags;
+};
+
+struct mcp2210_reg_default {
+	unsigned int reg;
+	unsigned int val;
+};
+
+struct mcp2210_regmap_config {
+	int reg_bytes;
+	int val_bytes;
+	unsigned int max_register;
+	unsigned int read_flag;
+	unsigned int write_flag;
+	int burst;
+	const struct mcp2210_reg_range *ranges;
+	int nranges;
+	const struct mcp2210_reg_default *defaults;
+	int ndefaults;
+};
+
+struct mcp2210_regmap_stats {
+	unsigned long long transfers;
+	unsigned long long bytes;
+	unsigned long long hits;
+};
+
+/* Device state shared with other processes, see libmcp2210_shm(3).  */
+
+#define MCP2210_SHM_MAGIC		"M2SH"
+#define MCP2210_SHM_VERSION		1
+
+#define MCP2210_SHM_STATUS		0
+#define MCP2210_SHM_GPIO_VAL		1
+#define MCP2210_SHM_GPIO_DIR		2
+#define MCP2210_SHM_CHIP		3
+#define MCP2210_SHM_SPI			4
+#define MCP2210_SHM_GP6_COUNT		5
+#define MCP2210_SHM_SECTIONS		6
+
+/*
+ * The latest response to each of the GET commands, taken at time_ns on the
+ * CLOCK_MONOTONIC clock. The sections change together, while seq is odd.
+ */
+
+struct mcp2210_shm_section {
+	unsigned long long time_ns;
+	int result;
+	unsigned int reserved;
+	mcp2210_packet packet;
+};
+
+struct mcp2210_shm {
+	char magic[4];
+	unsigned int version;
+	unsigned int seq;
+	unsigned int reserved;
+	unsigned long long updates;
+	struct mcp2210_shm_section sections[MCP2210_SHM_SECTIONS];
+};
+
+/* Tracking of devices across resets, see libmcp2210_hotplug(3).  */
+
+struct mcp2210_hotplug;
+
+struct mcp2210_device_id {
+	unsigned short vendor;
+	unsigned short product;
+	char serial[64];
+};
+
+struct mcp2210_hotplug_stats {
+	unsigned int reconnects;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+};
+
+/* SPI flash read through a page cache, see libmcp2210_flash(3).  */
+
+struct mcp2210_flash;
+
+struct mcp2210_flash_stats {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long transfers;
+	unsigned long long pages;
+	unsigned long long evictions;
+};
+
+/* Key/value store in the user EEPROM, see libmcp2210_kv(3).  */
+
+#define MCP2210_KV_KEYS			255
+#define MCP2210_KV_VALUE_MAX		122
+
+struct mcp2210_kv;
+
+struct mcp2210_kv_stats {
+	unsigned long long appends;
+	unsigned long long compactions;
+	unsigned long long batches;
+	unsigned long long written;
+	unsigned long long unchanged;
+};
+
+/* Settings cached across sessions, see libmcp2210_cache(3).  */
+
+struct mcp2210_cache;
+
+struct mcp2210_cache_stats {
+	unsigned long long generation;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long probes;
+	unsigned long long invalidations;
+};
+
+/* Periodic transfers to multiple slaves, see libmcp2210_sched(3).  */
+
+#define MCP2210_SCHED_SLOTS_MAX		(1 << 20)
+
+struct mcp2210_sched;
+
+struct mcp2210_sched_job {
+	unsigned int period_us;
+	mcp2210_packet spi_packet;
+	const void *tx;
+	unsigned short len;
+	unsigned int samples;
+};
+
+struct mcp2210_sched_sample {
+	unsigned long long time_ns;
+	int result;
+	unsigned short len;
+	unsigned short reserved;
+};
+
+struct mcp2210_sched_stats {
+	unsigned long long runs;
+	unsigned long long missed;
+	unsigned long long sets;
+	unsigned long long errors;
+	unsigned long long dropped;
+	unsigned long long jitter_total_ns;
+	unsigned long long jitter_max_ns;
+};
+
+/* Capture files, see libmcp2210_capture(3).  */
+
+#define MCP2210_CAPTURE_MAGIC		"M2CP"
+#define MCP2210_CAPTURE_CHUNK_MAGIC	"M2CK"
+#define MCP2210_CAPTURE_VERSION		1
+#define MCP2210_CAPTURE_COMPRESS	1
+#define MCP2210_CAPTURE_CHUNK		(1 << 20)
+#define MCP2210_CAPTURE_SPI		's'
+#define MCP2210_CAPTURE_GPIO		'g'
+
+/*
+ * The capture file is a header, the chunks of records, each with a chunk
+ * header, and an index of the chunks. The index offset is zero until the
+ * capture is closed. The fields are in the host byte order.
+ */
+
+struct mcp2210_capture;
+
+struct mcp2210_capture_header {
+	char magic[4];
+	unsigned int version;
+	unsigned int flags;
+	unsigned int reserved;
+	unsigned long long index_offset;
+	unsigned long long chunks;
+};
+
+struct mcp2210_capture_chunk {
+	char magic[4];
+	unsigned int flags;
+	unsigned int size;
+	unsigned int raw_size;
+	unsigned int records;
+	unsigned int crc;
+	unsigned long long first_ns;
+	unsigned long long last_ns;
+};
+
+struct mcp2210_capture_index {
+	unsigned long long offset;
+	unsigned long long first_ns;
+	unsigned long long last_ns;
+};
+
+struct mcp2210_capture_record {
+	unsigned long long time_ns;
+	unsigned int len;
+	unsigned short device;
+	unsigned short cs;
+	unsigned short job;
+	unsigned char type;
+	unsigned char reserved[5];
+};
+
 const char *mcp2210_strerror (int mcp2210_errno);
+int mcp2210_open (const char *path);
+int mcp2210_close (int fd);
+int mcp2210_socket (const char *addr, int listening);
+int mcp2210_libusb_open (const char *spec);
+int mcp2210_set_transport (int fd, const struct mcp2210_transport *ops, void *priv);
+const struct mcp2210_transport *mcp2210_get_transport (int fd, void **priv);
+int mcp2210_set_cancel (int fd, struct mcp2210_cancel *cancel);
+int mcp2210_cancelled (int fd);
+ssize_t mcp2210_write_report (int fd, const mcp2210_packet packet);
+ssize_t mcp2210_read_report (int fd, mcp2210_packet packet);
+int mcp2210_commands (int fd, mcp2210_packet *packets, int n);
+struct mcp2210_ring *mcp2210_ring_new (unsigned int commands);
+void mcp2210_ring_free (struct mcp2210_ring *ring);
+int mcp2210_ring_commands (struct mcp2210_ring *ring, const int *fds, mcp2210_packet *packets, int *results, int n);
 int mcp2210_command (int fd, mcp2210_packet packet, unsigned short command);
 int mcp2210_subcommand (int fd, mcp2210_packet packet, unsigned short command, unsigned short subcommand);
 int mcp2210_read_eeprom (int fd, mcp2210_packet packet, unsigned short addr);
 int mcp2210_write_eeprom (int fd, mcp2210_packet packet, unsigned short addr, unsigned short val);
 int mcp2210_unlock_eeprom (int fd, mcp2210_packet packet, const char *passwd);
 int mcp2210_gp6_count_get (int fd, mcp2210_packet packet, unsigned short no_reset);
-int mcp2210_spi_transfer (int fd, mcp2210_packet spi_packet, char *data, short len);
+int mcp2210_spi_transfer (int fd, mcp2210_packet spi_packet, char *data, unsigned short len);
+int mcp2210_spi_transfer_verify (int fd, mcp2210_packet spi_packet, char *data, unsigned short len, const char *expect, unsigned int *crc);
+int mcp2210_spi_apply (int fd, mcp2210_packet spi_packet);
+void mcp2210_spi_forget (int fd);
+int mcp2210_spi_cancel (int fd);
+int mcp2210_spi_cs_hold (int fd, mcp2210_packet chip_packet, mcp2210_packet spi_packet, int hold);
+int mcp2210_spi_autotune (int fd, mcp2210_packet spi_packet, const char *tx, const char *expect, unsigned short len, int rounds, int margin);
+int mcp2210_spi_transfer_large (int fd, mcp2210_packet chip_packet, mcp2210_packet spi_packet, char *data, size_t len);
+int mcp2210_spi_transfer_large_verify (int fd, mcp2210_packet chip_packet, mcp2210_packet spi_packet, char *data, size_t len, const char *expect, unsigned int *crc);
+int mcp2210_spi_transfer_stream (int fd, mcp2210_packet chip_packet, mcp2210_packet spi_packet, int in_fd, int out_fd);
+struct mcp2210_regmap *mcp2210_regmap_new (int fd, mcp2210_packet spi_packet, const struct mcp2210_regmap_config *config);
+void mcp2210_regmap_free (struct mcp2210_regmap *map);
+int mcp2210_regmap_read (struct mcp2210_regmap *map, unsigned int reg, unsigned int *val);
+int mcp2210_regmap_write (struct mcp2210_regmap *map, unsigned int reg, unsigned int val);
+int mcp2210_regmap_update_bits (struct mcp2210_regmap *map, unsigned int reg, unsigned int mask, unsigned int val);
+int mcp2210_regmap_bulk_read (struct mcp2210_regmap *map, unsigned int reg, unsigned int *vals, unsigned int n);
+int mcp2210_regmap_bulk_write (struct mcp2210_regmap *map, unsigned int reg, const unsigned int *vals, unsigned int n);
+void mcp2210_regmap_cache_only (struct mcp2210_regmap *map, int enable);
+void mcp2210_regmap_mark_dirty (struct mcp2210_regmap *map);
+int mcp2210_regmap_sync (struct mcp2210_regmap *map);
+void mcp2210_regmap_invalidate (struct mcp2210_regmap *map);
+void mcp2210_regmap_get_stats (struct mcp2210_regmap *map, struct mcp2210_regmap_stats *stats);
+struct mcp2210_shm *mcp2210_shm_create (const char *path);
+const struct mcp2210_shm *mcp2210_shm_open (const char *path);
+void mcp2210_shm_close (const struct mcp2210_shm *shm);
+void mcp2210_shm_publish (struct mcp2210_shm *shm, const mcp2210_packet *packets, const int *results, unsigned int sections);
+int mcp2210_shm_poll (int fd, struct mcp2210_shm *shm, unsigned int sections);
+unsigned long long mcp2210_shm_read (const struct mcp2210_shm *shm, struct mcp2210_shm_section *sections);
+int mcp2210_device_id (int fd, struct mcp2210_device_id *id);
+struct mcp2210_hotplug *mcp2210_hotplug_new (int timeout_ms);
+void mcp2210_hotplug_free (struct mcp2210_hotplug *hp);
+int mcp2210_hotplug_add (struct mcp2210_hotplug *hp, int fd);
+void mcp2210_hotplug_get_stats (struct mcp2210_hotplug *hp, struct mcp2210_hotplug_stats *stats);
+struct mcp2210_flash *mcp2210_flash_open (int fd, mcp2210_packet spi_packet, unsigned long long size, unsigned int pages, unsigned int readahead);
+void mcp2210_flash_close (struct mcp2210_flash *flash);
+int mcp2210_flash_page (struct mcp2210_flash *flash, unsigned long long offset, const void **data);
+int mcp2210_flash_read (struct mcp2210_flash *flash, unsigned long long offset, void *buf, size_t len);
+void mcp2210_flash_invalidate (struct mcp2210_flash *flash);
+void mcp2210_flash_get_stats (struct mcp2210_flash *flash, struct mcp2210_flash_stats *stats);
+int mcp2210_kv_open (int fd, int create, struct mcp2210_kv **kvp);
+void mcp2210_kv_close (struct mcp2210_kv *kv);
+int mcp2210_kv_get (struct mcp2210_kv *kv, unsigned int key, void *buf, size_t size);
+int mcp2210_kv_set (struct mcp2210_kv *kv, unsigned int key, const void *val, size_t len);
+int mcp2210_kv_delete (struct mcp2210_kv *kv, unsigned int key);
+int mcp2210_kv_next (struct mcp2210_kv *kv, int key);
+void mcp2210_kv_get_stats (struct mcp2210_kv *kv, struct mcp2210_kv_stats *stats);
+struct mcp2210_sched *mcp2210_sched_new (int fd, const struct mcp2210_sched_job *jobs, int njobs);
+void mcp2210_sched_free (struct mcp2210_sched *sched);
+int mcp2210_sched_run (struct mcp2210_sched *sched, unsigned long long cycles);
+int mcp2210_sched_read (struct mcp2210_sched *sched, int job, struct mcp2210_sched_sample *sample, void *data);
+void mcp2210_sched_get_stats (struct mcp2210_sched *sched, int job, struct mcp2210_sched_stats *stats, int reset);
+unsigned int mcp2210_sched_changes (struct mcp2210_sched *sched, unsigned int *slots);
+struct mcp2210_capture *mcp2210_capture_create (const char *path, unsigned int flags, size_t chunk_size);
+int mcp2210_capture_write (struct mcp2210_capture *cap, const struct mcp2210_capture_record *rec, const void *data);
+int mcp2210_capture_flush (struct mcp2210_capture *cap);
+int mcp2210_capture_close (struct mcp2210_capture *cap);
+struct mcp2210_capture *mcp2210_capture_open (const char *path);
+const struct mcp2210_capture_index *mcp2210_capture_get_index (struct mcp2210_capture *cap, unsigned long long *chunks);
+void mcp2210_capture_seek (struct mcp2210_capture *cap, unsigned long long time_ns);
+int mcp2210_capture_read (struct mcp2210_capture *cap, struct mcp2210_capture_record *rec, const void **data);
+struct mcp2210_cache *mcp2210_cache_open (int fd, const char *dir);
+int mcp2210_cache_get (struct mcp2210_cache *cache, int section, mcp2210_packet packet);
+void mcp2210_cache_put (struct mcp2210_cache *cache, int section, const mcp2210_packet packet);
+void mcp2210_cache_get_stats (struct mcp2210_cache *cache, struct mcp2210_cache_stats *stats);
+int mcp2210_cache_close (struct mcp2210_cache *cache);
+int mcp2210_rt_setup (const int *cpus, int ncpus, int priority, int lock);
+void mcp2210_rt_deadline (struct timespec *deadline, unsigned long long ns);
+void mcp2210_rt_sleep_until (const struct timespec *deadline);
+void mcp2210_rt_get_stats (struct mcp2210_rt_stats *stats, int reset);
+unsigned int mcp2210_crc32 (unsigned int crc, const void *data, size_t len);
+unsigned int mcp2210_crc32c (unsigned int crc, const void *data, size_t len);
+int mcp2210_bus_wait (int fd, mcp2210_packet status_packet, int timeout_ms);
+int mcp2210_bus_release (int fd, int ack);
+void mcp2210_bus_init (struct mcp2210_bus *bus, int timeout_ms, int release);
+int mcp2210_bus_queue (struct mcp2210_bus *bus, int (*run) (int fd, void *data), void *data);
+int mcp2210_bus_run (struct mcp2210_bus *bus, int fd);
+void mcp2210_bus_clear (struct mcp2210_bus *bus);
+int mcp2210_settings_cmp (mcp2210_packet a, mcp2210_packet b, unsigned short subcommand);
+int mcp2210_state_get (int fd, struct mcp2210_state *state, int eeprom);
+unsigned int mcp2210_state_diff (struct mcp2210_state *a, struct mcp2210_state *b);
+int mcp2210_state_restore (int fd, struct mcp2210_state *cur, struct mcp2210_state *want);
+int mcp2210_trace_open (const char *path, unsigned int records);
+void mcp2210_trace_close (void);
+void mcp2210_trace_packet (int fd, unsigned char dir, int result, const mcp2210_packet packet);
+struct mcp2210_trace_header *mcp2210_trace_map (const char *path);
+void mcp2210_trace_unmap (struct mcp2210_trace_header *trace);
+int mcp2210_trace_next (const struct mcp2210_trace_header *trace, unsigned long long *n, struct mcp2210_trace_record **w, struct mcp2210_trace_record **r);
+int mcp2210_trace_serve (int fd, const struct mcp2210_trace_header *trace);
 
 /*
  * mcp2210_command() wrappers that do some extra bits if necessary, such as set
@@ -137,6 +599,35 @@ mcp2210_set_nvram (int fd, mcp2210_packet packet, unsigned short subcommand)
 	return mcp2210_subcommand (fd, packet, MCP2210_NVRAM_SET, subcommand);
 }
 
+/*
+ * Check whether a snapshot (perhaps read from a file) is in the format
+ * we understand.
+ */
+
+static inline int
+mcp2210_state_valid (const struct mcp2210_state *state)
+{
+	return memcmp (state->magic, MCP2210_STATE_MAGIC, sizeof (state->magic)) == 0
+		&& state->version == MCP2210_STATE_VERSION;
+}
+
+/*
+ * Iterate the records that are still in the trace ring, from the
+ * oldest one: for (n = mcp2210_trace_first (t); n < t->count; n++)
+ */
+
+static inline unsigned long long
+mcp2210_trace_first (const struct mcp2210_trace_header *trace)
+{
+	return trace->count > trace->records ? trace->count - trace->records : 0;
+}
+
+static inline struct mcp2210_trace_record *
+mcp2210_trace_record (const struct mcp2210_trace_header *trace, unsigned long long n)
+{
+	return (struct mcp2210_trace_record *)(trace + 1) + n % trace->records;
+}
+
 /*
  * Utility functions for getting information from Status packets (section 3.6).
  * Issue a MCP2210_STATUS_GET command to fill the packet buffer.
@@ -620,4 +1111,8 @@ mcp2210_usb_string_set (mcp2210_packet packet, const char *string, short len)
 	packet[4] = len + 2;
 }
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* defined(__MCP2210_H) */
@@ -0,0 +1,632 @@
+/*
+ * MCP2210 USB SPI bridge library, C++ interface
+ * Copyright (C) 2016  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * Implements the protocol and functionality described here:
+ * http://ww1.microchip.com/downloads/en/DeviceDoc/22288A.pdf
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MCP2210_HPP
+#define __MCP2210_HPP
+
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "mcp2210.h"
+
+namespace mcp2210 {
+
+/*
+ * A device error, one of the MCP2210_E* codes. Failed system calls are
+ * reported with std::system_error instead.
+ */
+
+class error : public std::runtime_error {
+public:
+	explicit error (int code)
+		: std::runtime_error (mcp2210_strerror (-code)), code_ (code) {}
+
+	int
+	code () const noexcept
+	{
+		return code_;
+	}
+
+private:
+	int code_;
+};
+
+/*
+ * Turn a return value of the C interface into an exception.
+ */
+
+inline int
+check (int ret)
+{
+	if (ret == -1)
+		throw std::system_error (errno, std::generic_category ());
+	if (ret < 0)
+		throw error (-ret);
+	return ret;
+}
+
+/*
+ * The packets are laid out exactly like a mcp2210_packet, so that they can
+ * be handed to the C routines as they are and the accessors compile to the
+ * same code as their C counterparts. Each packet type knows the commands
+ * that read and write it; zero stands for a command that doesn't exist.
+ */
+
+template <unsigned char Get, unsigned char Set>
+class packet {
+public:
+	static constexpr unsigned char get_command = Get;
+	static constexpr unsigned char set_command = Set;
+
+	constexpr packet () noexcept : bytes_ {} {}
+
+	unsigned char *
+	raw () noexcept
+	{
+		return bytes_;
+	}
+
+	const unsigned char *
+	raw () const noexcept
+	{
+		return bytes_;
+	}
+
+	constexpr unsigned char
+	operator[] (std::size_t i) const noexcept
+	{
+		return bytes_[i];
+	}
+
+protected:
+	constexpr unsigned int
+	le16 (std::size_t i) const noexcept
+	{
+		return bytes_[i] | bytes_[i + 1] << 8;
+	}
+
+	constexpr void
+	set_le16 (std::size_t i, unsigned int val) noexcept
+	{
+		bytes_[i] = val & 0xff;
+		bytes_[i + 1] = (val >> 8) & 0xff;
+	}
+
+	constexpr bool
+	bit (std::size_t i, unsigned int pin) const noexcept
+	{
+		return (le16 (i) >> pin) & 1;
+	}
+
+	constexpr void
+	set_bit (std::size_t i, unsigned int pin, bool val) noexcept
+	{
+		if (val)
+			bytes_[i + pin / 8] |= 1 << pin % 8;
+		else
+			bytes_[i + pin / 8] &= ~(1 << pin % 8);
+	}
+
+	mcp2210_packet bytes_;
+};
+
+/*
+ * Status packets (section 3.6).
+ */
+
+class status : public packet<MCP2210_STATUS_GET, 0> {
+public:
+	constexpr unsigned int
+	no_ext_request () const noexcept
+	{
+		return bytes_[2];
+	}
+
+	constexpr unsigned int
+	bus_owner () const noexcept
+	{
+		return bytes_[3];
+	}
+
+	constexpr unsigned int
+	password_count () const noexcept
+	{
+		return bytes_[4];
+	}
+
+	constexpr bool
+	password_guessed () const noexcept
+	{
+		return bytes_[5];
+	}
+};
+
+/*
+ * Chip settings, at runtime and as power-up defaults in the NVRAM.
+ */
+
+class chip_settings : public packet<MCP2210_CHIP_GET, MCP2210_CHIP_SET> {
+public:
+	static constexpr unsigned char nvram_param = MCP2210_NVRAM_PARAM_CHIP;
+
+	constexpr unsigned int
+	function (unsigned int pin) const noexcept
+	{
+		return bytes_[4 + pin];
+	}
+
+	constexpr chip_settings &
+	set_function (unsigned int pin, unsigned int func) noexcept
+	{
+		bytes_[4 + pin] = func;
+		return *this;
+	}
+
+	constexpr bool
+	default_output (unsigned int pin) const noexcept
+	{
+		return bit (13, pin);
+	}
+
+	constexpr chip_settings &
+	set_default_output (unsigned int pin, bool val) noexcept
+	{
+		set_bit (13, pin, val);
+		return *this;
+	}
+
+	constexpr bool
+	default_direction (unsigned int pin) const noexcept
+	{
+		return bit (15, pin);
+	}
+
+	constexpr chip_settings &
+	set_default_direction (unsigned int pin, bool val) noexcept
+	{
+		set_bit (15, pin, val);
+		return *this;
+	}
+
+	constexpr bool
+	wakeup () const noexcept
+	{
+		return bytes_[17] & 0x10;
+	}
+
+	constexpr chip_settings &
+	set_wakeup (bool enabled) noexcept
+	{
+		bytes_[17] = (bytes_[17] & ~0x10) | enabled << 4;
+		return *this;
+	}
+
+	constexpr unsigned int
+	gp6_mode () const noexcept
+	{
+		return (bytes_[17] >> 1) & 7;
+	}
+
+	constexpr chip_settings &
+	set_gp6_mode (unsigned int mode) noexcept
+	{
+		bytes_[17] = (bytes_[17] & ~0xe) | mode << 1;
+		return *this;
+	}
+
+	constexpr bool
+	no_spi_release () const noexcept
+	{
+		return bytes_[17] & 0x1;
+	}
+
+	constexpr chip_settings &
+	set_no_spi_release (bool no_release) noexcept
+	{
+		bytes_[17] = (bytes_[17] & ~0x1) | no_release;
+		return *this;
+	}
+
+	constexpr unsigned int
+	access_control () const noexcept
+	{
+		return bytes_[18];
+	}
+
+	constexpr chip_settings &
+	set_access_control (unsigned int setting) noexcept
+	{
+		bytes_[18] = setting;
+		return *this;
+	}
+
+	constexpr chip_settings &
+	set_access_password (const char *passwd) noexcept
+	{
+		for (int i = 0; i < 8; i++)
+			bytes_[19 + i] = passwd[i];
+		return *this;
+	}
+};
+
+/*
+ * GPIO pin values and directions. They share the layout, but are
+ * distinct types so that one can't be written with the other's command.
+ */
+
+template <unsigned char Get, unsigned char Set>
+class gpio_pins : public packet<Get, Set> {
+public:
+	constexpr bool
+	pin (unsigned int pin) const noexcept
+	{
+		return this->bit (4, pin);
+	}
+
+	constexpr gpio_pins &
+	set_pin (unsigned int pin, bool val) noexcept
+	{
+		this->set_bit (4, pin, val);
+		return *this;
+	}
+};
+
+using gpio_values = gpio_pins<MCP2210_GPIO_VAL_GET, MCP2210_GPIO_VAL_SET>;
+using gpio_directions = gpio_pins<MCP2210_GPIO_DIR_GET, MCP2210_GPIO_DIR_SET>;
+
+/*
+ * SPI settings, at runtime and as power-up defaults in the NVRAM.
+ */
+
+class spi_settings : public packet<MCP2210_SPI_GET, MCP2210_SPI_SET> {
+public:
+	static constexpr unsigned char nvram_param = MCP2210_NVRAM_PARAM_SPI;
+
+	constexpr long
+	bitrate () const noexcept
+	{
+		return bytes_[4] | bytes_[5] << 8 |
+			bytes_[6] << 16 | (long) bytes_[7] << 24;
+	}
+
+	constexpr spi_settings &
+	set_bitrate (long bitrate) noexcept
+	{
+		bytes_[4] = bitrate & 0xff;
+		bytes_[5] = (bitrate >> 8) & 0xff;
+		bytes_[6] = (bitrate >> 16) & 0xff;
+		bytes_[7] = (bitrate >> 24) & 0xff;
+		return *this;
+	}
+
+	constexpr bool
+	active_cs (unsigned int pin) const noexcept
+	{
+		return bit (8, pin);
+	}
+
+	constexpr spi_settings &
+	set_active_cs (unsigned int pin, bool val) noexcept
+	{
+		set_bit (8, pin, val);
+		return *this;
+	}
+
+	constexpr bool
+	idle_cs (unsigned int pin) const noexcept
+	{
+		return bit (10, pin);
+	}
+
+	constexpr spi_settings &
+	set_idle_cs (unsigned int pin, bool val) noexcept
+	{
+		set_bit (10, pin, val);
+		return *this;
+	}
+
+	constexpr unsigned int
+	cs_data_delay_100us () const noexcept
+	{
+		return le16 (12);
+	}
+
+	constexpr spi_settings &
+	set_cs_data_delay_100us (unsigned int delay_100us) noexcept
+	{
+		set_le16 (12, delay_100us);
+		return *this;
+	}
+
+	constexpr unsigned int
+	data_cs_delay_100us () const noexcept
+	{
+		return le16 (14);
+	}
+
+	constexpr spi_settings &
+	set_data_cs_delay_100us (unsigned int delay_100us) noexcept
+	{
+		set_le16 (14, delay_100us);
+		return *this;
+	}
+
+	constexpr unsigned int
+	byte_delay_100us () const noexcept
+	{
+		return le16 (16);
+	}
+
+	constexpr spi_settings &
+	set_byte_delay_100us (unsigned int delay_100us) noexcept
+	{
+		set_le16 (16, delay_100us);
+		return *this;
+	}
+
+	constexpr unsigned int
+	transaction_size () const noexcept
+	{
+		return le16 (18);
+	}
+
+	constexpr spi_settings &
+	set_transaction_size (unsigned int size) noexcept
+	{
+		set_le16 (18, size);
+		return *this;
+	}
+
+	constexpr unsigned int
+	mode () const noexcept
+	{
+		return bytes_[20];
+	}
+
+	constexpr spi_settings &
+	set_mode (unsigned int mode) noexcept
+	{
+		bytes_[20] = mode;
+		return *this;
+	}
+};
+
+static_assert (sizeof (spi_settings) == MCP2210_PACKET_SIZE &&
+	       std::is_standard_layout<spi_settings>::value,
+	       "packets must be laid out like mcp2210_packet");
+
+/*
+ * A transfer buffer. It can be moved, but not copied, so that the data
+ * handed to a transfer comes back without being copied around.
+ */
+
+class buffer {
+public:
+	buffer () noexcept = default;
+
+	explicit buffer (std::size_t size)
+		: data_ (new char[size] ()), size_ (size) {}
+
+	buffer (const void *data, std::size_t size)
+		: buffer (size)
+	{
+		std::memcpy (data_.get (), data, size);
+	}
+
+	buffer (buffer &&other) noexcept
+		: data_ (std::move (other.data_)),
+		  size_ (std::exchange (other.size_, 0)) {}
+
+	buffer &
+	operator= (buffer &&other) noexcept
+	{
+		data_ = std::move (other.data_);
+		size_ = std::exchange (other.size_, 0);
+		return *this;
+	}
+
+	char *
+	data () noexcept
+	{
+		return data_.get ();
+	}
+
+	const char *
+	data () const noexcept
+	{
+		return data_.get ();
+	}
+
+	std::size_t
+	size () const noexcept
+	{
+		return size_;
+	}
+
+	char &
+	operator[] (std::size_t i) noexcept
+	{
+		return data_[i];
+	}
+
+	char
+	operator[] (std::size_t i) const noexcept
+	{
+		return data_[i];
+	}
+
+private:
+	std::unique_ptr<char[]> data_;
+	std::size_t size_ = 0;
+};
+
+/*
+ * An open device, closed when it goes out of scope. The failures are
+ * thrown as exceptions, see check().
+ */
+
+class device {
+public:
+	explicit device (const char *path)
+		: fd_ (check (mcp2210_open (path))) {}
+
+	/* Adopts a descriptor opened with the C interface. */
+	explicit device (int fd) noexcept
+		: fd_ (fd) {}
+
+	device (const device &) = delete;
+	device &operator= (const device &) = delete;
+
+	device (device &&other) noexcept
+		: fd_ (other.release ()) {}
+
+	device &
+	operator= (device &&other) noexcept
+	{
+		if (this != &other) {
+			reset ();
+			fd_ = other.release ();
+		}
+		return *this;
+	}
+
+	~device ()
+	{
+		reset ();
+	}
+
+	int
+	fd () const noexcept
+	{
+		return fd_;
+	}
+
+	/* Gives up the descriptor without closing it. */
+	int
+	release () noexcept
+	{
+		return std::exchange (fd_, -1);
+	}
+
+	template <class P>
+	P
+	get ()
+	{
+		static_assert (P::get_command != 0, "the packet can't be read");
+		P p;
+
+		check (mcp2210_command (fd_, p.raw (), P::get_command));
+		return p;
+	}
+
+	/* The device overwrites the packet with its response. */
+	template <class P>
+	void
+	set (P p)
+	{
+		static_assert (P::set_command != 0, "the packet can't be written");
+
+		check (mcp2210_command (fd_, p.raw (), P::set_command));
+	}
+
+	template <class P>
+	P
+	get_nvram ()
+	{
+		P p;
+
+		check (mcp2210_get_nvram (fd_, p.raw (), P::nvram_param));
+		return p;
+	}
+
+	template <class P>
+	void
+	set_nvram (P p)
+	{
+		check (mcp2210_set_nvram (fd_, p.raw (), P::nvram_param));
+	}
+
+	/*
+	 * A single transaction. The transaction size is issued along with
+	 * the rest of spi only if it differs from the one in it.
+	 */
+	buffer
+	transfer (spi_settings &spi, buffer data)
+	{
+		if (data.size () > MCP2210_SPI_TX_MAX)
+			throw std::system_error (EMSGSIZE, std::generic_category ());
+		set_transaction_size (spi, data.size ());
+		check (mcp2210_spi_transfer (fd_, spi.raw (), data.data (), data.size ()));
+		return data;
+	}
+
+	/* A transfer of any length, split into transactions as needed. */
+	buffer
+	transfer (chip_settings &chip, spi_settings &spi, buffer data)
+	{
+		check (mcp2210_spi_transfer_large (fd_, chip.raw (), spi.raw (),
+						   data.data (), data.size ()));
+		return data;
+	}
+
+	/* A transaction of a size known at compile time, kept on the stack. */
+	template <std::size_t N>
+	std::array<char, N>
+	transfer (spi_settings &spi, std::array<char, N> data)
+	{
+		static_assert (N > 0 && N <= MCP2210_SPI_TX_MAX,
+			       "the transaction is too large");
+
+		set_transaction_size (spi, N);
+		check (mcp2210_spi_transfer (fd_, spi.raw (), data.data (), N));
+		return data;
+	}
+
+private:
+	void
+	set_transaction_size (spi_settings &spi, unsigned int size)
+	{
+		if (spi.transaction_size () == size)
+			return;
+		spi.set_transaction_size (size);
+		set (spi);
+	}
+
+	void
+	reset () noexcept
+	{
+		if (fd_ != -1)
+			mcp2210_close (std::exchange (fd_, -1));
+	}
+
+	int fd_;
+};
+
+} /* namespace mcp2210 */
+
+#endif /* defined(__MCP2210_HPP) */